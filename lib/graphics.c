@@ -10,6 +10,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+// How long the garbage collector may run in each frame
+#define FLUX_GC_FRAME_BUDGET_US 2000
+
 static char output_image_path[1024];
 static char flux_thumbnail_str[100];
 
@@ -636,6 +639,11 @@ void flux_graphics_loop_start(FluxWindow window, MescheRepl *repl) {
     // Swap the render buffers
     glfwSwapBuffers(glfwWindow);
 
+    // Advance any unfinished garbage collection while the frame is on screen
+    if (repl != NULL) {
+      mesche_mem_gc_step((MescheMemory *)repl->vm, FLUX_GC_FRAME_BUDGET_US);
+    }
+
     // Render the screen to a file if requested and the window isn't waiting for resize
     if (output_image_path[0] != '\0' && !window->is_resizing) {
       flux_log("Saving image to path: %s\n", output_image_path);
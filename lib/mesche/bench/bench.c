@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <mesche.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MAX_SCRIPTS 32
+
+// Usage: mesche-bench [-n iterations] [-r] script.msc...
+//
+// -r compiles the scripts to register instructions instead of plain stack
+// instructions so that both code generators can be compared.
+//
+// Each script is loaded into a fresh VM for every iteration so that
+// results are not skewed by state left over from a previous run.  After a
+// script finishes, a full collection is timed while its globals are still
+// alive to show the cost of marking the heap it built.
+
+typedef struct {
+  const char *script_path;
+  double best_ms;
+  double total_ms;
+  double best_gc_ms;
+  size_t bytes_allocated;
+  bool failed;
+} BenchResult;
+
+static double bench_time_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static void bench_run_script(BenchResult *result, int iterations, bool use_register_ops) {
+  result->best_ms = -1;
+  result->best_gc_ms = -1;
+  result->total_ms = 0;
+  result->failed = false;
+
+  for (int i = 0; i < iterations; i++) {
+    VM vm;
+    mesche_vm_init(&vm);
+    vm.use_register_ops = use_register_ops;
+    mesche_vm_load_path_add(&vm, "lib/mesche/modules/");
+
+    double start_ms = bench_time_ms();
+    InterpretResult interpret_result = mesche_vm_load_file(&vm, result->script_path);
+    double elapsed_ms = bench_time_ms() - start_ms;
+
+    result->bytes_allocated = vm.mem.bytes_allocated;
+    start_ms = bench_time_ms();
+    mesche_mem_collect_major(&vm.mem);
+    double gc_ms = bench_time_ms() - start_ms;
+    mesche_vm_free(&vm);
+
+    if (interpret_result != INTERPRET_OK) {
+      result->failed = true;
+      return;
+    }
+
+    result->total_ms += elapsed_ms;
+    if (result->best_ms < 0 || elapsed_ms < result->best_ms) {
+      result->best_ms = elapsed_ms;
+    }
+    if (result->best_gc_ms < 0 || gc_ms < result->best_gc_ms) {
+      result->best_gc_ms = gc_ms;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int iterations = 5;
+  bool use_register_ops = false;
+  int script_count = 0;
+  BenchResult results[BENCH_MAX_SCRIPTS];
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0) {
+      use_register_ops = true;
+    } else if (script_count < BENCH_MAX_SCRIPTS) {
+      results[script_count++].script_path = argv[i];
+    }
+  }
+
+  if (script_count == 0 || iterations < 1) {
+    printf("\nMesche Benchmarks\n\n  Usage: mesche-bench [-n iterations] [-r] script.msc...\n\n");
+    return 1;
+  }
+
+  for (int i = 0; i < script_count; i++) {
+    bench_run_script(&results[i], iterations, use_register_ops);
+  }
+
+  // Print the report after all scripts have run so that it isn't
+  // interleaved with script output
+  printf("\n\n%-40s %12s %12s %12s %14s\n", "script", "best (ms)", "mean (ms)", "gc (ms)",
+         "heap (bytes)");
+  for (int i = 0; i < script_count; i++) {
+    BenchResult *result = &results[i];
+    if (result->failed) {
+      printf("%-40s %12s\n", result->script_path, "FAILED");
+    } else {
+      printf("%-40s %12.2f %12.2f %12.2f %14zu\n", result->script_path, result->best_ms,
+             result->total_ms / iterations, result->best_gc_ms, result->bytes_allocated);
+    }
+  }
+
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include "../src/object.h"
 #include "../src/module.h"
 #include "../src/vm.h"
+#include "../src/profile.h"
 #include "../src/repl.h"
 
 #endif
@@ -0,0 +1,589 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "fs.h"
+#include "mem.h"
+#include "object.h"
+#include "op.h"
+#include "vm.h"
+
+// Marks a function without a name (top-level scripts)
+#define CACHE_NO_NAME UINT32_MAX
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_size;
+  uint32_t source_hash;
+  uint32_t options;
+  uint32_t body_hash;
+} CacheHeader;
+
+// Compiler options which change the bytecode, code compiled with other
+// options is treated as stale
+#define CACHE_OPTION_REGISTER_OPS 1
+
+static uint32_t cache_options(VM *vm) {
+  return vm->use_register_ops ? CACHE_OPTION_REGISTER_OPS : 0;
+}
+
+typedef enum {
+  CacheValueNil,
+  CacheValueTrue,
+  CacheValueEmpty,
+  CacheValueNumber,
+  CacheValueString,
+  CacheValueSymbol,
+  CacheValueKeyword,
+  CacheValueFunction
+} CacheValueKind;
+
+typedef struct {
+  const uint8_t *current;
+  const uint8_t *end;
+} CacheReader;
+
+static uint32_t cache_hash(const void *data, size_t length) {
+  // Use the FNV-1a hash algorithm
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= ((const uint8_t *)data)[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+static char *cache_path_for_source(const char *source_path) {
+  // The cache path is the source path with a 'c' added to the end
+  size_t length = strlen(source_path);
+  char *cache_path = malloc(length + 2);
+  memcpy(cache_path, source_path, length);
+  cache_path[length] = 'c';
+  cache_path[length + 1] = '\0';
+
+  return cache_path;
+}
+
+static bool cache_read_bytes(CacheReader *reader, void *dest, size_t size) {
+  if ((size_t)(reader->end - reader->current) < size) {
+    return false;
+  }
+
+  memcpy(dest, reader->current, size);
+  reader->current += size;
+  return true;
+}
+
+static bool cache_read_chars(CacheReader *reader, const char **chars, uint32_t *length) {
+  if (!cache_read_bytes(reader, length, sizeof(uint32_t))) {
+    return false;
+  }
+
+  if (*length == CACHE_NO_NAME) {
+    *chars = NULL;
+    return true;
+  }
+
+  if ((size_t)(reader->end - reader->current) < *length) {
+    return false;
+  }
+
+  // The characters are copied straight out of the mapped file when the
+  // string object is made
+  *chars = (const char *)reader->current;
+  reader->current += *length;
+  return true;
+}
+
+static ObjectFunction *cache_read_function(VM *vm, CacheReader *reader);
+
+static bool cache_read_value(VM *vm, CacheReader *reader, Value *value) {
+  uint8_t kind;
+  const char *chars;
+  uint32_t length;
+  if (!cache_read_bytes(reader, &kind, sizeof(uint8_t))) {
+    return false;
+  }
+
+  switch (kind) {
+  case CacheValueNil:
+    *value = NIL_VAL;
+    return true;
+  case CacheValueTrue:
+    *value = T_VAL;
+    return true;
+  case CacheValueEmpty:
+    *value = EMPTY_VAL;
+    return true;
+  case CacheValueNumber: {
+    double number;
+    if (!cache_read_bytes(reader, &number, sizeof(double))) {
+      return false;
+    }
+
+    *value = NUMBER_VAL(number);
+    return true;
+  }
+  case CacheValueString:
+  case CacheValueSymbol:
+  case CacheValueKeyword:
+    if (!cache_read_chars(reader, &chars, &length) || length == CACHE_NO_NAME) {
+      return false;
+    }
+
+    if (kind == CacheValueString) {
+      *value = OBJECT_VAL(mesche_object_make_string(vm, chars, length));
+    } else if (kind == CacheValueSymbol) {
+      *value = OBJECT_VAL(mesche_object_make_symbol(vm, chars, length));
+    } else {
+      *value = OBJECT_VAL(mesche_object_make_keyword(vm, chars, length));
+    }
+    return true;
+  case CacheValueFunction: {
+    ObjectFunction *function = cache_read_function(vm, reader);
+    if (function == NULL) {
+      return false;
+    }
+
+    *value = OBJECT_VAL(function);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+static inline bool cache_constant_valid(Chunk *chunk, int index) {
+  return index < chunk->constants.count;
+}
+
+static inline bool cache_name_valid(Chunk *chunk, int index) {
+  return cache_constant_valid(chunk, index) && IS_STRING(chunk->constants.values[index]);
+}
+
+// Checks that every instruction and operand refers to something which exists
+// so that a corrupt cache or one from another build can't crash the VM
+static bool cache_chunk_valid(ObjectFunction *function) {
+  Chunk *chunk = &function->chunk;
+  uint8_t *code = chunk->code;
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t instr = code[offset];
+    int remaining = chunk->count - offset;
+    if (instr >= OP_COUNT) {
+      return false;
+    }
+
+    // The closure's function decides how long the instruction is
+    if (instr == OP_CLOSURE &&
+        (remaining < 2 || !cache_constant_valid(chunk, code[offset + 1]) ||
+         !IS_FUNCTION(chunk->constants.values[code[offset + 1]]))) {
+      return false;
+    }
+
+    int length = mesche_chunk_instr_length(chunk, offset);
+    if (length > remaining) {
+      return false;
+    }
+
+    bool is_valid = true;
+    uint16_t operand = length >= 3 ? (code[offset + length - 2] << 8) | code[offset + length - 1] : 0;
+    switch (instr) {
+    case OP_CONSTANT:
+      is_valid = cache_constant_valid(chunk, code[offset + 1]);
+      break;
+    case OP_EXPORT_SYMBOL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_READ_GLOBAL:
+      is_valid = cache_name_valid(chunk, code[offset + 1]);
+      break;
+    case OP_SET_UPVALUE:
+    case OP_READ_UPVALUE:
+      is_valid = code[offset + 1] < function->upvalue_count;
+      break;
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_EQV_LOCAL_CONSTANT:
+      is_valid = cache_constant_valid(chunk, code[offset + 2]);
+      break;
+    case OP_ADD_REG:
+    case OP_SUBTRACT_REG:
+    case OP_MULTIPLY_REG:
+    case OP_DIVIDE_REG:
+    case OP_EQV_REG:
+      is_valid = (!(code[offset + 1] & OP_REG_A_CONSTANT) ||
+                  cache_constant_valid(chunk, code[offset + 2])) &&
+                 (!(code[offset + 1] & OP_REG_B_CONSTANT) ||
+                  cache_constant_valid(chunk, code[offset + 3]));
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_EQV_JUMP_IF_FALSE:
+      is_valid = offset + length + operand <= chunk->count;
+      break;
+    case OP_LOOP:
+      is_valid = operand <= offset + length;
+      break;
+    case OP_CALL_KEYWORDS:
+    case OP_TAIL_CALL_KEYWORDS:
+      is_valid = operand < chunk->keyword_cache_count;
+      break;
+    case OP_CLOSURE:
+      // Upvalues captured from the enclosing function have to exist in it
+      for (int i = offset + 2; is_valid && i < offset + length; i += 2) {
+        is_valid = code[i] == 1 || (code[i] == 0 && code[i + 1] < function->upvalue_count);
+      }
+      break;
+    default:
+      break;
+    }
+
+    if (!is_valid) {
+      return false;
+    }
+
+    offset += length;
+  }
+
+  for (int i = 0; i < function->keyword_args.count; i++) {
+    if (function->keyword_args.args[i].default_index > chunk->constants.count) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool cache_read_function_body(VM *vm, CacheReader *reader, ObjectFunction *function) {
+  MescheMemory *mem = (MescheMemory *)vm;
+  Chunk *chunk = &function->chunk;
+  int32_t arity, upvalue_count, code_count, keyword_cache_count, constant_count, keyword_count;
+  const char *chars;
+  uint32_t length;
+
+  if (!cache_read_bytes(reader, &arity, sizeof(int32_t)) ||
+      !cache_read_bytes(reader, &upvalue_count, sizeof(int32_t)) ||
+      !cache_read_chars(reader, &chars, &length) || arity < 0 || arity > UINT8_MAX ||
+      upvalue_count < 0 || upvalue_count > UINT8_COUNT) {
+    return false;
+  }
+
+  function->arity = arity;
+  function->upvalue_count = upvalue_count;
+  if (length != CACHE_NO_NAME) {
+    function->name = mesche_object_make_string(vm, chars, length);
+  }
+
+  // Read the bytecode and the line of each byte
+  if (!cache_read_bytes(reader, &code_count, sizeof(int32_t)) || code_count < 0 ||
+      (size_t)(reader->end - reader->current) < code_count * (sizeof(uint8_t) + sizeof(int32_t))) {
+    return false;
+  }
+
+  chunk->code = GROW_ARRAY(mem, uint8_t, NULL, 0, code_count);
+  chunk->lines = GROW_ARRAY(mem, int, NULL, 0, code_count);
+  chunk->capacity = code_count;
+  chunk->count = code_count;
+  if (!cache_read_bytes(reader, chunk->code, code_count)) {
+    return false;
+  }
+
+  for (int i = 0; i < code_count; i++) {
+    int32_t line;
+    if (!cache_read_bytes(reader, &line, sizeof(int32_t))) {
+      return false;
+    }
+
+    chunk->lines[i] = line;
+  }
+
+  // Read the constants, nested functions are read in place
+  if (!cache_read_bytes(reader, &keyword_cache_count, sizeof(int32_t)) ||
+      !cache_read_bytes(reader, &constant_count, sizeof(int32_t)) || keyword_cache_count < 0 ||
+      keyword_cache_count > UINT16_MAX + 1 || constant_count < 0 || constant_count > UINT8_COUNT) {
+    return false;
+  }
+
+  for (int i = 0; i < constant_count; i++) {
+    Value value;
+    if (!cache_read_value(vm, reader, &value)) {
+      return false;
+    }
+
+    mesche_chunk_constant_add(mem, chunk, value);
+  }
+
+  // Read the keyword parameters
+  if (!cache_read_bytes(reader, &keyword_count, sizeof(int32_t))) {
+    return false;
+  }
+
+  for (int i = 0; i < keyword_count; i++) {
+    KeywordArgument keyword_arg;
+    if (!cache_read_chars(reader, &chars, &length) || length == CACHE_NO_NAME) {
+      return false;
+    }
+
+    keyword_arg.name = mesche_object_make_keyword(vm, chars, length);
+    if (!cache_read_bytes(reader, &keyword_arg.default_index, sizeof(uint8_t))) {
+      return false;
+    }
+
+    // Keep the keyword reachable while the argument array grows
+    mesche_vm_stack_push(vm, OBJECT_VAL(keyword_arg.name));
+    mesche_object_function_keyword_add(mem, function, keyword_arg);
+    mesche_vm_stack_pop(vm);
+  }
+
+  chunk->keyword_cache_count = keyword_cache_count;
+  mesche_chunk_caches_init(mem, chunk);
+
+  return cache_chunk_valid(function);
+}
+
+static ObjectFunction *cache_read_function(VM *vm, CacheReader *reader) {
+  uint8_t type;
+  if (!cache_read_bytes(reader, &type, sizeof(uint8_t)) || type > TYPE_SCRIPT) {
+    return NULL;
+  }
+
+  // Keep the function on the stack while its contents are allocated
+  ObjectFunction *function = mesche_object_make_function(vm, (FunctionType)type);
+  mesche_vm_stack_push(vm, OBJECT_VAL(function));
+  bool success = cache_read_function_body(vm, reader, function);
+  mesche_object_write_barrier_all(vm, (Object *)function);
+  mesche_vm_stack_pop(vm);
+
+  return success ? function : NULL;
+}
+
+static bool cache_source_matches(const CacheHeader *header, const char *source_path) {
+  struct stat source_stat;
+  if (stat(source_path, &source_stat) != 0 || header->source_size != (uint64_t)source_stat.st_size) {
+    return false;
+  }
+
+  // Modification times are too coarse to catch an edit made right after the
+  // cache was written so the contents are always hashed, which is still far
+  // cheaper than compiling them
+  char *source = mesche_fs_file_read_all(source_path);
+  if (source == NULL) {
+    return false;
+  }
+
+  bool matches = header->source_hash == cache_hash(source, strlen(source));
+  free(source);
+
+  return matches;
+}
+
+ObjectFunction *mesche_cache_load(VM *vm, const char *source_path) {
+  char *cache_path = cache_path_for_source(source_path);
+  int fd = open(cache_path, O_RDONLY);
+  free(cache_path);
+  if (fd == -1) {
+    return NULL;
+  }
+
+  struct stat cache_stat;
+  if (fstat(fd, &cache_stat) != 0 || cache_stat.st_size < (off_t)sizeof(CacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  // Map the cache file so that its contents can be read without copying
+  size_t size = cache_stat.st_size;
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+
+  CacheHeader header;
+  CacheReader reader = {.current = data, .end = (const uint8_t *)data + size};
+  cache_read_bytes(&reader, &header, sizeof(CacheHeader));
+
+  // A cache which was cut short or damaged since it was written won't match
+  // the hash of its body
+  ObjectFunction *function = NULL;
+  if (memcmp(header.magic, MESCHE_CACHE_MAGIC, 4) == 0 && header.version == MESCHE_CACHE_VERSION &&
+      header.options == cache_options(vm) &&
+      header.body_hash == cache_hash(reader.current, reader.end - reader.current) &&
+      cache_source_matches(&header, source_path)) {
+    function = cache_read_function(vm, &reader);
+    if (reader.current != reader.end) {
+      function = NULL;
+    }
+  }
+
+  munmap(data, size);
+  return function;
+}
+
+static void cache_write_chars(FILE *file, const char *chars, uint32_t length) {
+  fwrite(&length, sizeof(uint32_t), 1, file);
+  fwrite(chars, sizeof(char), length, file);
+}
+
+static bool cache_write_function(FILE *file, ObjectFunction *function);
+
+static bool cache_write_value(FILE *file, Value value) {
+  uint8_t kind;
+  if (IS_NIL(value)) {
+    kind = CacheValueNil;
+  } else if (IS_T(value)) {
+    kind = CacheValueTrue;
+  } else if (IS_EMPTY(value)) {
+    kind = CacheValueEmpty;
+  } else if (IS_NUMBER(value)) {
+    kind = CacheValueNumber;
+  } else if (IS_OBJECT(value)) {
+    switch (OBJECT_KIND(value)) {
+    case ObjectKindString:
+      kind = CacheValueString;
+      break;
+    case ObjectKindSymbol:
+      kind = CacheValueSymbol;
+      break;
+    case ObjectKindKeyword:
+      kind = CacheValueKeyword;
+      break;
+    case ObjectKindFunction:
+      kind = CacheValueFunction;
+      break;
+    default:
+      // Other objects only exist at runtime
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  fwrite(&kind, sizeof(uint8_t), 1, file);
+  switch (kind) {
+  case CacheValueNumber: {
+    double number = AS_NUMBER(value);
+    fwrite(&number, sizeof(double), 1, file);
+    break;
+  }
+  case CacheValueString:
+  case CacheValueSymbol:
+  case CacheValueKeyword:
+    cache_write_chars(file, AS_CSTRING(value), AS_STRING(value)->length);
+    break;
+  case CacheValueFunction:
+    return cache_write_function(file, AS_FUNCTION(value));
+  }
+
+  return true;
+}
+
+static bool cache_write_function(FILE *file, ObjectFunction *function) {
+  Chunk *chunk = &function->chunk;
+  uint8_t type = function->type;
+  int32_t arity = function->arity;
+  int32_t upvalue_count = function->upvalue_count;
+  fwrite(&type, sizeof(uint8_t), 1, file);
+  fwrite(&arity, sizeof(int32_t), 1, file);
+  fwrite(&upvalue_count, sizeof(int32_t), 1, file);
+  if (function->name != NULL) {
+    cache_write_chars(file, function->name->chars, function->name->length);
+  } else {
+    uint32_t no_name = CACHE_NO_NAME;
+    fwrite(&no_name, sizeof(uint32_t), 1, file);
+  }
+
+  int32_t code_count = chunk->count;
+  fwrite(&code_count, sizeof(int32_t), 1, file);
+  fwrite(chunk->code, sizeof(uint8_t), chunk->count, file);
+  for (int i = 0; i < chunk->count; i++) {
+    int32_t line = chunk->lines[i];
+    fwrite(&line, sizeof(int32_t), 1, file);
+  }
+
+  int32_t keyword_cache_count = chunk->keyword_cache_count;
+  int32_t constant_count = chunk->constants.count;
+  fwrite(&keyword_cache_count, sizeof(int32_t), 1, file);
+  fwrite(&constant_count, sizeof(int32_t), 1, file);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (!cache_write_value(file, chunk->constants.values[i])) {
+      return false;
+    }
+  }
+
+  int32_t keyword_count = function->keyword_args.count;
+  fwrite(&keyword_count, sizeof(int32_t), 1, file);
+  for (int i = 0; i < function->keyword_args.count; i++) {
+    KeywordArgument *keyword_arg = &function->keyword_args.args[i];
+    cache_write_chars(file, keyword_arg->name->string.chars, keyword_arg->name->string.length);
+    fwrite(&keyword_arg->default_index, sizeof(uint8_t), 1, file);
+  }
+
+  return true;
+}
+
+bool mesche_cache_write(VM *vm, ObjectFunction *function, const char *source_path,
+                        const char *source) {
+  // Don't cache a file that changed since its source was read
+  struct stat source_stat;
+  size_t source_size = strlen(source);
+  if (stat(source_path, &source_stat) != 0 || (size_t)source_stat.st_size != source_size) {
+    return false;
+  }
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(CacheHeader));
+  memcpy(header.magic, MESCHE_CACHE_MAGIC, 4);
+  header.version = MESCHE_CACHE_VERSION;
+  header.source_size = source_size;
+  header.source_hash = cache_hash(source, source_size);
+  header.options = cache_options(vm);
+
+  // Write to a temporary file first so that a partially written cache is
+  // never picked up by another process
+  char *cache_path = cache_path_for_source(source_path);
+  size_t temp_size = strlen(cache_path) + 5;
+  char *temp_path = malloc(temp_size);
+  snprintf(temp_path, temp_size, "%s.tmp", cache_path);
+
+  // The body is written to memory first so that the header can hold its hash
+  char *body = NULL;
+  size_t body_size = 0;
+  FILE *body_file = open_memstream(&body, &body_size);
+  bool success = body_file != NULL && cache_write_function(body_file, function);
+  if (body_file != NULL) {
+    success = fclose(body_file) == 0 && success;
+  }
+
+  FILE *file = success ? fopen(temp_path, "wb") : NULL;
+  if (file != NULL) {
+    header.body_hash = cache_hash(body, body_size);
+    success = fwrite(&header, sizeof(CacheHeader), 1, file) == 1 &&
+              fwrite(body, sizeof(char), body_size, file) == body_size;
+    success = fclose(file) == 0 && success;
+    if (success) {
+      success = rename(temp_path, cache_path) == 0;
+    }
+
+    if (!success) {
+      remove(temp_path);
+    }
+  } else {
+    success = false;
+  }
+
+  free(body);
+  free(temp_path);
+  free(cache_path);
+
+  return success;
+}
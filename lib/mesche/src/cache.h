@@ -0,0 +1,19 @@
+#ifndef mesche_cache_h
+#define mesche_cache_h
+
+#include <stdbool.h>
+
+#include "object.h"
+#include "vm.h"
+
+// Bytecode cache files sit next to their source file with the extension
+// ".mscc".  Bump the version whenever the compiler's output or the opcode
+// numbering changes so that stale caches get recompiled.
+#define MESCHE_CACHE_MAGIC "MSCC"
+#define MESCHE_CACHE_VERSION 12
+
+ObjectFunction *mesche_cache_load(VM *vm, const char *source_path);
+bool mesche_cache_write(VM *vm, ObjectFunction *function, const char *source_path,
+                        const char *source);
+
+#endif
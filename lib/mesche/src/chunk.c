@@ -3,6 +3,8 @@
 #include "vm.h"
 #include "mem.h"
 #include "chunk.h"
+#include "object.h"
+#include "op.h"
 #include "value.h"
 
 void mesche_chunk_init(Chunk* chunk) {
@@ -11,6 +13,10 @@ void mesche_chunk_init(Chunk* chunk) {
   chunk->code = NULL;
   chunk->lines = NULL;
   mesche_value_array_init(&chunk->constants);
+  chunk->global_cache_count = 0;
+  chunk->global_caches = NULL;
+  chunk->keyword_cache_count = 0;
+  chunk->keyword_caches = NULL;
 }
 
 void mesche_chunk_write(MescheMemory *mem, Chunk* chunk, uint8_t byte, int line) {
@@ -38,9 +44,86 @@ int mesche_chunk_constant_add(MescheMemory *mem, Chunk *chunk, Value value) {
   return chunk->constants.count - 1;
 }
 
+int mesche_chunk_keyword_cache_add(Chunk *chunk) {
+  // The cache itself is allocated with the rest once the chunk is complete
+  return chunk->keyword_cache_count++;
+}
+
+int mesche_chunk_instr_length(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_POP_SCOPE:
+  case OP_LIST:
+  case OP_EXPORT_SYMBOL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_SET_UPVALUE:
+  case OP_SET_LOCAL:
+  case OP_READ_GLOBAL:
+  case OP_READ_UPVALUE:
+  case OP_READ_LOCAL:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_CALL_CLOSURE_EXACT_ARITY:
+  case OP_CALL_NATIVE:
+  case OP_TAIL_CALL_CLOSURE_EXACT_ARITY:
+  case OP_STORE_LOCAL:
+    return 2;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_EQV_JUMP_IF_FALSE:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+  case OP_EQV_LOCAL_CONSTANT:
+  case OP_MOVE_LOCAL:
+    return 3;
+  case OP_ADD_REG:
+  case OP_SUBTRACT_REG:
+  case OP_MULTIPLY_REG:
+  case OP_DIVIDE_REG:
+  case OP_EQV_REG:
+    return 4;
+  case OP_CALL_KEYWORDS:
+  case OP_TAIL_CALL_KEYWORDS:
+  case OP_LOOP:
+    return 5;
+  case OP_CLOSURE: {
+    // The function constant is followed by a pair of bytes for each upvalue
+    ObjectFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + function->upvalue_count * 2;
+  }
+  default:
+    return 1;
+  }
+}
+
+void mesche_chunk_caches_init(MescheMemory *mem, Chunk *chunk) {
+  // Global instructions refer to their variable name by constant index, so
+  // one cache slot per constant gives every name in the chunk its own cache
+  int count = chunk->constants.count;
+  chunk->global_caches = GROW_ARRAY(mem, GlobalCache, chunk->global_caches,
+                                    chunk->global_cache_count, count);
+  for (int i = chunk->global_cache_count; i < count; i++) {
+    chunk->global_caches[i].table = NULL;
+    chunk->global_caches[i].version = 0;
+    chunk->global_caches[i].binding = NULL;
+  }
+
+  chunk->global_cache_count = count;
+
+  chunk->keyword_caches =
+      GROW_ARRAY(mem, KeywordCallCache, chunk->keyword_caches, 0, chunk->keyword_cache_count);
+  for (int i = 0; i < chunk->keyword_cache_count; i++) {
+    chunk->keyword_caches[i].function = NULL;
+  }
+}
+
 void mesche_chunk_free(MescheMemory *mem, Chunk* chunk) {
   FREE_ARRAY(mem, uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(mem, uint8_t, chunk->lines, chunk->capacity);
+  FREE_ARRAY(mem, int, chunk->lines, chunk->capacity);
   mesche_value_array_free(mem, &chunk->constants);
+  FREE_ARRAY(mem, GlobalCache, chunk->global_caches, chunk->global_cache_count);
+  FREE_ARRAY(mem, KeywordCallCache, chunk->keyword_caches, chunk->keyword_cache_count);
   mesche_chunk_init(chunk);
 }
@@ -3,19 +3,47 @@
 
 #include <stdint.h>
 #include "mem.h"
+#include "table.h"
 #include "value.h"
 
+// Remembers the binding a global variable name was last resolved to so that
+// repeated reads and writes can skip the hash table lookup while the module
+// table is unchanged
+typedef struct {
+  Table *table;
+  uint32_t version;
+  ObjectBinding *binding;
+} GlobalCache;
+
+// The most keyword parameters a call site cache can hold matches for, calls
+// to functions with more keyword parameters are matched on every call
+#define KEYWORD_CACHE_MAX 16
+
+// Remembers which of the call site's keyword arguments supplies each keyword
+// parameter of the function that was last called from it
+typedef struct {
+  ObjectFunction *function;
+  uint8_t matches[KEYWORD_CACHE_MAX];
+} KeywordCallCache;
+
 typedef struct {
   int capacity;
   int count;
   uint8_t *code;
   int *lines;
   ValueArray constants;
+  int global_cache_count;
+  GlobalCache *global_caches;
+  int keyword_cache_count;
+  KeywordCallCache *keyword_caches;
 } Chunk;
 
 void mesche_chunk_init(Chunk* chunk);
 void mesche_chunk_write(MescheMemory *mem, Chunk* chunk, uint8_t byte, int line);
 int mesche_chunk_constant_add(MescheMemory *mem, Chunk *chunk, Value value);
+int mesche_chunk_keyword_cache_add(Chunk *chunk);
+int mesche_chunk_instr_length(Chunk *chunk, int offset);
+void mesche_chunk_caches_init(MescheMemory *mem, Chunk *chunk);
 void mesche_chunk_free(MescheMemory *mem, Chunk* chunk);
 
 #endif
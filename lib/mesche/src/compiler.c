@@ -8,6 +8,7 @@
 #include "mem.h"
 #include "object.h"
 #include "op.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "util.h"
 #include "vm.h"
@@ -15,7 +16,7 @@
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 // NOTE: Enable this for diagnostic purposes
-#define DEBUG_PRINT_CODE
+/* #define DEBUG_PRINT_CODE */
 
 // Contains context for parsing tokens irrespective of the current compilation
 // scope
@@ -30,6 +31,7 @@ typedef struct {
 typedef struct {
   Token name;
   int depth;
+  int slot;
   bool is_captured;
 } Local;
 
@@ -39,6 +41,38 @@ typedef struct {
   bool is_local;
 } Upvalue;
 
+// A global defined by the script being compiled.  Its value is known at
+// compile time for as long as it has only been bound to constants.
+typedef struct {
+  ObjectString *name;
+  bool is_constant;
+  Value value;
+} KnownGlobal;
+
+// A named `let` whose body is being compiled.  Calls to its name in tail
+// position jump back to the start of the body with new values for its
+// variables.
+typedef struct Loop {
+  struct Loop *enclosing;
+  Token name;
+  int first_local;
+  int first_slot;
+  int var_count;
+  int start;
+
+  // Where each call to the loop ends, checked once the whole body is known
+  int *call_ends;
+  int call_count;
+  int call_capacity;
+} Loop;
+
+// A place in the source which the compiler can come back to
+typedef struct {
+  Scanner scanner;
+  Token current;
+  Token previous;
+} SourcePosition;
+
 // Stores context for compilation at a particular scope
 typedef struct CompilerContext {
   struct CompilerContext *parent;
@@ -54,7 +88,25 @@ typedef struct CompilerContext {
   Local locals[UINT8_COUNT];
   int local_count;
   int scope_depth;
+
+  // How many values are on the frame's stack where code is being emitted.
+  // Values being collected for a call sit between locals, so a local's slot
+  // can be higher than its index.
+  int stack_depth;
   Upvalue upvalues[UINT8_COUNT];
+
+  // The innermost named `let` and how many loops of any kind the code being
+  // compiled is inside of
+  Loop *loop;
+  int loop_depth;
+
+  // How many branches of an `if` or `do` the code being compiled is inside of
+  int branch_depth;
+
+  // Only used by the script's context, functions can run at any later time
+  KnownGlobal *known_globals;
+  int known_global_count;
+  int known_global_capacity;
 } CompilerContext;
 
 typedef struct {
@@ -66,7 +118,7 @@ void mesche_compiler_mark_roots(void *target) {
   CompilerContext *ctx = (CompilerContext *)target;
 
   while (ctx != NULL) {
-    mesche_mem_mark_object(ctx->vm, (Object *)ctx->function);
+    mesche_mem_mark_root(ctx->vm, (Object *)ctx->function);
     ctx = ctx->parent;
   }
 }
@@ -87,6 +139,13 @@ static void compiler_init_context(CompilerContext *ctx, CompilerContext *parent,
   ctx->function_type = type;
   ctx->local_count = 0;
   ctx->scope_depth = 0;
+  ctx->stack_depth = 1;
+  ctx->loop = NULL;
+  ctx->loop_depth = 0;
+  ctx->branch_depth = 0;
+  ctx->known_globals = NULL;
+  ctx->known_global_count = 0;
+  ctx->known_global_capacity = 0;
 
   // Set up memory management
   ctx->vm->current_compiler = ctx;
@@ -95,6 +154,7 @@ static void compiler_init_context(CompilerContext *ctx, CompilerContext *parent,
   // Establish the first local slot
   Local *local = &ctx->locals[ctx->local_count++];
   local->depth = 0;
+  local->slot = 0;
   local->is_captured = false;
   local->name.start = "";
   local->name.length = 0;
@@ -113,9 +173,79 @@ static void compiler_emit_return(CompilerContext *ctx) {
   compiler_emit_byte(ctx, OP_RETURN);
 }
 
+static bool compiler_leads_to_return(Chunk *chunk, int offset) {
+  // Follow the instructions that run after a call to see if the function
+  // returns its result without doing anything else.  Scope cleanup can be
+  // skipped because a tail call discards the whole frame.
+  for (;;) {
+    switch (chunk->code[offset]) {
+    case OP_RETURN:
+      return true;
+    case OP_POP_SCOPE:
+    case OP_CLOSE_UPVALUE:
+      offset += mesche_chunk_instr_length(chunk, offset);
+      break;
+    case OP_JUMP: {
+      uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+      offset += 3 + jump;
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+}
+
+static bool compiler_leads_to(Chunk *chunk, int offset, int end) {
+  // Like compiler_leads_to_return, but for code which should reach the end
+  // of a loop's body.  Jumping back to the start of the loop discards the
+  // body's locals so leaving scopes can be skipped.
+  while (offset < end) {
+    switch (chunk->code[offset]) {
+    case OP_POP_SCOPE:
+    case OP_CLOSE_UPVALUE:
+      offset += mesche_chunk_instr_length(chunk, offset);
+      break;
+    case OP_JUMP: {
+      uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+      offset += 3 + jump;
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+
+  return offset == end;
+}
+
+static void compiler_emit_tail_calls(CompilerContext *ctx) {
+  // Turn calls in tail position into tail calls which reuse the caller's
+  // frame.  Scripts keep their frame so that module imports can detect when
+  // a module's script returns.
+  Chunk *chunk = &ctx->function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += mesche_chunk_instr_length(chunk, offset)) {
+    uint8_t *instr = &chunk->code[offset];
+    if (*instr == OP_CALL && compiler_leads_to_return(chunk, offset + 2)) {
+      *instr = OP_TAIL_CALL;
+    } else if (*instr == OP_CALL_KEYWORDS && compiler_leads_to_return(chunk, offset + 5)) {
+      *instr = OP_TAIL_CALL_KEYWORDS;
+    }
+  }
+}
+
 static ObjectFunction *compiler_end(CompilerContext *ctx) {
   ObjectFunction *function = ctx->function;
   compiler_emit_return(ctx);
+  if (ctx->function_type == TYPE_FUNCTION && !ctx->parser->had_error) {
+    compiler_emit_tail_calls(ctx);
+  }
+  if (!ctx->parser->had_error) {
+    mesche_peephole_optimize(&function->chunk, ctx->vm->use_register_ops);
+  }
+  mesche_chunk_caches_init(ctx->mem, &function->chunk);
+  mesche_object_write_barrier_all(ctx->vm, (Object *)function);
 
 #ifdef DEBUG_PRINT_CODE
   if (!ctx->parser->had_error) {
@@ -137,10 +267,104 @@ static uint8_t compiler_make_constant(CompilerContext *ctx, Value value) {
   return (uint8_t)constant;
 }
 
+static uint8_t compiler_shared_constant(CompilerContext *ctx, Value value) {
+  // Reuse an existing constant for the same interned object if possible
+  Chunk *chunk = &ctx->function->chunk;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    if (mesche_value_equalp(chunk->constants.values[i], value)) {
+      return (uint8_t)i;
+    }
+  }
+
+  return compiler_make_constant(ctx, value);
+}
+
 static void compiler_emit_constant(CompilerContext *ctx, Value value) {
   compiler_emit_bytes(ctx, OP_CONSTANT, compiler_make_constant(ctx, value));
 }
 
+static void compiler_emit_known_constant(CompilerContext *ctx, Value value) {
+  if (IS_NIL(value)) {
+    compiler_emit_byte(ctx, OP_NIL);
+  } else if (IS_T(value)) {
+    compiler_emit_byte(ctx, OP_T);
+  } else {
+    compiler_emit_bytes(ctx, OP_CONSTANT, compiler_shared_constant(ctx, value));
+  }
+}
+
+// Checks whether the code emitted between the offsets does nothing but push a
+// constant, which it stores in `value` if so
+static bool compiler_constant_between(CompilerContext *ctx, int start, int end, Value *value) {
+  Chunk *chunk = &ctx->function->chunk;
+  if (end - start == 1 && chunk->code[start] == OP_NIL) {
+    *value = NIL_VAL;
+  } else if (end - start == 1 && chunk->code[start] == OP_T) {
+    *value = T_VAL;
+  } else if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+    *value = chunk->constants.values[chunk->code[start + 1]];
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+// Replaces all code and constants since the given counts with a single
+// constant
+static void compiler_fold_constant(CompilerContext *ctx, int code_count, int constant_count,
+                                   Value value) {
+  // The value may only be held by one of the constants being dropped
+  Chunk *chunk = &ctx->function->chunk;
+  mesche_vm_stack_push(ctx->vm, value);
+  chunk->count = code_count;
+  chunk->constants.count = constant_count;
+  compiler_emit_known_constant(ctx, value);
+  mesche_vm_stack_pop(ctx->vm);
+}
+
+static CompilerContext *compiler_root_context(CompilerContext *ctx) {
+  while (ctx->parent != NULL) {
+    ctx = ctx->parent;
+  }
+
+  return ctx;
+}
+
+static KnownGlobal *compiler_known_global(CompilerContext *ctx, ObjectString *name) {
+  CompilerContext *root = compiler_root_context(ctx);
+  for (int i = 0; i < root->known_global_count; i++) {
+    if (root->known_globals[i].name == name) {
+      return &root->known_globals[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void compiler_known_global_set(CompilerContext *ctx, ObjectString *name, bool is_constant,
+                                      Value value) {
+  KnownGlobal *global = compiler_known_global(ctx, name);
+  if (global == NULL) {
+    CompilerContext *root = compiler_root_context(ctx);
+    if (root->known_global_count == root->known_global_capacity) {
+      root->known_global_capacity = GROW_CAPACITY(root->known_global_capacity);
+      root->known_globals =
+          realloc(root->known_globals, sizeof(KnownGlobal) * root->known_global_capacity);
+      if (root->known_globals == NULL) {
+        PANIC("Could not allocate known globals.");
+      }
+    }
+
+    global = &root->known_globals[root->known_global_count++];
+    global->name = name;
+  }
+
+  // Constant values stay alive in the script's constant pool
+  global->is_constant = is_constant;
+  global->value = value;
+}
+
 static void compiler_error_at_token(CompilerContext *ctx, Token *token, const char *message) {
   // If we're already in panic mode, ignore errors to avoid spam
   if (ctx->parser->panic_mode)
@@ -196,6 +420,43 @@ static void compiler_consume(CompilerContext *ctx, TokenKind kind, const char *m
   compiler_error_at_current(ctx, message);
 }
 
+static SourcePosition compiler_save_position(CompilerContext *ctx) {
+  return (SourcePosition){
+      .scanner = *ctx->scanner,
+      .current = ctx->parser->current,
+      .previous = ctx->parser->previous,
+  };
+}
+
+static void compiler_restore_position(CompilerContext *ctx, SourcePosition *position) {
+  *ctx->scanner = position->scanner;
+  ctx->parser->current = position->current;
+  ctx->parser->previous = position->previous;
+}
+
+static void compiler_skip_expr(CompilerContext *ctx) {
+  // Quotes belong to the expression which follows them
+  while (ctx->parser->current.kind == TokenKindQuote ||
+         ctx->parser->current.kind == TokenKindBackquote ||
+         ctx->parser->current.kind == TokenKindUnquote ||
+         ctx->parser->current.kind == TokenKindSplice) {
+    compiler_advance(ctx);
+  }
+
+  int depth = 0;
+  do {
+    if (ctx->parser->current.kind == TokenKindEOF) {
+      return;
+    } else if (ctx->parser->current.kind == TokenKindLeftParen) {
+      depth++;
+    } else if (ctx->parser->current.kind == TokenKindRightParen) {
+      depth--;
+    }
+
+    compiler_advance(ctx);
+  } while (depth > 0);
+}
+
 // Predefine the main parser function
 static void compiler_parse_expr(CompilerContext *ctx);
 
@@ -219,7 +480,9 @@ static ObjectKeyword *compiler_parse_keyword_literal(CompilerContext *ctx) {
 }
 
 static void compiler_parse_keyword(CompilerContext *ctx) {
-  compiler_emit_constant(ctx, OBJECT_VAL(compiler_parse_keyword_literal(ctx)));
+  // Keywords are interned so every use of a keyword can share one constant
+  compiler_emit_bytes(ctx, OP_CONSTANT,
+                      compiler_shared_constant(ctx, OBJECT_VAL(compiler_parse_keyword_literal(ctx))));
 }
 
 static void compiler_parse_symbol_literal(CompilerContext *ctx) {
@@ -244,14 +507,21 @@ static void compiler_parse_literal(CompilerContext *ctx) {
 static void compiler_parse_block(CompilerContext *ctx, bool expect_end_paren) {
   // TODO: Discard every value except for the last!
   for (;;) {
+    // A define in a local scope leaves its value on the stack as the local
+    int local_count = ctx->local_count;
     compiler_parse_expr(ctx);
+    bool is_local_define = ctx->local_count > local_count;
 
     if (expect_end_paren && ctx->parser->current.kind == TokenKindRightParen) {
+      // The block's result is a copy so that the local can leave its scope
+      if (is_local_define) {
+        compiler_emit_bytes(ctx, OP_READ_LOCAL, ctx->locals[ctx->local_count - 1].slot);
+      }
       compiler_consume(ctx, TokenKindRightParen, "Expected closing paren.");
       break;
     } else if (ctx->parser->current.kind == TokenKindEOF) {
       break;
-    } else {
+    } else if (!is_local_define) {
       // If we continue the loop, pop the last expression result
       compiler_emit_byte(ctx, OP_POP);
     }
@@ -265,12 +535,14 @@ static bool compiler_identifiers_equal(Token *a, Token *b) {
 }
 
 static void compiler_add_local(CompilerContext *ctx, Token name) {
-  if (ctx->local_count == UINT8_COUNT) {
+  if (ctx->local_count == UINT8_COUNT || ctx->stack_depth > UINT8_MAX) {
     compiler_error(ctx, "Too many local variables defined in function.");
+    return;
   }
   Local *local = &ctx->locals[ctx->local_count++];
   local->name = name; // No need to copy, will only be used during compilation
   local->depth = -1;  // The variable is uninitialized until assigned
+  local->slot = ctx->stack_depth; // Where its value will be pushed
   local->is_captured = false;
 }
 
@@ -318,7 +590,7 @@ static int compiler_resolve_upvalue(CompilerContext *ctx, Token *name) {
   int local = compiler_resolve_local(ctx->parent, name);
   if (local != -1) {
     ctx->parent->locals[local].is_captured = true;
-    return compiler_add_upvalue(ctx, (uint8_t)local, true);
+    return compiler_add_upvalue(ctx, (uint8_t)ctx->parent->locals[local].slot, true);
   }
 
   // If we didn't find a local, look for a binding from a parent scope
@@ -336,8 +608,10 @@ static void compiler_local_mark_initialized(CompilerContext *ctx) {
   if (ctx->scope_depth == 0)
     return;
 
-  // Mark the latest local variable as initialized
+  // Mark the latest local variable as initialized, its value is now on the
+  // stack
   ctx->locals[ctx->local_count - 1].depth = ctx->scope_depth;
+  ctx->stack_depth++;
 }
 
 static void compiler_declare_variable(CompilerContext *ctx) {
@@ -365,40 +639,81 @@ static void compiler_declare_variable(CompilerContext *ctx) {
   compiler_add_local(ctx, *name);
 }
 
+static uint8_t compiler_identifier_constant(CompilerContext *ctx) {
+  return compiler_shared_constant(
+      ctx, OBJECT_VAL(mesche_object_make_string(ctx->vm, ctx->parser->previous.start,
+                                                ctx->parser->previous.length)));
+}
+
 static uint8_t compiler_parse_symbol(CompilerContext *ctx, bool is_global) {
   // Declare the variable and exit if we're in a local scope
   compiler_declare_variable(ctx);
   if (!is_global && ctx->scope_depth > 0)
     return 0;
 
-  Value new_string = OBJECT_VAL(mesche_object_make_string(ctx->vm, ctx->parser->previous.start,
-                                                          ctx->parser->previous.length));
+  return compiler_identifier_constant(ctx);
+}
 
-  // Reuse an existing constant for the same string if possible
-  uint8_t constant = 0;
-  bool value_found = false;
-  Chunk *chunk = &ctx->function->chunk;
-  for (int i = 0; i < chunk->constants.count; i++) {
-    if (mesche_value_equalp(chunk->constants.values[i], new_string)) {
-      constant = i;
-      value_found = true;
-      break;
+static Loop *compiler_resolve_loop(CompilerContext *ctx, Token *name, int local_index) {
+  for (Loop *loop = ctx->loop; loop != NULL; loop = loop->enclosing) {
+    // Locals bound inside of a loop hide its name
+    if (local_index >= loop->first_local) {
+      return NULL;
+    }
+
+    if (compiler_identifiers_equal(name, &loop->name)) {
+      return loop;
     }
   }
 
-  return value_found ? constant : compiler_make_constant(ctx, new_string);
+  return NULL;
+}
+
+static bool compiler_loop_escapes(CompilerContext *ctx, Token *name, int local_index) {
+  // A loop's name can't be used as a value or called from a function defined
+  // inside of its body, the loop doesn't exist as a closure
+  if (compiler_resolve_loop(ctx, name, local_index) != NULL) {
+    return true;
+  }
+
+  for (CompilerContext *parent = ctx->parent; local_index == -1 && parent != NULL;
+       parent = parent->parent) {
+    if (compiler_resolve_loop(parent, name, -1) != NULL) {
+      return true;
+    }
+  }
+
+  return false;
 }
 
 static void compiler_parse_identifier(CompilerContext *ctx) {
   // Are we looking at a local variable?
   int local_index = compiler_resolve_local(ctx, &ctx->parser->previous);
+  if (compiler_loop_escapes(ctx, &ctx->parser->previous, local_index)) {
+    compiler_error(ctx, "A 'let' loop can only be called in tail position of its body.");
+  }
+
   if (local_index != -1) {
-    compiler_emit_bytes(ctx, OP_READ_LOCAL, (uint8_t)local_index);
+    compiler_emit_bytes(ctx, OP_READ_LOCAL, (uint8_t)ctx->locals[local_index].slot);
   } else if ((local_index = compiler_resolve_upvalue(ctx, &ctx->parser->previous)) != -1) {
     // Found an upvalue
     compiler_emit_bytes(ctx, OP_READ_UPVALUE, (uint8_t)local_index);
   } else {
-    uint8_t variable_constant = compiler_parse_symbol(ctx, true);
+    // The script's own code runs in order so a global it has only bound to a
+    // constant so far still holds that constant, unless a loop comes back
+    // around after binding it to something else
+    if (ctx->parent == NULL && ctx->loop_depth == 0) {
+      KnownGlobal *global = compiler_known_global(
+          ctx, mesche_object_make_string(ctx->vm, ctx->parser->previous.start,
+                                         ctx->parser->previous.length));
+      if (global != NULL && global->is_constant) {
+        compiler_emit_known_constant(ctx, global->value);
+        return;
+      }
+    }
+
+    // Global references are resolved at runtime, don't declare a local for them
+    uint8_t variable_constant = compiler_identifier_constant(ctx);
     compiler_emit_bytes(ctx, OP_READ_GLOBAL, variable_constant);
   }
 }
@@ -431,12 +746,16 @@ static void compiler_parse_set(CompilerContext *ctx) {
   uint8_t instr = OP_SET_LOCAL;
   int arg = compiler_resolve_local(ctx, &ctx->parser->previous);
 
-  // If there isn't a local, use a global variable instead
-  if (arg == -1) {
-    arg = compiler_parse_symbol(ctx, true);
-    instr = OP_SET_GLOBAL;
+  // If there isn't a local, try an upvalue and then a global variable
+  if (arg != -1) {
+    arg = ctx->locals[arg].slot;
   } else if ((arg = compiler_resolve_upvalue(ctx, &ctx->parser->previous)) != -1) {
     instr = OP_SET_UPVALUE;
+  } else {
+    arg = compiler_identifier_constant(ctx);
+    instr = OP_SET_GLOBAL;
+    compiler_known_global_set(ctx, AS_STRING(ctx->function->chunk.constants.values[arg]), false,
+                              NIL_VAL);
   }
 
   compiler_parse_expr(ctx);
@@ -451,28 +770,22 @@ static void compiler_begin_scope(CompilerContext *ctx) {
 
 static void compiler_end_scope(CompilerContext *ctx) {
   // Pop all local variables from the previous scope while closing any upvalues
-  // that have been captured inside of it
+  // that have been captured inside of it.  Each instruction removes exactly
+  // one local while retaining the final expression result.
   ctx->scope_depth--;
-  uint8_t local_count = 0;
   while (ctx->local_count > 0 && ctx->locals[ctx->local_count - 1].depth > ctx->scope_depth) {
-    local_count++;
     if (ctx->locals[ctx->local_count - 1].is_captured) {
       compiler_emit_byte(ctx, OP_CLOSE_UPVALUE);
     } else {
       compiler_emit_bytes(ctx, OP_POP_SCOPE, 1);
     }
     ctx->local_count--;
+    ctx->stack_depth--;
   }
-
-  // Pop all of the locals off of the scope, retaining the final expression result
-  compiler_emit_bytes(ctx, OP_POP_SCOPE, local_count);
 }
 
-static void compiler_parse_let(CompilerContext *ctx) {
-  compiler_consume(ctx, TokenKindLeftParen, "Expected left paren after 'let'");
-
-  compiler_begin_scope(ctx);
-
+static int compiler_parse_let_bindings(CompilerContext *ctx) {
+  int binding_count = 0;
   for (;;) {
     if (ctx->parser->current.kind == TokenKindRightParen) {
       compiler_consume(ctx, TokenKindRightParen, "Expected right paren to end bindings");
@@ -486,10 +799,56 @@ static void compiler_parse_let(CompilerContext *ctx) {
     compiler_parse_symbol(ctx, false);
     compiler_parse_expr(ctx);
     compiler_define_variable(ctx, 0 /* Irrelevant, this is local */);
+    binding_count++;
 
     compiler_consume(ctx, TokenKindRightParen, "Expected right paren to end binding pair");
   }
 
+  return binding_count;
+}
+
+static void compiler_parse_named_let(CompilerContext *ctx) {
+  // The body is compiled in place and calls to the loop's name become jumps
+  // back to its start, which only works for calls the body ends with
+  Chunk *chunk = &ctx->function->chunk;
+  Loop loop = {.enclosing = ctx->loop, .name = ctx->parser->previous};
+  compiler_consume(ctx, TokenKindLeftParen, "Expected left paren after 'let' loop name");
+
+  compiler_begin_scope(ctx);
+  loop.first_local = ctx->local_count;
+  loop.first_slot = ctx->stack_depth;
+  loop.var_count = compiler_parse_let_bindings(ctx);
+  loop.start = chunk->count;
+
+  ctx->loop = &loop;
+  ctx->loop_depth++;
+  compiler_parse_block(ctx, true);
+  ctx->loop_depth--;
+  ctx->loop = loop.enclosing;
+
+  for (int i = 0; i < loop.call_count; i++) {
+    if (!compiler_leads_to(chunk, loop.call_ends[i], chunk->count)) {
+      compiler_error_at_token(ctx, &loop.name,
+                              "A 'let' loop can only be called in tail position of its body.");
+      break;
+    }
+  }
+
+  free(loop.call_ends);
+  compiler_end_scope(ctx);
+}
+
+static void compiler_parse_let(CompilerContext *ctx) {
+  if (ctx->parser->current.kind == TokenKindSymbol) {
+    compiler_advance(ctx);
+    compiler_parse_named_let(ctx);
+    return;
+  }
+
+  compiler_consume(ctx, TokenKindLeftParen, "Expected left paren after 'let'");
+
+  compiler_begin_scope(ctx);
+  compiler_parse_let_bindings(ctx);
   compiler_parse_block(ctx, true);
   compiler_end_scope(ctx);
 }
@@ -506,8 +865,6 @@ static void compiler_parse_define_attributes(CompilerContext *ctx,
       } else {
         // TODO: Warn on unknown keywords?
       }
-
-      mesche_object_free(ctx->vm, keyword);
     } else {
       break;
     }
@@ -521,12 +878,18 @@ static void compiler_parse_define_attributes(CompilerContext *ctx,
   }
 }
 
-static void compiler_parse_lambda_inner(CompilerContext *ctx, DefineAttributes *define_attributes) {
+static void compiler_parse_lambda_inner(CompilerContext *ctx, DefineAttributes *define_attributes,
+                                        Token *name) {
   // Create a new compiler context for parsing the function body
   CompilerContext func_ctx;
   compiler_init_context(&func_ctx, ctx, TYPE_FUNCTION);
   compiler_begin_scope(&func_ctx);
 
+  // Functions created by a define are named after their binding
+  if (name != NULL) {
+    func_ctx.function->name = mesche_object_make_string(ctx->vm, name->start, name->length);
+  }
+
   bool in_keyword_list = false;
   for (;;) {
     // Try to parse each argument until we reach a closing paren
@@ -575,14 +938,17 @@ static void compiler_parse_lambda_inner(CompilerContext *ctx, DefineAttributes *
                          "Expected right paren after keyword default value.");
       }
 
-      // Add the keyword definition to the function
+      // Add the keyword definition to the function, keeping the keyword on
+      // the stack in case adding it triggers a collection
       KeywordArgument keyword_arg = {
-          .name = mesche_object_make_string(ctx->vm, ctx->parser->previous.start,
-                                            ctx->parser->previous.length),
+          .name = mesche_object_make_keyword(ctx->vm, ctx->parser->previous.start,
+                                             ctx->parser->previous.length),
           .default_index = default_constant,
       };
 
+      mesche_vm_stack_push(ctx->vm, OBJECT_VAL(keyword_arg.name));
       mesche_object_function_keyword_add(ctx->mem, func_ctx.function, keyword_arg);
+      mesche_vm_stack_pop(ctx->vm);
     }
   }
 
@@ -611,7 +977,7 @@ static void compiler_parse_lambda_inner(CompilerContext *ctx, DefineAttributes *
 static void compiler_parse_lambda(CompilerContext *ctx) {
   // Consume the leading paren and let the shared lambda parser take over
   compiler_consume(ctx, TokenKindLeftParen, "Expected left paren to begin argument list.");
-  compiler_parse_lambda_inner(ctx, NULL);
+  compiler_parse_lambda_inner(ctx, NULL, NULL);
 }
 
 static void compiler_parse_define(CompilerContext *ctx) {
@@ -628,17 +994,31 @@ static void compiler_parse_define(CompilerContext *ctx) {
 
   compiler_consume(ctx, TokenKindSymbol, "Expected symbol after 'define'");
 
+  Token name = ctx->parser->previous;
   uint8_t variable_constant = variable_constant = compiler_parse_symbol(ctx, true);
+  Value value = NIL_VAL;
+  bool is_constant = false;
   if (is_func) {
     // Let the lambda parser take over
-    compiler_parse_lambda_inner(ctx, &define_attributes);
+    compiler_parse_lambda_inner(ctx, &define_attributes, &name);
   } else {
     // Parse a normal expression
+    int value_start = ctx->function->chunk.count;
     compiler_parse_expr(ctx);
+    is_constant =
+        compiler_constant_between(ctx, value_start, ctx->function->chunk.count, &value);
     compiler_parse_define_attributes(ctx, &define_attributes);
     compiler_consume(ctx, TokenKindRightParen, "Expected closing paren.");
   }
 
+  // Globals defined by functions could be defined at any time and those
+  // defined in a branch might never be
+  if (ctx->scope_depth == 0) {
+    compiler_known_global_set(
+        ctx, AS_STRING(ctx->function->chunk.constants.values[variable_constant]),
+        is_constant && ctx->parent == NULL && ctx->branch_depth == 0, value);
+  }
+
   // TODO: Only allow defines at the top of let/lambda bodies
   compiler_define_variable_ex(ctx, variable_constant, &define_attributes);
 }
@@ -667,6 +1047,9 @@ static void compiler_parse_define_module(CompilerContext *ctx) {
   compiler_parse_module_symbol_list(ctx);
   compiler_emit_byte(ctx, OP_DEFINE_MODULE);
 
+  // Globals known so far belong to the previous module
+  compiler_root_context(ctx)->known_global_count = 0;
+
   // Check for a possible 'import' expression
   if (ctx->parser->current.kind == TokenKindLeftParen) {
     compiler_consume(ctx, TokenKindLeftParen, "Expected left paren after 'define-module'");
@@ -714,6 +1097,19 @@ static void compiler_patch_jump(CompilerContext *ctx, int offset) {
   ctx->function->chunk.code[offset + 1] = jump & 0xff;
 }
 
+// Locals defined in a branch only exist on the path which ran it so they're
+// popped before the branches join again
+static void compiler_parse_branch(CompilerContext *ctx) {
+  if (ctx->scope_depth == 0) {
+    compiler_parse_expr(ctx);
+    return;
+  }
+
+  compiler_begin_scope(ctx);
+  compiler_parse_expr(ctx);
+  compiler_end_scope(ctx);
+}
+
 static void compiler_parse_if(CompilerContext *ctx) {
   // Parse predicate
   compiler_parse_expr(ctx);
@@ -723,7 +1119,8 @@ static void compiler_parse_if(CompilerContext *ctx) {
   compiler_emit_byte(ctx, OP_POP);
 
   // Parse truth expr
-  compiler_parse_expr(ctx);
+  ctx->branch_depth++;
+  compiler_parse_branch(ctx);
 
   int else_jump = compiler_emit_jump(ctx, OP_JUMP);
 
@@ -734,7 +1131,8 @@ static void compiler_parse_if(CompilerContext *ctx) {
   compiler_emit_byte(ctx, OP_POP);
 
   // Parse false expr
-  compiler_parse_expr(ctx);
+  compiler_parse_branch(ctx);
+  ctx->branch_depth--;
 
   // Patch the jump instruction after the false path has been compiled
   compiler_patch_jump(ctx, else_jump);
@@ -742,9 +1140,217 @@ static void compiler_parse_if(CompilerContext *ctx) {
   compiler_consume(ctx, TokenKindRightParen, "Expected right paren to end 'if' expression");
 }
 
+static void compiler_emit_loop(CompilerContext *ctx, int first_slot, int var_count, int start) {
+  // The loop instruction stores the values on top of the stack into the
+  // loop's variables and then jumps back to its start
+  compiler_emit_byte(ctx, OP_LOOP);
+  compiler_emit_bytes(ctx, first_slot, var_count);
+
+  int jump = ctx->function->chunk.count + 2 - start;
+  if (jump > UINT16_MAX) {
+    compiler_error(ctx, "Attempting to emit loop that is larger than possible jump size.");
+  }
+
+  compiler_emit_bytes(ctx, (jump >> 8) & 0xff, jump & 0xff);
+}
+
+static void compiler_parse_loop_call(CompilerContext *ctx, Loop *loop) {
+  int arg_count = 0;
+  while (ctx->parser->current.kind != TokenKindRightParen &&
+         ctx->parser->current.kind != TokenKindEOF) {
+    compiler_parse_expr(ctx);
+    ctx->stack_depth++;
+    arg_count++;
+  }
+  ctx->stack_depth -= arg_count;
+
+  if (arg_count != loop->var_count) {
+    compiler_error(ctx, "Wrong number of arguments passed to 'let' loop.");
+  }
+
+  compiler_emit_loop(ctx, loop->first_slot, loop->var_count, loop->start);
+
+  if (loop->call_count == loop->call_capacity) {
+    loop->call_capacity = GROW_CAPACITY(loop->call_capacity);
+    loop->call_ends = realloc(loop->call_ends, sizeof(int) * loop->call_capacity);
+    if (loop->call_ends == NULL) {
+      PANIC("Could not allocate 'let' loop calls.");
+    }
+  }
+  loop->call_ends[loop->call_count++] = ctx->function->chunk.count;
+
+  compiler_consume(ctx, TokenKindRightParen, "Expected closing paren.");
+}
+
+static void compiler_parse_do(CompilerContext *ctx) {
+  // (do ((var init step) ...) (test result ...) body ...)
+  Chunk *chunk = &ctx->function->chunk;
+  compiler_consume(ctx, TokenKindLeftParen, "Expected left paren after 'do'");
+  compiler_begin_scope(ctx);
+
+  // Steps are written before the body but run after it, so they're skipped
+  // for now and compiled once the body has been
+  int first_slot = ctx->stack_depth;
+  int var_count = 0;
+  SourcePosition steps[UINT8_COUNT];
+  bool has_step[UINT8_COUNT];
+  while (ctx->parser->current.kind != TokenKindRightParen &&
+         ctx->parser->current.kind != TokenKindEOF && var_count < UINT8_COUNT) {
+    compiler_consume(ctx, TokenKindLeftParen, "Expected left paren to start 'do' variable");
+
+    // compiler_parse_symbol expects the symbol token to be in parser->previous
+    compiler_advance(ctx);
+    compiler_parse_symbol(ctx, false);
+    compiler_parse_expr(ctx);
+    compiler_define_variable(ctx, 0 /* Irrelevant, this is local */);
+
+    has_step[var_count] = ctx->parser->current.kind != TokenKindRightParen;
+    if (has_step[var_count]) {
+      steps[var_count] = compiler_save_position(ctx);
+      compiler_skip_expr(ctx);
+    }
+
+    var_count++;
+    compiler_consume(ctx, TokenKindRightParen, "Expected right paren to end 'do' variable");
+  }
+  compiler_consume(ctx, TokenKindRightParen, "Expected right paren to end 'do' variables");
+
+  // Each pass starts by checking whether the loop is finished
+  ctx->loop_depth++;
+  ctx->branch_depth++;
+  int loop_start = chunk->count;
+  compiler_consume(ctx, TokenKindLeftParen, "Expected left paren to start 'do' test");
+  compiler_parse_expr(ctx);
+  int body_jump = compiler_emit_jump(ctx, OP_JUMP_IF_FALSE);
+
+  compiler_emit_byte(ctx, OP_POP);
+  if (ctx->parser->current.kind == TokenKindRightParen) {
+    compiler_advance(ctx);
+    compiler_emit_byte(ctx, OP_NIL);
+  } else {
+    // The result expressions are a branch the body never sees
+    compiler_begin_scope(ctx);
+    compiler_parse_block(ctx, true);
+    compiler_end_scope(ctx);
+  }
+  int exit_jump = compiler_emit_jump(ctx, OP_JUMP);
+
+  // The body is only run for its effects
+  compiler_patch_jump(ctx, body_jump);
+  compiler_emit_byte(ctx, OP_POP);
+  compiler_begin_scope(ctx);
+  int body_local_count = ctx->local_count;
+  while (ctx->parser->current.kind != TokenKindRightParen &&
+         ctx->parser->current.kind != TokenKindEOF) {
+    int local_count = ctx->local_count;
+    compiler_parse_expr(ctx);
+    if (ctx->local_count == local_count) {
+      compiler_emit_byte(ctx, OP_POP);
+    }
+  }
+
+  // Compute every variable's next value before any of them change
+  SourcePosition end = compiler_save_position(ctx);
+  for (int i = 0; i < var_count; i++) {
+    if (has_step[i]) {
+      compiler_restore_position(ctx, &steps[i]);
+      compiler_parse_expr(ctx);
+    } else {
+      compiler_emit_bytes(ctx, OP_READ_LOCAL, first_slot + i);
+    }
+    ctx->stack_depth++;
+  }
+  compiler_restore_position(ctx, &end);
+  ctx->stack_depth -= var_count;
+
+  // Jumping back discards anything the body defined
+  compiler_emit_loop(ctx, first_slot, var_count, loop_start);
+  ctx->scope_depth--;
+  ctx->stack_depth -= ctx->local_count - body_local_count;
+  ctx->local_count = body_local_count;
+  compiler_patch_jump(ctx, exit_jump);
+  ctx->branch_depth--;
+  ctx->loop_depth--;
+
+  compiler_consume(ctx, TokenKindRightParen, "Expected right paren to end 'do' expression");
+  compiler_end_scope(ctx);
+}
+
+// Evaluates an operator the way the VM would if all of its operands are
+// constant.  Operators which allocate or have side effects are left alone.
+static bool compiler_fold_operator(TokenKind operator, uint8_t operand_count, Value *operands,
+                                   Value *result) {
+  if (operator== TokenKindNot) {
+    if (operand_count != 1) {
+      return false;
+    }
+
+    *result = IS_NIL(operands[0]) ? T_VAL : NIL_VAL;
+    return true;
+  }
+
+  if (operand_count != 2) {
+    return false;
+  }
+
+  Value a = operands[0];
+  Value b = operands[1];
+  bool is_numeric = IS_NUMBER(a) && IS_NUMBER(b);
+  switch (operator) {
+  case TokenKindPlus:
+    *result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+    return is_numeric;
+  case TokenKindMinus:
+    *result = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+    return is_numeric;
+  case TokenKindStar:
+    *result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+    return is_numeric;
+  case TokenKindSlash:
+    *result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+    return is_numeric;
+  case TokenKindAnd:
+    *result = BOOL_VAL(AS_BOOL(a) && AS_BOOL(b));
+    return true;
+  case TokenKindOr:
+    *result = BOOL_VAL(AS_BOOL(a) || AS_BOOL(b));
+    return true;
+  case TokenKindEqv:
+  case TokenKindEqual:
+    *result = BOOL_VAL(mesche_value_equalp(a, b));
+    return true;
+  default:
+    return false;
+  }
+}
+
 static void compiler_parse_operator_call(CompilerContext *ctx, Token *call_token,
                                          uint8_t operand_count) {
   TokenKind operator= call_token->kind;
+
+  // Operators only take two operands so any after the first are combined
+  // before being applied to it, (- a b c) becomes (- a (+ b c))
+  for (int i = 2; i < operand_count; i++) {
+    switch (operator) {
+    case TokenKindPlus:
+    case TokenKindMinus:
+      compiler_emit_byte(ctx, OP_ADD);
+      break;
+    case TokenKindStar:
+    case TokenKindSlash:
+      compiler_emit_byte(ctx, OP_MULTIPLY);
+      break;
+    case TokenKindAnd:
+      compiler_emit_byte(ctx, OP_AND);
+      break;
+    case TokenKindOr:
+      compiler_emit_byte(ctx, OP_OR);
+      break;
+    default:
+      break;
+    }
+  }
+
   switch (operator) {
   case TokenKindPlus:
     compiler_emit_byte(ctx, OP_ADD);
@@ -792,12 +1398,19 @@ static void compiler_parse_module_import(CompilerContext *ctx) {
   compiler_parse_module_symbol_list(ctx);
   compiler_emit_byte(ctx, OP_IMPORT_MODULE);
   compiler_consume(ctx, TokenKindRightParen, "Expected right paren to complete 'module-import'");
+
+  // Imported bindings replace any globals of the same name
+  compiler_root_context(ctx)->known_global_count = 0;
+
+  // OP_IMPORT_MODULE leaves nothing on the stack but this is an expression
+  compiler_emit_byte(ctx, OP_T);
 }
 
 static void compiler_parse_module_enter(CompilerContext *ctx) {
   compiler_consume(ctx, TokenKindLeftParen, "Expected left paren after 'module-enter'");
   compiler_parse_module_symbol_list(ctx);
   compiler_emit_byte(ctx, OP_ENTER_MODULE);
+  compiler_root_context(ctx)->known_global_count = 0;
   compiler_consume(ctx, TokenKindRightParen, "Expected right paren to complete 'module-enter'");
 }
 
@@ -825,6 +1438,9 @@ static bool compiler_parse_special_form(CompilerContext *ctx, Token *call_token)
   case TokenKindLet:
     compiler_parse_let(ctx);
     break;
+  case TokenKindDo:
+    compiler_parse_do(ctx);
+    break;
   case TokenKindIf:
     compiler_parse_if(ctx);
     break;
@@ -858,6 +1474,7 @@ static void compiler_parse_quoted_list(CompilerContext *ctx) {
       // Emit the list operation
       compiler_advance(ctx);
       compiler_emit_bytes(ctx, OP_LIST, item_count);
+      ctx->stack_depth -= item_count;
       return;
     }
 
@@ -896,15 +1513,100 @@ static void compiler_parse_quoted_list(CompilerContext *ctx) {
       compiler_parse_expr(ctx);
     }
 
+    ctx->stack_depth++;
     item_count++;
   }
 }
 
+static bool compiler_parse_inline_lambda(CompilerContext *ctx) {
+  // ((lambda (param ...) body ...) arg ...)
+  //
+  // A lambda which is called where it's written can't escape, so instead of
+  // making a closure its body runs in this frame like a `let`.  Variables it
+  // would have captured are read from their slots directly.  Parameters are
+  // bound after the arguments have been evaluated, so the parameters and
+  // body are compiled by coming back to them.
+  SourcePosition callee = compiler_save_position(ctx);
+  compiler_advance(ctx);
+  if (ctx->parser->current.kind != TokenKindLambda) {
+    compiler_restore_position(ctx, &callee);
+    return false;
+  }
+
+  compiler_advance(ctx);
+  compiler_consume(ctx, TokenKindLeftParen, "Expected left paren to begin argument list.");
+  SourcePosition params = compiler_save_position(ctx);
+  int param_count = 0;
+  while (ctx->parser->current.kind == TokenKindSymbol) {
+    compiler_advance(ctx);
+    param_count++;
+  }
+
+  // Keyword parameters are matched to arguments by a real call
+  if (ctx->parser->current.kind != TokenKindRightParen) {
+    compiler_restore_position(ctx, &callee);
+    return false;
+  }
+
+  compiler_advance(ctx);
+  while (ctx->parser->current.kind != TokenKindRightParen &&
+         ctx->parser->current.kind != TokenKindEOF) {
+    compiler_skip_expr(ctx);
+  }
+  compiler_consume(ctx, TokenKindRightParen, "Expected closing paren.");
+
+  SourcePosition args = compiler_save_position(ctx);
+  int arg_count = 0;
+  bool has_keywords = false;
+  while (ctx->parser->current.kind != TokenKindRightParen &&
+         ctx->parser->current.kind != TokenKindEOF) {
+    has_keywords |= ctx->parser->current.kind == TokenKindKeyword;
+    compiler_skip_expr(ctx);
+    arg_count++;
+  }
+
+  // Calls which fail at runtime are left for the VM to report
+  if (arg_count != param_count || has_keywords || ctx->stack_depth + param_count > UINT8_MAX) {
+    compiler_restore_position(ctx, &callee);
+    return false;
+  }
+
+  compiler_restore_position(ctx, &args);
+  for (int i = 0; i < arg_count; i++) {
+    compiler_parse_expr(ctx);
+    ctx->stack_depth++;
+  }
+  ctx->stack_depth -= arg_count;
+  SourcePosition end = compiler_save_position(ctx);
+
+  compiler_restore_position(ctx, &params);
+  compiler_begin_scope(ctx);
+  for (int i = 0; i < param_count; i++) {
+    // compiler_parse_symbol expects the symbol token to be in parser->previous
+    compiler_advance(ctx);
+    compiler_parse_symbol(ctx, false);
+    compiler_define_variable(ctx, 0 /* Irrelevant, this is local */);
+  }
+  compiler_consume(ctx, TokenKindRightParen, "Expected right paren to end argument list.");
+  compiler_parse_block(ctx, true);
+  compiler_end_scope(ctx);
+
+  compiler_restore_position(ctx, &end);
+  compiler_consume(ctx, TokenKindRightParen, "Expected closing paren.");
+  return true;
+}
+
 static void compiler_parse_list(CompilerContext *ctx) {
   // Try to find the call target (this could be an expression!)
   Token call_token = ctx->parser->current;
   bool is_call = false;
 
+  // Where the code and constants for this expression start in case it gets
+  // folded into a constant
+  Chunk *chunk = &ctx->function->chunk;
+  int code_start = chunk->count;
+  int constant_start = chunk->constants.count;
+
   // Possibilities
   // - Primitive command with its own opcode
   // - Special form that has non-standard call semantics
@@ -913,9 +1615,24 @@ static void compiler_parse_list(CompilerContext *ctx) {
   // - Expression that evaluates to lambda
   // In the latter 3 cases, compiler the callee before the arguments
 
+  // Calls to a named `let` jump back to the start of its body
+  if (call_token.kind == TokenKindSymbol && ctx->loop != NULL) {
+    Loop *loop = compiler_resolve_loop(ctx, &call_token, compiler_resolve_local(ctx, &call_token));
+    if (loop != NULL) {
+      compiler_advance(ctx);
+      compiler_parse_loop_call(ctx, loop);
+      return;
+    }
+  }
+
+  if (call_token.kind == TokenKindLeftParen && compiler_parse_inline_lambda(ctx)) {
+    return;
+  }
+
   // Evaluate the first expression if it's not an operator
   if (call_token.kind == TokenKindSymbol || call_token.kind == TokenKindLeftParen) {
     compiler_parse_expr(ctx);
+    ctx->stack_depth++;
     is_call = true;
   } else {
     compiler_advance(ctx);
@@ -927,13 +1644,40 @@ static void compiler_parse_list(CompilerContext *ctx) {
 
   // Parse argument expressions until we reach a right paren
   uint8_t arg_count = 0;
+  uint8_t keyword_count = 0;
   bool in_keyword_args = false;
+  int arg_starts[UINT8_COUNT + 1];
+  Value args[UINT8_COUNT];
   for (;;) {
     // Bail out when we hit the closing parentheses
     if (ctx->parser->current.kind == TokenKindRightParen) {
-      if (is_call == false) {
+      // The callee and arguments are consumed by the call
+      ctx->stack_depth -= arg_count + (is_call ? 1 : 0);
+
+      // Arguments which are all constant may let the whole expression be
+      // evaluated now
+      arg_starts[arg_count] = chunk->count;
+      bool is_constant = !is_call && keyword_count == 0;
+      for (int i = 0; is_constant && i < arg_count; i++) {
+        is_constant = compiler_constant_between(ctx, arg_starts[i], arg_starts[i + 1], &args[i]);
+      }
+
+      Value result;
+      if (is_constant && compiler_fold_operator(call_token.kind, arg_count, args, &result)) {
+        compiler_fold_constant(ctx, code_start, constant_start, result);
+      } else if (is_call == false) {
         // Compile the primitive operator
         compiler_parse_operator_call(ctx, &call_token, arg_count);
+      } else if (keyword_count > 0) {
+        // Keyword calls carry a cache slot for matching keywords to parameters
+        int cache = mesche_chunk_keyword_cache_add(&ctx->function->chunk);
+        if (cache > UINT16_MAX) {
+          compiler_error(ctx, "Too many keyword calls in one function.");
+        }
+
+        compiler_emit_bytes(ctx, OP_CALL_KEYWORDS, arg_count);
+        compiler_emit_byte(ctx, keyword_count);
+        compiler_emit_bytes(ctx, (cache >> 8) & 0xff, cache & 0xff);
       } else {
         // Emit the call operation
         compiler_emit_bytes(ctx, OP_CALL, arg_count);
@@ -954,11 +1698,16 @@ static void compiler_parse_list(CompilerContext *ctx) {
       // Parse the keyword and value
       compiler_consume(ctx, TokenKindKeyword, "Expected keyword.");
       compiler_parse_keyword(ctx);
+      ctx->stack_depth++;
       compiler_parse_expr(ctx);
+      ctx->stack_depth++;
+      keyword_count++;
       arg_count++; // Add one more argument for the value we just parsed
     } else {
       // Compile next positional parameter
+      arg_starts[arg_count] = chunk->count;
       compiler_parse_expr(ctx);
+      ctx->stack_depth++;
     }
 
     if (arg_count == 255) {
@@ -1044,10 +1793,12 @@ ObjectFunction *mesche_compile_source(VM *vm, const char *script_source) {
   compiler_parse_block(&ctx, false);
   compiler_consume(&ctx, TokenKindEOF, "Expected end of expression.");
 
-  // Clear the VM's pointer to this compiler
+  // Retrieve the final function and then clear the VM's pointer to this
+  // compiler, finishing the function may allocate so it must stay rooted
+  ObjectFunction *function = compiler_end(&ctx);
   vm->current_compiler = NULL;
+  free(ctx.known_globals);
 
-  // Retrieve the final function and return it if there were no parse errors
-  ObjectFunction *function = compiler_end(&ctx);
+  // Return the function if there were no parse errors
   return parser.had_error ? NULL : function;
 }
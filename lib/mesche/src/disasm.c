@@ -33,6 +33,55 @@ int mesche_disasm_jump_instr(const char *name, int sign, Chunk *chunk, int offse
   return offset + 3;
 }
 
+int mesche_disasm_local_const_instr(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d  '", name, slot, constant);
+  mesche_value_print(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+static void mesche_disasm_reg_operand(Chunk *chunk, bool is_constant, uint8_t index) {
+  if (is_constant) {
+    printf(" k%-3d '", index);
+    mesche_value_print(chunk->constants.values[index]);
+    printf("'");
+  } else {
+    printf(" r%-3d", index);
+  }
+}
+
+int mesche_disasm_reg_instr(const char *name, Chunk *chunk, int offset) {
+  uint8_t mode = chunk->code[offset + 1];
+  printf("%-16s", name);
+  mesche_disasm_reg_operand(chunk, mode & OP_REG_A_CONSTANT, chunk->code[offset + 2]);
+  mesche_disasm_reg_operand(chunk, mode & OP_REG_B_CONSTANT, chunk->code[offset + 3]);
+  printf("\n");
+  return offset + 4;
+}
+
+int mesche_disasm_move_instr(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d <- %d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+  return offset + 3;
+}
+
+int mesche_disasm_loop_instr(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t count = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s %4d  %d locals -> %d\n", name, slot, count, offset + 5 - jump);
+  return offset + 5;
+}
+
+int mesche_disasm_keyword_call_instr(const char *name, Chunk *chunk, int offset) {
+  uint8_t arg_count = chunk->code[offset + 1];
+  uint8_t keyword_count = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s %4d  %d keywords, cache %d\n", name, arg_count, keyword_count, cache);
+  return offset + 5;
+}
+
 int mesche_disasm_instr(Chunk *chunk, int offset) {
   printf("%04d ", offset);
   if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -63,6 +112,14 @@ int mesche_disasm_instr(Chunk *chunk, int offset) {
     return mesche_disasm_simple_instr("OP_MULTIPLY", offset);
   case OP_DIVIDE:
     return mesche_disasm_simple_instr("OP_DIVIDE", offset);
+  case OP_ADD_NUM:
+    return mesche_disasm_simple_instr("OP_ADD_NUM", offset);
+  case OP_SUBTRACT_NUM:
+    return mesche_disasm_simple_instr("OP_SUBTRACT_NUM", offset);
+  case OP_MULTIPLY_NUM:
+    return mesche_disasm_simple_instr("OP_MULTIPLY_NUM", offset);
+  case OP_DIVIDE_NUM:
+    return mesche_disasm_simple_instr("OP_DIVIDE_NUM", offset);
   case OP_NEGATE:
     return mesche_disasm_simple_instr("OP_NEGATE", offset);
   case OP_AND:
@@ -105,8 +162,46 @@ int mesche_disasm_instr(Chunk *chunk, int offset) {
     return mesche_disasm_jump_instr("OP_JUMP", 1, chunk, offset);
   case OP_JUMP_IF_FALSE:
     return mesche_disasm_jump_instr("OP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_LOOP:
+    return mesche_disasm_loop_instr("OP_LOOP", chunk, offset);
+  case OP_POP_JUMP_IF_FALSE:
+    return mesche_disasm_jump_instr("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_EQV_JUMP_IF_FALSE:
+    return mesche_disasm_jump_instr("OP_EQV_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_ADD_LOCAL_CONSTANT:
+    return mesche_disasm_local_const_instr("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+    return mesche_disasm_local_const_instr("OP_SUBTRACT_LOCAL_CONSTANT", chunk, offset);
+  case OP_EQV_LOCAL_CONSTANT:
+    return mesche_disasm_local_const_instr("OP_EQV_LOCAL_CONSTANT", chunk, offset);
+  case OP_ADD_REG:
+    return mesche_disasm_reg_instr("OP_ADD_REG", chunk, offset);
+  case OP_SUBTRACT_REG:
+    return mesche_disasm_reg_instr("OP_SUBTRACT_REG", chunk, offset);
+  case OP_MULTIPLY_REG:
+    return mesche_disasm_reg_instr("OP_MULTIPLY_REG", chunk, offset);
+  case OP_DIVIDE_REG:
+    return mesche_disasm_reg_instr("OP_DIVIDE_REG", chunk, offset);
+  case OP_EQV_REG:
+    return mesche_disasm_reg_instr("OP_EQV_REG", chunk, offset);
+  case OP_MOVE_LOCAL:
+    return mesche_disasm_move_instr("OP_MOVE_LOCAL", chunk, offset);
+  case OP_STORE_LOCAL:
+    return mesche_disasm_byte_instr("OP_STORE_LOCAL", chunk, offset);
   case OP_CALL:
     return mesche_disasm_byte_instr("OP_CALL", chunk, offset);
+  case OP_CALL_CLOSURE_EXACT_ARITY:
+    return mesche_disasm_byte_instr("OP_CALL_CLOSURE_EXACT_ARITY", chunk, offset);
+  case OP_CALL_NATIVE:
+    return mesche_disasm_byte_instr("OP_CALL_NATIVE", chunk, offset);
+  case OP_TAIL_CALL_CLOSURE_EXACT_ARITY:
+    return mesche_disasm_byte_instr("OP_TAIL_CALL_CLOSURE_EXACT_ARITY", chunk, offset);
+  case OP_CALL_KEYWORDS:
+    return mesche_disasm_keyword_call_instr("OP_CALL_KEYWORDS", chunk, offset);
+  case OP_TAIL_CALL:
+    return mesche_disasm_byte_instr("OP_TAIL_CALL", chunk, offset);
+  case OP_TAIL_CALL_KEYWORDS:
+    return mesche_disasm_keyword_call_instr("OP_TAIL_CALL_KEYWORDS", chunk, offset);
   case OP_CLOSURE: {
     offset++;
     uint8_t constant = chunk->code[offset++];
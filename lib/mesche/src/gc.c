@@ -0,0 +1,136 @@
+#include <string.h>
+
+#include "gc.h"
+#include "mem.h"
+#include "module.h"
+#include "object.h"
+#include "vm.h"
+
+// Names of the object kinds as they appear in the swept object counts
+static const char *gc_kind_names[] = {"string",  "symbol",   "keyword",         "cons",
+                                       "upvalue", "function", "closure",         "native-function",
+                                       "pointer", "module",   "binding"};
+
+_Static_assert(sizeof(gc_kind_names) / sizeof(gc_kind_names[0]) == ObjectKindBinding + 1,
+               "Every object kind needs a name");
+_Static_assert(ObjectKindBinding < MESCHE_GC_KIND_COUNT, "MESCHE_GC_KIND_COUNT is too small");
+
+// Association lists are built up on the VM stack so that everything stays
+// reachable while the next pair is allocated.  The value of the new pair is
+// popped off the stack and the list below it gets replaced.
+static void gc_alist_add(VM *vm, const char *key) {
+  ObjectSymbol *symbol = mesche_object_make_symbol(vm, key, strlen(key));
+  mesche_vm_stack_push(vm, OBJECT_VAL(symbol));
+  ObjectCons *pair = mesche_object_make_cons(vm, OBJECT_VAL(symbol), vm->stack_top[-2]);
+  vm->stack_top[-1] = OBJECT_VAL(pair);
+  ObjectCons *list = mesche_object_make_cons(vm, OBJECT_VAL(pair), vm->stack_top[-3]);
+  mesche_vm_stack_pop(vm);
+  mesche_vm_stack_pop(vm);
+  vm->stack_top[-1] = OBJECT_VAL(list);
+}
+
+static void gc_alist_add_number(VM *vm, const char *key, double value) {
+  mesche_vm_stack_push(vm, NUMBER_VAL(value));
+  gc_alist_add(vm, key);
+}
+
+static void gc_alist_add_symbol(VM *vm, const char *key, const char *name) {
+  mesche_vm_stack_push(vm, OBJECT_VAL(mesche_object_make_symbol(vm, name, strlen(name))));
+  gc_alist_add(vm, key);
+}
+
+static void gc_push_cycle(VM *vm, const MescheGCCycleStats *cycle) {
+  // Pairs are added in reverse so that the list reads in this order:
+  // kind, trigger, forced, slices, timings, sizes and swept objects
+  mesche_vm_stack_push(vm, EMPTY_VAL);
+  mesche_vm_stack_push(vm, EMPTY_VAL);
+  for (int kind = ObjectKindBinding; kind >= 0; kind--) {
+    if (cycle->objects_swept[kind] > 0) {
+      gc_alist_add_number(vm, gc_kind_names[kind], cycle->objects_swept[kind]);
+    }
+  }
+  gc_alist_add(vm, "swept");
+
+  gc_alist_add_number(vm, "next-major-gc", cycle->next_major_gc);
+  gc_alist_add_number(vm, "heap-growth", cycle->heap_growth);
+  gc_alist_add_number(vm, "bytes-freed", cycle->bytes_freed);
+  gc_alist_add_number(vm, "bytes-after", cycle->bytes_after);
+  gc_alist_add_number(vm, "bytes-before", cycle->bytes_before);
+  gc_alist_add_number(vm, "max-pause-us", cycle->max_pause_us);
+  gc_alist_add_number(vm, "pause-us", cycle->pause_us);
+  gc_alist_add_number(vm, "slices", cycle->slice_count);
+  mesche_vm_stack_push(vm, BOOL_VAL(cycle->was_forced));
+  gc_alist_add(vm, "forced");
+  gc_alist_add_symbol(vm, "trigger", mesche_mem_gc_trigger_name(cycle->trigger));
+  gc_alist_add_symbol(vm, "kind", cycle->is_major ? "major" : "minor");
+}
+
+static Value mesche_gc_func_collect(MescheMemory *mem, int arg_count, Value *args) {
+  mesche_mem_collect_major(mem);
+  return T_VAL;
+}
+
+static Value mesche_gc_func_stats(MescheMemory *mem, int arg_count, Value *args) {
+  static const char *phase_names[] = {"idle", "mark", "sweep"};
+
+  VM *vm = (VM *)mem;
+  MescheGCStats *stats = &mem->gc_stats;
+  mesche_vm_stack_push(vm, EMPTY_VAL);
+  gc_alist_add_symbol(vm, "phase", phase_names[mem->gc_phase]);
+  gc_alist_add_number(vm, "next-major-gc", mem->next_major_gc);
+  gc_alist_add_number(vm, "next-gc", mem->next_gc);
+  gc_alist_add_number(vm, "bytes-allocated", mem->bytes_allocated);
+  gc_alist_add_number(vm, "bytes-freed", stats->bytes_freed);
+  gc_alist_add_number(vm, "max-pause-us", stats->max_pause_us);
+  gc_alist_add_number(vm, "pause-us", stats->pause_us);
+  gc_alist_add_number(vm, "major-count", stats->major_count);
+  gc_alist_add_number(vm, "minor-count", stats->minor_count);
+
+  return mesche_vm_stack_pop(vm);
+}
+
+static Value mesche_gc_func_last_cycle(MescheMemory *mem, int arg_count, Value *args) {
+  VM *vm = (VM *)mem;
+  if (mem->gc_stats.minor_count + mem->gc_stats.major_count == 0) {
+    return NIL_VAL;
+  }
+
+  gc_push_cycle(vm, &mem->gc_stats.last);
+  return mesche_vm_stack_pop(vm);
+}
+
+static Value mesche_gc_func_history(MescheMemory *mem, int arg_count, Value *args) {
+  // Returns the recorded cycles with the most recent one first
+  VM *vm = (VM *)mem;
+  mesche_vm_stack_push(vm, EMPTY_VAL);
+  for (int i = mem->gc_stats.history_count - 1; i >= 0; i--) {
+    gc_push_cycle(vm, mesche_mem_stats_history_get(mem, i));
+    ObjectCons *list = mesche_object_make_cons(vm, vm->stack_top[-1], vm->stack_top[-2]);
+    mesche_vm_stack_pop(vm);
+    vm->stack_top[-1] = OBJECT_VAL(list);
+  }
+
+  return mesche_vm_stack_pop(vm);
+}
+
+static Value mesche_gc_func_history_size_set(MescheMemory *mem, int arg_count, Value *args) {
+  if (arg_count != 1 || !IS_NUMBER(args[0])) {
+    return NIL_VAL;
+  }
+
+  mesche_mem_stats_history_size_set(mem, (int)AS_NUMBER(args[0]));
+  return T_VAL;
+}
+
+void mesche_gc_module_init(VM *vm) {
+  // Define the natives of the (mesche gc) module without leaving the
+  // current module
+  ObjectModule *previous_module = vm->current_module;
+  mesche_module_enter_by_name(vm, "mesche gc");
+  mesche_vm_define_native(vm, "gc-collect", mesche_gc_func_collect, true);
+  mesche_vm_define_native(vm, "gc-stats", mesche_gc_func_stats, true);
+  mesche_vm_define_native(vm, "gc-last-cycle", mesche_gc_func_last_cycle, true);
+  mesche_vm_define_native(vm, "gc-history", mesche_gc_func_history, true);
+  mesche_vm_define_native(vm, "gc-history-size-set!", mesche_gc_func_history_size_set, true);
+  mesche_module_enter(vm, previous_module);
+}
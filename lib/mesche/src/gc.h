@@ -0,0 +1,8 @@
+#ifndef mesche_gc_h
+#define mesche_gc_h
+
+#include "vm.h"
+
+void mesche_gc_module_init(VM *vm);
+
+#endif
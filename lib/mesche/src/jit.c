@@ -0,0 +1,716 @@
+#ifdef MESCHE_JIT
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "object.h"
+#include "op.h"
+#include "util.h"
+#include "value.h"
+#include "vm.h"
+
+// A baseline JIT which stitches a template for each instruction of a hot
+// function into x86-64 code.  Moving values around the stack is inlined,
+// everything else calls a helper with the VM, the frame and the operand.
+// Calls to closures push the callee's frame and run its native code from the
+// helper, and returns between functions pop the frame without leaving native
+// code.  Anything without a template leaves the native code so that the
+// interpreter can run it, it comes back in at the next call, return or loop.
+// Helpers which find something the template can't handle, like an operand
+// which isn't a number, leave before changing anything so that the
+// interpreter runs the instruction again and reports the error.
+//
+// While native code runs, rbx holds the VM and r12 holds the call frame.
+
+// Why native code returned to the interpreter
+#define JIT_EXIT_INTERPRET 0
+#define JIT_EXIT_DEOPT 1
+#define JIT_EXIT_RETURN 2
+
+#define JIT_VALUE_WORDS (sizeof(Value) / 8)
+_Static_assert(sizeof(Value) % 8 == 0, "Values are copied a word at a time");
+
+typedef int (*JitEntry)(VM *vm, CallFrame *frame, uint8_t *target);
+typedef bool (*JitHelper)(VM *vm, CallFrame *frame, int operand);
+
+typedef struct {
+  JitHelper helper;
+  bool can_fail;
+} JitTemplate;
+
+typedef struct {
+  int position;
+  int target;
+} JitPatch;
+
+typedef struct {
+  Chunk *chunk;
+  uint32_t *entries;
+
+  uint8_t *code;
+  int count;
+  int capacity;
+  int epilogue;
+
+  JitPatch *patches;
+  int patch_count;
+  int patch_capacity;
+} JitCompiler;
+
+static inline Value *jit_peek(VM *vm, int distance) { return &vm->stack_top[-1 - distance]; }
+
+static int jit_run(VM *vm, CallFrame *frame, MescheJitCode *jit, uint32_t entry) {
+  int status = ((JitEntry)jit->code)(vm, frame, jit->code + entry);
+  if (status == JIT_EXIT_DEOPT) {
+    jit->deopt_count++;
+  }
+
+  return status;
+}
+
+static bool jit_op_nil(VM *vm, CallFrame *frame, int operand) {
+  *vm->stack_top++ = NIL_VAL;
+  return true;
+}
+
+static bool jit_op_t(VM *vm, CallFrame *frame, int operand) {
+  *vm->stack_top++ = T_VAL;
+  return true;
+}
+
+static bool jit_op_cons(VM *vm, CallFrame *frame, int operand) {
+  // The operands stay on the stack so that they can't be collected while the
+  // cons is allocated
+  ObjectCons *cons = mesche_object_make_cons(vm, *jit_peek(vm, 1), *jit_peek(vm, 0));
+  vm->stack_top -= 2;
+  *vm->stack_top++ = OBJECT_VAL(cons);
+  return true;
+}
+
+static bool jit_op_pop_scope(VM *vm, CallFrame *frame, int operand) {
+  if (operand > 0) {
+    vm->stack_top -= operand;
+    vm->stack_top[-1] = vm->stack_top[operand - 1];
+  }
+  return true;
+}
+
+#define JIT_NUMBER_OP(name, op)                                                                    \
+  static bool jit_op_##name(VM *vm, CallFrame *frame, int operand) {                               \
+    Value *a = jit_peek(vm, 1);                                                                    \
+    Value *b = jit_peek(vm, 0);                                                                    \
+    if (!IS_NUMBER(*a) || !IS_NUMBER(*b)) {                                                        \
+      return false;                                                                                \
+    }                                                                                              \
+    *a = NUMBER_VAL(AS_NUMBER(*a) op AS_NUMBER(*b));                                               \
+    vm->stack_top--;                                                                               \
+    return true;                                                                                   \
+  }
+
+JIT_NUMBER_OP(add, +)
+JIT_NUMBER_OP(subtract, -)
+JIT_NUMBER_OP(multiply, *)
+JIT_NUMBER_OP(divide, /)
+
+#undef JIT_NUMBER_OP
+
+// The operand holds the local slot in its low byte and the constant above it
+#define JIT_LOCAL_CONSTANT_OP(name, op)                                                            \
+  static bool jit_op_##name(VM *vm, CallFrame *frame, int operand) {                               \
+    Value a = frame->slots[operand & 0xff];                                                        \
+    Value b = frame->closure->function->chunk.constants.values[operand >> 8];                      \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                                          \
+      return false;                                                                                \
+    }                                                                                              \
+    *vm->stack_top++ = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b));                                   \
+    return true;                                                                                   \
+  }
+
+JIT_LOCAL_CONSTANT_OP(add_local_constant, +)
+JIT_LOCAL_CONSTANT_OP(subtract_local_constant, -)
+
+#undef JIT_LOCAL_CONSTANT_OP
+
+static bool jit_op_eqv_local_constant(VM *vm, CallFrame *frame, int operand) {
+  Value a = frame->slots[operand & 0xff];
+  Value b = frame->closure->function->chunk.constants.values[operand >> 8];
+  *vm->stack_top++ = BOOL_VAL(mesche_value_equalp(a, b));
+  return true;
+}
+
+// Register operands are packed as the mode in the low byte followed by the
+// two operand bytes
+static inline Value jit_reg(CallFrame *frame, int operand, int constant_bit, int shift) {
+  uint8_t index = (operand >> shift) & 0xff;
+  return operand & constant_bit ? frame->closure->function->chunk.constants.values[index]
+                                : frame->slots[index];
+}
+
+#define JIT_REG_OP(name, op)                                                                       \
+  static bool jit_op_##name(VM *vm, CallFrame *frame, int operand) {                               \
+    Value a = jit_reg(frame, operand, OP_REG_A_CONSTANT, 8);                                       \
+    Value b = jit_reg(frame, operand, OP_REG_B_CONSTANT, 16);                                      \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                                          \
+      return false;                                                                                \
+    }                                                                                              \
+    *vm->stack_top++ = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b));                                   \
+    return true;                                                                                   \
+  }
+
+JIT_REG_OP(add_reg, +)
+JIT_REG_OP(subtract_reg, -)
+JIT_REG_OP(multiply_reg, *)
+JIT_REG_OP(divide_reg, /)
+
+#undef JIT_REG_OP
+
+static bool jit_op_eqv_reg(VM *vm, CallFrame *frame, int operand) {
+  Value a = jit_reg(frame, operand, OP_REG_A_CONSTANT, 8);
+  Value b = jit_reg(frame, operand, OP_REG_B_CONSTANT, 16);
+  *vm->stack_top++ = BOOL_VAL(mesche_value_equalp(a, b));
+  return true;
+}
+
+static bool jit_op_store_local(VM *vm, CallFrame *frame, int operand) {
+  frame->slots[operand] = *--vm->stack_top;
+  return true;
+}
+
+static bool jit_op_move_local(VM *vm, CallFrame *frame, int operand) {
+  frame->slots[operand & 0xff] = frame->slots[operand >> 8];
+  return true;
+}
+
+static bool jit_op_and(VM *vm, CallFrame *frame, int operand) {
+  *jit_peek(vm, 1) = BOOL_VAL(AS_BOOL(*jit_peek(vm, 1)) && AS_BOOL(*jit_peek(vm, 0)));
+  vm->stack_top--;
+  return true;
+}
+
+static bool jit_op_or(VM *vm, CallFrame *frame, int operand) {
+  *jit_peek(vm, 1) = BOOL_VAL(AS_BOOL(*jit_peek(vm, 1)) || AS_BOOL(*jit_peek(vm, 0)));
+  vm->stack_top--;
+  return true;
+}
+
+static bool jit_op_not(VM *vm, CallFrame *frame, int operand) {
+  *jit_peek(vm, 0) = IS_NIL(*jit_peek(vm, 0)) ? T_VAL : NIL_VAL;
+  return true;
+}
+
+static bool jit_op_eqv(VM *vm, CallFrame *frame, int operand) {
+  *jit_peek(vm, 1) = BOOL_VAL(mesche_value_equalp(*jit_peek(vm, 1), *jit_peek(vm, 0)));
+  vm->stack_top--;
+  return true;
+}
+
+// Only bindings which the interpreter has already resolved are used, a
+// stale cache goes back to it so that it can look the name up again
+static GlobalCache *jit_global_cache(VM *vm, CallFrame *frame, int constant) {
+  Table *globals =
+      frame->closure->module ? &frame->closure->module->locals : &vm->current_module->locals;
+  GlobalCache *cache = &frame->closure->function->chunk.global_caches[constant];
+  if (cache->table != globals || cache->version != globals->version) {
+    return NULL;
+  }
+
+  return cache;
+}
+
+static bool jit_op_read_global(VM *vm, CallFrame *frame, int operand) {
+  GlobalCache *cache = jit_global_cache(vm, frame, operand);
+  if (cache == NULL) {
+    return false;
+  }
+
+  *vm->stack_top++ = cache->binding->value;
+  return true;
+}
+
+static bool jit_op_set_global(VM *vm, CallFrame *frame, int operand) {
+  GlobalCache *cache = jit_global_cache(vm, frame, operand);
+  if (cache == NULL) {
+    return false;
+  }
+
+  cache->binding->value = *jit_peek(vm, 0);
+  mesche_object_write_barrier(vm, (Object *)cache->binding, cache->binding->value);
+  return true;
+}
+
+static bool jit_op_read_upvalue(VM *vm, CallFrame *frame, int operand) {
+  *vm->stack_top++ = *frame->closure->upvalues[operand]->location;
+  return true;
+}
+
+static bool jit_op_set_upvalue(VM *vm, CallFrame *frame, int operand) {
+  ObjectUpvalue *upvalue = frame->closure->upvalues[operand];
+  *upvalue->location = *jit_peek(vm, 0);
+  mesche_object_write_barrier(vm, (Object *)upvalue, *upvalue->location);
+  return true;
+}
+
+// Conditional jumps return whether the jump is taken
+
+static bool jit_op_jump_if_false(VM *vm, CallFrame *frame, int operand) {
+  return IS_FALSEY(*jit_peek(vm, 0));
+}
+
+static bool jit_op_pop_jump_if_false(VM *vm, CallFrame *frame, int operand) {
+  return IS_FALSEY(*--vm->stack_top);
+}
+
+static bool jit_op_eqv_jump_if_false(VM *vm, CallFrame *frame, int operand) {
+  vm->stack_top -= 2;
+  return !mesche_value_equalp(vm->stack_top[0], vm->stack_top[1]);
+}
+
+static bool jit_op_loop(VM *vm, CallFrame *frame, int operand) {
+  mesche_vm_loop_store(vm, &frame->slots[operand & 0xff], operand >> 8);
+  return true;
+}
+
+// Returns whether the callee returned without leaving native code.  When a
+// call can't be made here the frame's ip is moved back to the call so that
+// the interpreter makes it instead.
+static bool jit_op_call(VM *vm, CallFrame *frame, int operand) {
+  Value callee = *jit_peek(vm, operand);
+  ObjectFunction *function = IS_CLOSURE(callee) ? AS_CLOSURE(callee)->function : NULL;
+  if (function == NULL || function->arity != operand || function->keyword_args.count > 0 ||
+      vm->jit_depth == JIT_CALL_DEPTH_MAX || !mesche_vm_jit_call(vm, AS_CLOSURE(callee), operand)) {
+    frame->ip -= 2;
+    return false;
+  }
+
+  // The interpreter runs callees which haven't been compiled
+  MescheJitCode *jit = function->jit;
+  if (jit == NULL || jit->deopt_count >= JIT_DEOPT_LIMIT) {
+    return false;
+  }
+
+  vm->jit_depth++;
+  int status = jit_run(vm, &vm->frames[vm->frame_count - 1], jit, jit->entries[0]);
+  vm->jit_depth--;
+
+  return status == JIT_EXIT_RETURN;
+}
+
+static bool jit_op_return(VM *vm, CallFrame *frame, int operand) {
+  // Module scripts and the last frame are returned from by the interpreter
+  if (frame->closure->function->type != TYPE_FUNCTION || vm->frame_count == 1) {
+    return false;
+  }
+
+  mesche_vm_jit_return(vm);
+  return true;
+}
+
+// Quickened instructions share the template of their generic form
+static const JitTemplate jit_templates[OP_COUNT] = {
+    [OP_NIL] = {jit_op_nil, false},
+    [OP_T] = {jit_op_t, false},
+    [OP_POP_SCOPE] = {jit_op_pop_scope, false},
+    [OP_CONS] = {jit_op_cons, false},
+    [OP_ADD] = {jit_op_add, true},
+    [OP_SUBTRACT] = {jit_op_subtract, true},
+    [OP_MULTIPLY] = {jit_op_multiply, true},
+    [OP_DIVIDE] = {jit_op_divide, true},
+    [OP_ADD_NUM] = {jit_op_add, true},
+    [OP_SUBTRACT_NUM] = {jit_op_subtract, true},
+    [OP_MULTIPLY_NUM] = {jit_op_multiply, true},
+    [OP_DIVIDE_NUM] = {jit_op_divide, true},
+    [OP_ADD_LOCAL_CONSTANT] = {jit_op_add_local_constant, true},
+    [OP_SUBTRACT_LOCAL_CONSTANT] = {jit_op_subtract_local_constant, true},
+    [OP_EQV_LOCAL_CONSTANT] = {jit_op_eqv_local_constant, false},
+    [OP_ADD_REG] = {jit_op_add_reg, true},
+    [OP_SUBTRACT_REG] = {jit_op_subtract_reg, true},
+    [OP_MULTIPLY_REG] = {jit_op_multiply_reg, true},
+    [OP_DIVIDE_REG] = {jit_op_divide_reg, true},
+    [OP_EQV_REG] = {jit_op_eqv_reg, false},
+    [OP_STORE_LOCAL] = {jit_op_store_local, false},
+    [OP_MOVE_LOCAL] = {jit_op_move_local, false},
+    [OP_AND] = {jit_op_and, false},
+    [OP_OR] = {jit_op_or, false},
+    [OP_NOT] = {jit_op_not, false},
+    [OP_EQV] = {jit_op_eqv, false},
+    [OP_EQUAL] = {jit_op_eqv, false},
+    [OP_READ_GLOBAL] = {jit_op_read_global, true},
+    [OP_SET_GLOBAL] = {jit_op_set_global, true},
+    [OP_READ_UPVALUE] = {jit_op_read_upvalue, false},
+    [OP_SET_UPVALUE] = {jit_op_set_upvalue, false},
+    [OP_JUMP_IF_FALSE] = {jit_op_jump_if_false, false},
+    [OP_POP_JUMP_IF_FALSE] = {jit_op_pop_jump_if_false, false},
+    [OP_EQV_JUMP_IF_FALSE] = {jit_op_eqv_jump_if_false, false},
+    [OP_LOOP] = {jit_op_loop, false},
+};
+
+// Code emission
+
+static void jit_emit(JitCompiler *compiler, const uint8_t *bytes, int count) {
+  if (compiler->count + count > compiler->capacity) {
+    while (compiler->count + count > compiler->capacity) {
+      compiler->capacity = GROW_CAPACITY(compiler->capacity);
+    }
+
+    compiler->code = realloc(compiler->code, compiler->capacity);
+    if (compiler->code == NULL) {
+      PANIC("Could not allocate JIT code buffer.");
+    }
+  }
+
+  memcpy(compiler->code + compiler->count, bytes, count);
+  compiler->count += count;
+}
+
+#define JIT_EMIT(compiler, ...)                                                                    \
+  jit_emit(compiler, (const uint8_t[]){__VA_ARGS__}, sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void jit_emit_u32(JitCompiler *compiler, uint32_t value) {
+  jit_emit(compiler, (const uint8_t *)&value, sizeof(uint32_t));
+}
+
+static void jit_emit_u64(JitCompiler *compiler, uint64_t value) {
+  jit_emit(compiler, (const uint8_t *)&value, sizeof(uint64_t));
+}
+
+static void jit_patch_u32(JitCompiler *compiler, int position, uint32_t value) {
+  memcpy(compiler->code + position, &value, sizeof(uint32_t));
+}
+
+static void jit_emit_jump_to(JitCompiler *compiler, int target) {
+  if (compiler->patch_count == compiler->patch_capacity) {
+    compiler->patch_capacity = GROW_CAPACITY(compiler->patch_capacity);
+    compiler->patches = realloc(compiler->patches, sizeof(JitPatch) * compiler->patch_capacity);
+    if (compiler->patches == NULL) {
+      PANIC("Could not allocate JIT jump patches.");
+    }
+  }
+
+  // The displacement is filled in once the target's native offset is known
+  compiler->patches[compiler->patch_count++] =
+      (JitPatch){.position = compiler->count, .target = target};
+  jit_emit_u32(compiler, 0);
+}
+
+// mov rcx, [rbx + stack_top]
+static void jit_emit_load_stack_top(JitCompiler *compiler) {
+  JIT_EMIT(compiler, 0x48, 0x8b, 0x8b);
+  jit_emit_u32(compiler, offsetof(VM, stack_top));
+}
+
+// mov [rbx + stack_top], rcx
+static void jit_emit_store_stack_top(JitCompiler *compiler) {
+  JIT_EMIT(compiler, 0x48, 0x89, 0x8b);
+  jit_emit_u32(compiler, offsetof(VM, stack_top));
+}
+
+// mov rax, [r12 + slots]
+static void jit_emit_load_slots(JitCompiler *compiler) {
+  JIT_EMIT(compiler, 0x49, 0x8b, 0x84, 0x24);
+  jit_emit_u32(compiler, offsetof(CallFrame, slots));
+}
+
+// Pushes the value which rax points to
+static void jit_emit_push_from_rax(JitCompiler *compiler, int32_t displacement) {
+  jit_emit_load_stack_top(compiler);
+  for (int i = 0; i < JIT_VALUE_WORDS; i++) {
+    // mov rdx, [rax + displacement]; mov [rcx + i * 8], rdx
+    JIT_EMIT(compiler, 0x48, 0x8b, 0x90);
+    jit_emit_u32(compiler, displacement + i * 8);
+    JIT_EMIT(compiler, 0x48, 0x89, 0x91);
+    jit_emit_u32(compiler, i * 8);
+  }
+
+  // add rcx, sizeof(Value)
+  JIT_EMIT(compiler, 0x48, 0x81, 0xc1);
+  jit_emit_u32(compiler, sizeof(Value));
+  jit_emit_store_stack_top(compiler);
+}
+
+static void jit_emit_set_ip(JitCompiler *compiler, int offset) {
+  // mov rax, ip; mov [r12 + ip], rax
+  JIT_EMIT(compiler, 0x48, 0xb8);
+  jit_emit_u64(compiler, (uint64_t)(uintptr_t)(compiler->chunk->code + offset));
+  JIT_EMIT(compiler, 0x49, 0x89, 0x84, 0x24);
+  jit_emit_u32(compiler, offsetof(CallFrame, ip));
+}
+
+static void jit_emit_leave(JitCompiler *compiler, int status) {
+  // mov eax, status; jmp epilogue
+  JIT_EMIT(compiler, 0xb8);
+  jit_emit_u32(compiler, status);
+  JIT_EMIT(compiler, 0xe9);
+  jit_emit_u32(compiler, compiler->epilogue - (compiler->count + 4));
+}
+
+// Leaves native code with the frame's ip pointing at the instruction
+static void jit_emit_exit(JitCompiler *compiler, int offset, int status) {
+  jit_emit_set_ip(compiler, offset);
+  jit_emit_leave(compiler, status);
+}
+
+static void jit_emit_helper_call(JitCompiler *compiler, JitHelper helper, int operand) {
+  // mov rdi, rbx; mov rsi, r12; mov edx, operand
+  JIT_EMIT(compiler, 0x48, 0x89, 0xdf, 0x4c, 0x89, 0xe6, 0xba);
+  jit_emit_u32(compiler, operand);
+
+  // mov rax, helper; call rax
+  JIT_EMIT(compiler, 0x48, 0xb8);
+  jit_emit_u64(compiler, (uint64_t)(uintptr_t)helper);
+  JIT_EMIT(compiler, 0xff, 0xd0);
+}
+
+static void jit_emit_template(JitCompiler *compiler, int offset, const JitTemplate *template,
+                              int operand) {
+  jit_emit_helper_call(compiler, template->helper, operand);
+  if (template->can_fail) {
+    // test al, al; jnz over the exit
+    JIT_EMIT(compiler, 0x84, 0xc0, 0x75, 0x00);
+    int skip = compiler->count;
+    jit_emit_exit(compiler, offset, JIT_EXIT_DEOPT);
+    compiler->code[skip - 1] = compiler->count - skip;
+  }
+}
+
+static void jit_emit_prologue(JitCompiler *compiler) {
+  // push rbx; push r12; push r13 to keep the stack aligned for calls
+  JIT_EMIT(compiler, 0x53, 0x41, 0x54, 0x41, 0x55);
+
+  // mov rbx, rdi; mov r12, rsi; jmp rdx
+  JIT_EMIT(compiler, 0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4, 0xff, 0xe2);
+
+  // pop r13; pop r12; pop rbx; ret
+  compiler->epilogue = compiler->count;
+  JIT_EMIT(compiler, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+}
+
+static int jit_jump_target(Chunk *chunk, int offset) {
+  return offset + 3 + (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+}
+
+static int jit_loop_target(Chunk *chunk, int offset) {
+  return offset + 5 - (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+}
+
+static void jit_compile_instr(JitCompiler *compiler, int offset) {
+  uint8_t *code = compiler->chunk->code;
+  uint8_t instr = code[offset];
+  int skip;
+
+  switch (instr) {
+  case OP_CONSTANT: {
+    // mov rax, &constant
+    Value *constant = &compiler->chunk->constants.values[code[offset + 1]];
+    JIT_EMIT(compiler, 0x48, 0xb8);
+    jit_emit_u64(compiler, (uint64_t)(uintptr_t)constant);
+    jit_emit_push_from_rax(compiler, 0);
+    return;
+  }
+  case OP_READ_LOCAL:
+    jit_emit_load_slots(compiler);
+    jit_emit_push_from_rax(compiler, code[offset + 1] * sizeof(Value));
+    return;
+  case OP_SET_LOCAL:
+    jit_emit_load_slots(compiler);
+    jit_emit_load_stack_top(compiler);
+    for (int i = 0; i < JIT_VALUE_WORDS; i++) {
+      // mov rdx, [rcx - sizeof(Value) + i * 8]; mov [rax + slot + i * 8], rdx
+      JIT_EMIT(compiler, 0x48, 0x8b, 0x91);
+      jit_emit_u32(compiler, (int32_t)(i * 8 - sizeof(Value)));
+      JIT_EMIT(compiler, 0x48, 0x89, 0x90);
+      jit_emit_u32(compiler, code[offset + 1] * sizeof(Value) + i * 8);
+    }
+    return;
+  case OP_POP:
+    // sub qword [rbx + stack_top], sizeof(Value)
+    JIT_EMIT(compiler, 0x48, 0x81, 0xab);
+    jit_emit_u32(compiler, offsetof(VM, stack_top));
+    jit_emit_u32(compiler, sizeof(Value));
+    return;
+  case OP_JUMP:
+    // jmp target
+    JIT_EMIT(compiler, 0xe9);
+    jit_emit_jump_to(compiler, jit_jump_target(compiler->chunk, offset));
+    return;
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_EQV_JUMP_IF_FALSE:
+    // test al, al; jnz target
+    jit_emit_helper_call(compiler, jit_templates[instr].helper, 0);
+    JIT_EMIT(compiler, 0x84, 0xc0, 0x0f, 0x85);
+    jit_emit_jump_to(compiler, jit_jump_target(compiler->chunk, offset));
+    return;
+  case OP_LOOP:
+    // Loops stay in native code, jmp target
+    jit_emit_helper_call(compiler, jit_templates[instr].helper,
+                         code[offset + 1] | (code[offset + 2] << 8));
+    JIT_EMIT(compiler, 0xe9);
+    jit_emit_jump_to(compiler, jit_loop_target(compiler->chunk, offset));
+    return;
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+  case OP_EQV_LOCAL_CONSTANT:
+  case OP_MOVE_LOCAL:
+    jit_emit_template(compiler, offset, &jit_templates[instr],
+                      code[offset + 1] | (code[offset + 2] << 8));
+    return;
+  case OP_ADD_REG:
+  case OP_SUBTRACT_REG:
+  case OP_MULTIPLY_REG:
+  case OP_DIVIDE_REG:
+  case OP_EQV_REG:
+    jit_emit_template(compiler, offset, &jit_templates[instr],
+                      code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16));
+    return;
+  case OP_CALL:
+  case OP_CALL_CLOSURE_EXACT_ARITY:
+    // The ip is where the caller picks up again, natively or in the
+    // interpreter.  test al, al; jnz over the exit.
+    jit_emit_set_ip(compiler, offset + 2);
+    jit_emit_helper_call(compiler, jit_op_call, code[offset + 1]);
+    JIT_EMIT(compiler, 0x84, 0xc0, 0x75, 0x00);
+    skip = compiler->count;
+    jit_emit_leave(compiler, JIT_EXIT_INTERPRET);
+    compiler->code[skip - 1] = compiler->count - skip;
+    return;
+  case OP_RETURN:
+    // test al, al; jnz over the exit to leave for the caller's code
+    jit_emit_helper_call(compiler, jit_op_return, 0);
+    JIT_EMIT(compiler, 0x84, 0xc0, 0x75, 0x00);
+    skip = compiler->count;
+    jit_emit_exit(compiler, offset, JIT_EXIT_INTERPRET);
+    compiler->code[skip - 1] = compiler->count - skip;
+    jit_emit_leave(compiler, JIT_EXIT_RETURN);
+    return;
+  default:
+    break;
+  }
+
+  if (jit_templates[instr].helper == NULL) {
+    // Tail calls, natives and everything else are left to the interpreter
+    jit_emit_exit(compiler, offset, JIT_EXIT_INTERPRET);
+    return;
+  }
+
+  int operand = mesche_chunk_instr_length(compiler->chunk, offset) > 1 ? code[offset + 1] : 0;
+  jit_emit_template(compiler, offset, &jit_templates[instr], operand);
+}
+
+void mesche_jit_init(VM *vm) {
+  char *threshold = getenv("MESCHE_JIT_THRESHOLD");
+  vm->jit_threshold = threshold != NULL ? atoi(threshold) : JIT_DEFAULT_THRESHOLD;
+  vm->jit_depth = 0;
+}
+
+void mesche_jit_compile(VM *vm, ObjectFunction *function) {
+  JitCompiler compiler;
+  memset(&compiler, 0, sizeof(JitCompiler));
+  compiler.chunk = &function->chunk;
+
+  int count = function->chunk.count;
+  compiler.entries = malloc(sizeof(uint32_t) * count);
+  if (compiler.entries == NULL) {
+    PANIC("Could not allocate JIT entries.");
+  }
+
+  for (int i = 0; i < count; i++) {
+    compiler.entries[i] = JIT_NO_ENTRY;
+  }
+
+  jit_emit_prologue(&compiler);
+  for (int offset = 0; offset < count; offset += mesche_chunk_instr_length(compiler.chunk, offset)) {
+    compiler.entries[offset] = compiler.count;
+    jit_compile_instr(&compiler, offset);
+  }
+
+  // Jumps which don't land on an instruction can't be compiled, the function
+  // stays interpreted
+  bool is_valid = true;
+  for (int i = 0; i < compiler.patch_count; i++) {
+    JitPatch *patch = &compiler.patches[i];
+    if (patch->target >= count || compiler.entries[patch->target] == JIT_NO_ENTRY) {
+      is_valid = false;
+      break;
+    }
+
+    jit_patch_u32(&compiler, patch->position,
+                  compiler.entries[patch->target] - (patch->position + 4));
+  }
+
+  // Copy the code into executable memory
+  uint8_t *code = NULL;
+  if (is_valid) {
+    code = mmap(NULL, compiler.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+      code = NULL;
+    } else {
+      memcpy(code, compiler.code, compiler.count);
+      if (mprotect(code, compiler.count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, compiler.count);
+        code = NULL;
+      }
+    }
+  }
+
+  free(compiler.code);
+  free(compiler.patches);
+  if (code == NULL) {
+    free(compiler.entries);
+    return;
+  }
+
+  MescheJitCode *jit = malloc(sizeof(MescheJitCode));
+  if (jit == NULL) {
+    PANIC("Could not allocate JIT code.");
+  }
+
+  jit->code = code;
+  jit->size = compiler.count;
+  jit->entries = compiler.entries;
+  jit->deopt_count = 0;
+  function->jit = jit;
+}
+
+void mesche_jit_enter(VM *vm, CallFrame *frame) {
+  // Carry on in the caller's code for as long as frames return natively
+  for (;;) {
+    ObjectFunction *function = frame->closure->function;
+    MescheJitCode *jit = function->jit;
+    if (jit == NULL) {
+      return;
+    }
+
+    if (jit->deopt_count >= JIT_DEOPT_LIMIT) {
+      // The function isn't called the way its code expects, keep interpreting
+      // it.  No native code is running here so its code can be freed.
+      mesche_jit_function_free(function);
+      return;
+    }
+
+    uint32_t entry = jit->entries[frame->ip - function->chunk.code];
+    if (entry == JIT_NO_ENTRY || jit_run(vm, frame, jit, entry) != JIT_EXIT_RETURN) {
+      return;
+    }
+
+    frame = &vm->frames[vm->frame_count - 1];
+  }
+}
+
+void mesche_jit_function_free(ObjectFunction *function) {
+  MescheJitCode *jit = function->jit;
+  if (jit == NULL) {
+    return;
+  }
+
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+  function->jit = NULL;
+}
+
+#endif
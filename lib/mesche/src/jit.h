@@ -0,0 +1,45 @@
+#ifndef mesche_jit_h
+#define mesche_jit_h
+
+#ifdef MESCHE_JIT
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "MESCHE_JIT is only supported on x86-64 Linux"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "vm.h"
+
+// How many calls make a function hot enough to compile when
+// MESCHE_JIT_THRESHOLD isn't set
+#define JIT_DEFAULT_THRESHOLD 1000
+
+// Compiled code which keeps bailing out is thrown away after this many times
+#define JIT_DEOPT_LIMIT 64
+
+// Native calls nest on the C stack, deeper calls go through the interpreter
+#define JIT_CALL_DEPTH_MAX 256
+
+// Marks bytecode offsets where native code can't be entered
+#define JIT_NO_ENTRY UINT32_MAX
+
+typedef struct MescheJitCode {
+  uint8_t *code;
+  size_t size;
+
+  // The native offset of each instruction, indexed by bytecode offset
+  uint32_t *entries;
+  int deopt_count;
+} MescheJitCode;
+
+void mesche_jit_init(VM *vm);
+void mesche_jit_compile(VM *vm, ObjectFunction *function);
+void mesche_jit_enter(VM *vm, CallFrame *frame);
+void mesche_jit_function_free(ObjectFunction *function);
+
+#endif
+
+#endif
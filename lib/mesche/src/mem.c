@@ -1,3 +1,5 @@
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -11,13 +13,110 @@
 // The factor by which the heap limit will be extended after a sweep
 #define GC_HEAP_GROW_FACTOR 2;
 
+// How much can be allocated between minor collections of the young generation
+#define GC_NURSERY_SIZE 256 * 1024;
+
+// How much can be allocated between slices of an incremental collection
+#define GC_STEP_SIZE (64 * 1024)
+
+// The default time budget of a slice which is triggered by an allocation
+#define GC_STEP_BUDGET_US 1000
+
 void mesche_mem_init(MescheMemory *mem, MescheMemoryCollectGarbageFunc collect_garbage_func) {
   mem->collect_garbage_func = collect_garbage_func;
   mem->bytes_allocated = 0;
-  mem->next_gc = GC_INITIAL_LIMIT;
+  mem->next_gc = GC_NURSERY_SIZE;
+  mem->next_major_gc = GC_INITIAL_LIMIT;
+  mem->gc_phase = MESCHE_GC_IDLE;
+  mem->gc_step_budget_us = GC_STEP_BUDGET_US;
+  memset(&mem->gc_stats, 0, sizeof(MescheGCStats));
+
+  for (int i = 0; i < MEM_POOL_CLASS_COUNT; i++) {
+    mem->pools[i].block_size = (i + 1) * MEM_POOL_GRANULE;
+    mem->pools[i].pages = NULL;
+    mem->pools[i].free_pages = NULL;
+  }
+
+  mem->young_pages = NULL;
+  mem->young_large_cells = NULL;
+  mem->large_cells = NULL;
+  mem->gc_epoch = 0;
 }
 
-void *mesche_mem_realloc(MescheMemory *mem, void *mem_ptr, size_t old_size, size_t new_size) {
+// Blocks start after the page header, rounded up to keep them aligned
+#define MEM_POOL_PAGE_HEADER                                                                       \
+  ((sizeof(MeschePoolPage) + MEM_POOL_GRANULE - 1) & ~(size_t)(MEM_POOL_GRANULE - 1))
+
+static inline MeschePool *mem_pool_for_size(MescheMemory *mem, size_t size) {
+  return &mem->pools[(size - 1) / MEM_POOL_GRANULE];
+}
+
+static void mem_pool_add_page(MescheMemory *mem, MeschePool *pool) {
+  MeschePoolPage *page = aligned_alloc(MEM_POOL_PAGE_SIZE, MEM_POOL_PAGE_SIZE);
+  if (page == NULL) {
+    PANIC("Memory pool page allocation failed!\n");
+  }
+
+  page->live_count = 0;
+  page->free_list = NULL;
+  page->swept_epoch = mem->gc_epoch;
+  page->has_young_cells = false;
+  page->next_young = NULL;
+  memset(page->cell_bits, 0, sizeof(page->cell_bits));
+  memset(page->mark_bits, 0, sizeof(page->mark_bits));
+  page->next = pool->pages;
+  pool->pages = page;
+  page->has_free_blocks = true;
+  page->next_free = pool->free_pages;
+  pool->free_pages = page;
+
+  // Thread every block in the page onto the free list, last block first so
+  // that allocations walk the page in address order
+  char *first_block = (char *)page + MEM_POOL_PAGE_HEADER;
+  size_t block_count = (MEM_POOL_PAGE_SIZE - MEM_POOL_PAGE_HEADER) / pool->block_size;
+  for (size_t i = block_count; i > 0; i--) {
+    MeschePoolBlock *block = (MeschePoolBlock *)(first_block + (i - 1) * pool->block_size);
+    block->next = page->free_list;
+    page->free_list = block;
+  }
+}
+
+static void *mem_pool_alloc(MescheMemory *mem, size_t size) {
+  MeschePool *pool = mem_pool_for_size(mem, size);
+  if (pool->free_pages == NULL) {
+    mem_pool_add_page(mem, pool);
+  }
+
+  MeschePoolPage *page = pool->free_pages;
+  MeschePoolBlock *block = page->free_list;
+  page->free_list = block->next;
+  page->live_count++;
+
+  // Full pages leave the list of pages to allocate from
+  if (page->free_list == NULL) {
+    pool->free_pages = page->next_free;
+    page->has_free_blocks = false;
+  }
+
+  return block;
+}
+
+static void mem_pool_free(MescheMemory *mem, void *mem_ptr, size_t size) {
+  MeschePool *pool = mem_pool_for_size(mem, size);
+  MeschePoolBlock *block = (MeschePoolBlock *)mem_ptr;
+  MeschePoolPage *page = mesche_mem_pool_page(block);
+  block->next = page->free_list;
+  page->free_list = block;
+  page->live_count--;
+
+  if (!page->has_free_blocks) {
+    page->has_free_blocks = true;
+    page->next_free = pool->free_pages;
+    pool->free_pages = page;
+  }
+}
+
+static inline void mem_account(MescheMemory *mem, size_t old_size, size_t new_size) {
   // Adjust the memory allocation amount
   mem->bytes_allocated += new_size - old_size;
 
@@ -31,43 +130,358 @@ void *mesche_mem_realloc(MescheMemory *mem, void *mem_ptr, size_t old_size, size
     }
 #endif
   }
+}
 
-  if (new_size == 0) {
-    free(mem_ptr);
-    return NULL;
+void *mesche_mem_realloc(MescheMemory *mem, void *mem_ptr, size_t old_size, size_t new_size) {
+  mem_account(mem, old_size, new_size);
+
+  // Small blocks come from the size class pools, anything larger goes
+  // straight to the system allocator
+  bool old_pooled = mem_ptr != NULL && old_size > 0 && old_size <= MEM_POOL_MAX_SIZE;
+  bool new_pooled = new_size > 0 && new_size <= MEM_POOL_MAX_SIZE;
+  if (old_pooled && new_pooled &&
+      mem_pool_for_size(mem, old_size) == mem_pool_for_size(mem, new_size)) {
+    return mem_ptr;
   }
 
-  void *new_ptr = realloc(mem_ptr, new_size);
-  if (new_ptr == NULL) {
-    // Reallocation failed, bail out
-    // TODO: Is there a more specific error code I can check?
-    PANIC("Memory reallocation failed!\n");
+  if (!old_pooled && !new_pooled) {
+    if (new_size == 0) {
+      free(mem_ptr);
+      return NULL;
+    }
+
+    void *new_ptr = realloc(mem_ptr, new_size);
+    if (new_ptr == NULL) {
+      // Reallocation failed, bail out
+      // TODO: Is there a more specific error code I can check?
+      PANIC("Memory reallocation failed!\n");
+    }
+
+    return new_ptr;
+  }
+
+  // Moving between a pool and the system allocator (or between two pools)
+  // needs a copy
+  void *new_ptr = NULL;
+  if (new_pooled) {
+    new_ptr = mem_pool_alloc(mem, new_size);
+  } else if (new_size > 0) {
+    new_ptr = malloc(new_size);
+    if (new_ptr == NULL) {
+      PANIC("Memory reallocation failed!\n");
+    }
+  }
+
+  if (mem_ptr != NULL) {
+    if (new_ptr != NULL) {
+      memcpy(new_ptr, mem_ptr, old_size < new_size ? old_size : new_size);
+    }
+
+    if (old_pooled) {
+      mem_pool_free(mem, mem_ptr, old_size);
+    } else {
+      free(mem_ptr);
+    }
   }
 
   return new_ptr;
 }
 
-void mesche_mem_collect_garbage(MescheMemory *mem) {
+void *mesche_mem_cell_alloc(MescheMemory *mem, size_t size) {
+  mem_account(mem, 0, size);
+
+  // Cells allocated while a major collection is running belong to the old
+  // generation, so only cells allocated outside of one are tracked as young
+  if (size > MEM_POOL_MAX_SIZE) {
+    MescheLargeCell *large = malloc(sizeof(MescheLargeCell) + size);
+    if (large == NULL) {
+      PANIC("Memory allocation failed!\n");
+    }
+
+    large->size = size;
+    large->is_marked = false;
+    if (mem->gc_phase == MESCHE_GC_IDLE) {
+      large->next = mem->young_large_cells;
+      mem->young_large_cells = large;
+    } else {
+      large->next = mem->large_cells;
+      mem->large_cells = large;
+    }
+
+    return large + 1;
+  }
+
+  void *cell = mem_pool_alloc(mem, size);
+  MeschePoolPage *page = mesche_mem_pool_page(cell);
+  int bit = mesche_mem_cell_bit(cell);
+  page->cell_bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+
+  if (mem->gc_phase == MESCHE_GC_IDLE) {
+    if (!page->has_young_cells) {
+      page->has_young_cells = true;
+      page->next_young = mem->young_pages;
+      mem->young_pages = page;
+    }
+  } else if (mem->gc_phase == MESCHE_GC_SWEEP && page->swept_epoch != mem->gc_epoch) {
+    // The page hasn't been swept yet, so the new cell must look marked
+    mesche_mem_cell_mark(cell, false);
+  }
+
+  return cell;
+}
+
+void mesche_mem_cell_free(MescheMemory *mem, void *cell, size_t size) {
+  // Large cells have to be unlinked from their list by the caller
+  mem->bytes_allocated -= size;
+  if (size > MEM_POOL_MAX_SIZE) {
+    free(mesche_mem_large_cell(cell));
+    return;
+  }
+
+  MeschePoolPage *page = mesche_mem_pool_page(cell);
+  int bit = mesche_mem_cell_bit(cell);
+  page->cell_bits[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+  page->mark_bits[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+  mem_pool_free(mem, cell, size);
+}
+
+void mesche_mem_pools_sweep(MescheMemory *mem) {
+  // Return the pages emptied by a collection to the system.  One empty page
+  // is kept in each pool so that a pool which is emptied and refilled in
+  // every cycle doesn't keep allocating fresh pages.
+  for (int i = 0; i < MEM_POOL_CLASS_COUNT; i++) {
+    MeschePool *pool = &mem->pools[i];
+    bool kept_empty = false;
+    bool released = false;
+    for (MeschePoolPage *page = pool->pages; page != NULL; page = page->next) {
+      if (page->live_count == 0 && kept_empty) {
+        // Mark the page so it can be dropped from both page lists
+        page->live_count = -1;
+        released = true;
+      } else if (page->live_count == 0) {
+        kept_empty = true;
+      }
+    }
+
+    if (!released) {
+      continue;
+    }
+
+    // Empty pages always have free blocks so they are on the free page list
+    MeschePoolPage **page_ptr = &pool->free_pages;
+    while (*page_ptr != NULL) {
+      if ((*page_ptr)->live_count < 0) {
+        *page_ptr = (*page_ptr)->next_free;
+      } else {
+        page_ptr = &(*page_ptr)->next_free;
+      }
+    }
+
+    page_ptr = &pool->pages;
+    while (*page_ptr != NULL) {
+      MeschePoolPage *page = *page_ptr;
+      if (page->live_count < 0) {
+        *page_ptr = page->next;
+        free(page);
+      } else {
+        page_ptr = &page->next;
+      }
+    }
+  }
+}
+
+void mesche_mem_free(MescheMemory *mem) {
+  for (int i = 0; i < MEM_POOL_CLASS_COUNT; i++) {
+    MeschePoolPage *page = mem->pools[i].pages;
+    while (page != NULL) {
+      MeschePoolPage *next = page->next;
+      free(page);
+      page = next;
+    }
+
+    mem->pools[i].pages = NULL;
+    mem->pools[i].free_pages = NULL;
+  }
+
+  free(mem->gc_stats.history);
+  mem->gc_stats.history = NULL;
+}
+
+void mesche_mem_stats_history_size_set(MescheMemory *mem, int capacity) {
+  // Resizing the ring buffer drops the cycles it already holds
+  MescheGCStats *stats = &mem->gc_stats;
+  free(stats->history);
+  stats->history = NULL;
+  stats->history_capacity = capacity > 0 ? capacity : 0;
+  stats->history_count = 0;
+  stats->history_next = 0;
+
+  if (stats->history_capacity > 0) {
+    stats->history = calloc(stats->history_capacity, sizeof(MescheGCCycleStats));
+    if (stats->history == NULL) {
+      PANIC("GC history allocation failed!\n");
+    }
+  }
+}
+
+const MescheGCCycleStats *mesche_mem_stats_history_get(MescheMemory *mem, int index) {
+  // Index 0 is the most recent cycle
+  MescheGCStats *stats = &mem->gc_stats;
+  if (index < 0 || index >= stats->history_count) {
+    return NULL;
+  }
+
+  int slot = stats->history_next - 1 - index;
+  return &stats->history[slot < 0 ? slot + stats->history_capacity : slot];
+}
+
+const char *mesche_mem_gc_trigger_name(MescheGCTrigger trigger) {
+  switch (trigger) {
+  case MESCHE_GC_TRIGGER_NURSERY:
+    return "nursery";
+  case MESCHE_GC_TRIGGER_HEAP_LIMIT:
+    return "heap-limit";
+  case MESCHE_GC_TRIGGER_EXPLICIT:
+    return "explicit";
+  }
+
+  return "unknown";
+}
+
+static void mem_stats_finish_cycle(MescheMemory *mem) {
+  MescheGCStats *stats = &mem->gc_stats;
+  MescheGCCycleStats *cycle = &stats->cycle;
+  cycle->bytes_after = mem->bytes_allocated;
+  cycle->heap_growth = (long)cycle->bytes_after - (long)stats->last.bytes_after;
+  cycle->next_major_gc = mem->next_major_gc;
+
+  if (cycle->is_major) {
+    stats->major_count++;
+  } else {
+    stats->minor_count++;
+  }
+
+  stats->pause_us += cycle->pause_us;
+  stats->bytes_freed += cycle->bytes_freed;
+  if (cycle->max_pause_us > stats->max_pause_us) {
+    stats->max_pause_us = cycle->max_pause_us;
+  }
+
+  stats->last = *cycle;
+  if (stats->history_capacity > 0) {
+    stats->history[stats->history_next] = *cycle;
+    stats->history_next = (stats->history_next + 1) % stats->history_capacity;
+    if (stats->history_count < stats->history_capacity) {
+      stats->history_count++;
+    }
+  }
+}
+
+static void mem_collect(MescheMemory *mem, bool is_major, long budget_us,
+                        MescheGCTrigger trigger) {
   if (mem->collect_garbage_func == NULL) {
     PANIC("No garbage collector function is registered.");
   }
 
+  // Slices of a running major collection add up in the same cycle
+  MescheGCCycleStats *cycle = &mem->gc_stats.cycle;
+  if (mem->gc_phase == MESCHE_GC_IDLE) {
+    memset(cycle, 0, sizeof(MescheGCCycleStats));
+    cycle->is_major = is_major;
+    cycle->trigger = trigger;
+    cycle->bytes_before = mem->bytes_allocated;
+  }
+
 #ifdef DEBUG_LOG_GC
-  printf("-- GC starting...\n");
+  printf("-- GC %s (%s)...\n", mem->gc_phase == MESCHE_GC_IDLE ? "starting" : "resuming",
+         is_major ? "major" : "minor");
   size_t before_size = mem->bytes_allocated;
 #endif
 
-  // Collect garbage and adjust the next GC limit
-  mem->collect_garbage_func(mem);
-  mem->next_gc = mem->bytes_allocated * GC_HEAP_GROW_FACTOR;
+  size_t slice_size = mem->bytes_allocated;
+  uint64_t slice_start = mesche_mem_time_us();
+  mem->collect_garbage_func(mem, is_major, budget_us);
+  uint64_t slice_us = mesche_mem_time_us() - slice_start;
+
+  cycle->slice_count++;
+  cycle->pause_us += slice_us;
+  if (slice_us > cycle->max_pause_us) {
+    cycle->max_pause_us = slice_us;
+  }
+  if (slice_size > mem->bytes_allocated) {
+    cycle->bytes_freed += slice_size - mem->bytes_allocated;
+  }
+
+  // Keep running slices of an unfinished collection as allocation continues,
+  // otherwise adjust the next GC limits
+  if (mem->gc_phase != MESCHE_GC_IDLE) {
+    mem->next_gc = mem->bytes_allocated + GC_STEP_SIZE;
+  } else {
+    if (is_major) {
+      // Small heaps would otherwise drop the limit below the nursery size and
+      // turn every collection into a major one
+      size_t limit = GC_INITIAL_LIMIT;
+      mem->next_major_gc = mem->bytes_allocated * GC_HEAP_GROW_FACTOR;
+      if (mem->next_major_gc < limit) {
+        mem->next_major_gc = limit;
+      }
+    }
+    mem->next_gc = mem->bytes_allocated + GC_NURSERY_SIZE;
+    mem_stats_finish_cycle(mem);
+  }
 
 #ifdef DEBUG_LOG_GC
-  printf("-- GC finished: freed %zu bytes (from %zu to %zu), next GC at %zu bytes\n",
-         before_size - mem->bytes_allocated, before_size, mem->bytes_allocated, mem->next_gc);
+  printf("-- GC %s: freed %zu bytes (from %zu to %zu), next GC at %zu bytes\n",
+         mem->gc_phase == MESCHE_GC_IDLE ? "finished" : "paused",
+         before_size > mem->bytes_allocated ? before_size - mem->bytes_allocated : 0, before_size,
+         mem->bytes_allocated, mem->next_gc);
 #endif
 }
 
+void mesche_mem_collect_garbage(MescheMemory *mem) {
+  if (mem->gc_phase != MESCHE_GC_IDLE) {
+    // Finish the collection in one go if the heap has outgrown the slices
+    size_t limit = mem->next_major_gc * GC_HEAP_GROW_FACTOR;
+    if (mem->bytes_allocated > limit) {
+      mem->gc_stats.cycle.was_forced = true;
+      mem_collect(mem, true, 0, MESCHE_GC_TRIGGER_HEAP_LIMIT);
+    } else {
+      mem_collect(mem, true, mem->gc_step_budget_us, MESCHE_GC_TRIGGER_HEAP_LIMIT);
+    }
+  } else if (mem->bytes_allocated > mem->next_major_gc) {
+    mem_collect(mem, true, mem->gc_step_budget_us, MESCHE_GC_TRIGGER_HEAP_LIMIT);
+  } else {
+    // Only collect the young generation until the heap has grown enough to
+    // be worth a full collection
+    mem_collect(mem, false, 0, MESCHE_GC_TRIGGER_NURSERY);
+  }
+}
+
+bool mesche_mem_gc_step(MescheMemory *mem, long budget_us) {
+  // Gives the collector time outside of allocation, e.g. once per frame, so
+  // that fewer slices have to run in the middle of the program's work
+  if (mem->gc_phase != MESCHE_GC_IDLE || mem->bytes_allocated > mem->next_major_gc) {
+    mem_collect(mem, true, budget_us, MESCHE_GC_TRIGGER_HEAP_LIMIT);
+  }
+
+  return mem->gc_phase != MESCHE_GC_IDLE;
+}
+
+void mesche_mem_collect_major(MescheMemory *mem) {
+  // Runs a whole major collection, finishing the one in progress first
+  if (mem->gc_phase != MESCHE_GC_IDLE) {
+    mem_collect(mem, true, 0, MESCHE_GC_TRIGGER_EXPLICIT);
+  }
+
+  mem_collect(mem, true, 0, MESCHE_GC_TRIGGER_EXPLICIT);
+}
+
 void mesche_mem_report(MescheMemory *mem) {
+  MescheGCStats *stats = &mem->gc_stats;
   printf("-- %zu bytes allocated in memory, next GC at %zu bytes\n", mem->bytes_allocated,
          mem->next_gc);
+  printf("-- %zu minor and %zu major collections freed %zu bytes, paused %.2f ms in total "
+         "(longest %.2f ms)\n",
+         stats->minor_count, stats->major_count, stats->bytes_freed, stats->pause_us / 1000.0,
+         stats->max_pause_us / 1000.0);
 }
@@ -1,8 +1,11 @@
 #ifndef mesche_mem_h
 #define mesche_mem_h
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 // If this is defined, the GC will be run frequently
 /* #define DEBUG_STRESS_GC */
@@ -12,8 +15,110 @@
 
 struct MescheMemory;
 
-// Stores a pointer to the garbage collector (almost certainly from the VM)
-typedef void (*MescheMemoryCollectGarbageFunc)(struct MescheMemory *);
+// Small allocations are carved out of pages holding blocks of a single size
+// class.  Pages are aligned to their size so that a block can find its page
+// by masking its address.
+#define MEM_POOL_GRANULE 8
+#define MEM_POOL_CLASS_COUNT 32
+#define MEM_POOL_MAX_SIZE (MEM_POOL_GRANULE * MEM_POOL_CLASS_COUNT)
+#define MEM_POOL_PAGE_SIZE (64 * 1024)
+
+// Blocks holding objects ("cells") are tracked in bitmaps at the start of
+// their page with one bit per granule: one for blocks which hold a cell and
+// one for cells marked by the collector
+#define MEM_POOL_BITMAP_WORDS (MEM_POOL_PAGE_SIZE / MEM_POOL_GRANULE / 64)
+
+typedef struct MeschePoolBlock {
+  struct MeschePoolBlock *next;
+} MeschePoolBlock;
+
+// Each page keeps its own free list so that an empty page can be released
+// without touching the blocks of every other page
+typedef struct MeschePoolPage {
+  struct MeschePoolPage *next;
+  struct MeschePoolPage *next_free;
+  struct MeschePoolPage *next_young;
+  MeschePoolBlock *free_list;
+  int live_count;
+  unsigned int swept_epoch;
+  bool has_free_blocks;
+  bool has_young_cells;
+  uint64_t cell_bits[MEM_POOL_BITMAP_WORDS];
+  uint64_t mark_bits[MEM_POOL_BITMAP_WORDS];
+} MeschePoolPage;
+
+// Cells too big for the pools get a header of their own
+typedef struct MescheLargeCell {
+  struct MescheLargeCell *next;
+  size_t size;
+  bool is_marked;
+} MescheLargeCell;
+
+typedef struct {
+  size_t block_size;
+  MeschePoolPage *pages;
+  MeschePoolPage *free_pages;
+} MeschePool;
+
+// Major collections are incremental: marking and sweeping are split into
+// slices which each run for a bounded amount of time
+typedef enum {
+  MESCHE_GC_IDLE,
+  MESCHE_GC_MARK,
+  MESCHE_GC_SWEEP,
+} MescheGCPhase;
+
+// Why a collection cycle was started
+typedef enum {
+  MESCHE_GC_TRIGGER_NURSERY,
+  MESCHE_GC_TRIGGER_HEAP_LIMIT,
+  MESCHE_GC_TRIGGER_EXPLICIT,
+} MescheGCTrigger;
+
+// Enough room to count swept objects for every ObjectKind
+#define MESCHE_GC_KIND_COUNT 16
+
+// Statistics of a single minor collection or of a whole major collection,
+// summed over all of its slices
+typedef struct {
+  bool is_major;
+  MescheGCTrigger trigger;
+  // The collection had to finish without a time budget because the heap
+  // outgrew its slices
+  bool was_forced;
+  int slice_count;
+  uint64_t pause_us;
+  uint64_t max_pause_us;
+  size_t bytes_before;
+  size_t bytes_after;
+  size_t bytes_freed;
+  // Change of the live heap since the end of the previous cycle
+  long heap_growth;
+  size_t next_major_gc;
+  size_t objects_swept[MESCHE_GC_KIND_COUNT];
+} MescheGCCycleStats;
+
+// Totals over every finished cycle, the running cycle and an optional ring
+// buffer holding the most recent cycles
+typedef struct {
+  size_t minor_count;
+  size_t major_count;
+  uint64_t pause_us;
+  uint64_t max_pause_us;
+  size_t bytes_freed;
+  MescheGCCycleStats cycle;
+  MescheGCCycleStats last;
+  MescheGCCycleStats *history;
+  int history_capacity;
+  int history_count;
+  int history_next;
+} MescheGCStats;
+
+// Stores a pointer to the garbage collector (almost certainly from the VM).
+// A major collection is started or advanced for at most `budget_us`
+// microseconds, a budget of 0 runs it to completion.
+typedef void (*MescheMemoryCollectGarbageFunc)(struct MescheMemory *, bool is_major,
+                                               long budget_us);
 
 // Contains pointers to objects which assist with memory management
 // and object usage tracking.
@@ -21,6 +126,21 @@ typedef struct MescheMemory {
   MescheMemoryCollectGarbageFunc collect_garbage_func;
   size_t bytes_allocated;
   size_t next_gc;
+  size_t next_major_gc;
+  MescheGCPhase gc_phase;
+  long gc_step_budget_us;
+  MescheGCStats gc_stats;
+  MeschePool pools[MEM_POOL_CLASS_COUNT];
+
+  // Pages and large cells holding cells allocated since the last minor
+  // collection, which are the only ones it has to sweep
+  MeschePoolPage *young_pages;
+  MescheLargeCell *young_large_cells;
+  MescheLargeCell *large_cells;
+
+  // Pages whose swept_epoch doesn't match still have to be swept by the
+  // running major collection
+  unsigned int gc_epoch;
 } MescheMemory;
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2);
@@ -33,9 +153,54 @@ typedef struct MescheMemory {
   mesche_mem_realloc((MescheMemory *)mem, (pointer), sizeof(type) * size, 0)
 #define FREE_SIZE(mem, pointer, size) mesche_mem_realloc((MescheMemory *)mem, (pointer), size, 0)
 
+static inline uint64_t mesche_mem_time_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static inline MeschePoolPage *mesche_mem_pool_page(void *block) {
+  return (MeschePoolPage *)((uintptr_t)block & ~(uintptr_t)(MEM_POOL_PAGE_SIZE - 1));
+}
+
+static inline int mesche_mem_cell_bit(void *cell) {
+  return ((uintptr_t)cell & (MEM_POOL_PAGE_SIZE - 1)) / MEM_POOL_GRANULE;
+}
+
+static inline MescheLargeCell *mesche_mem_large_cell(void *cell) {
+  return (MescheLargeCell *)cell - 1;
+}
+
+static inline bool mesche_mem_cell_is_marked(void *cell, bool is_large) {
+  if (is_large) {
+    return mesche_mem_large_cell(cell)->is_marked;
+  }
+
+  int bit = mesche_mem_cell_bit(cell);
+  return (mesche_mem_pool_page(cell)->mark_bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void mesche_mem_cell_mark(void *cell, bool is_large) {
+  if (is_large) {
+    mesche_mem_large_cell(cell)->is_marked = true;
+  } else {
+    int bit = mesche_mem_cell_bit(cell);
+    mesche_mem_pool_page(cell)->mark_bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+}
+
 void mesche_mem_init(MescheMemory *mem, MescheMemoryCollectGarbageFunc collect_garbage_func);
 void *mesche_mem_realloc(MescheMemory *mem, void *mem_ptr, size_t old_size, size_t new_size);
+void *mesche_mem_cell_alloc(MescheMemory *mem, size_t size);
+void mesche_mem_cell_free(MescheMemory *mem, void *cell, size_t size);
 void mesche_mem_collect_garbage(MescheMemory *mem);
+bool mesche_mem_gc_step(MescheMemory *mem, long budget_us);
+void mesche_mem_collect_major(MescheMemory *mem);
+void mesche_mem_pools_sweep(MescheMemory *mem);
+void mesche_mem_free(MescheMemory *mem);
+void mesche_mem_stats_history_size_set(MescheMemory *mem, int capacity);
+const MescheGCCycleStats *mesche_mem_stats_history_get(MescheMemory *mem, int index);
+const char *mesche_mem_gc_trigger_name(MescheGCTrigger trigger);
 void mesche_mem_report(MescheMemory *mem);
 
 #endif
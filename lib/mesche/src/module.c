@@ -57,13 +57,17 @@ char *mesche_module_find_module_path(VM *vm, const char *module_name) {
 }
 
 ObjectString *mesche_module_name_from_symbol_list(VM *vm, ObjectCons *list) {
+  // Keep the partial name on the stack while the next part is joined to it
   ObjectString *module_name = AS_STRING(list->car);
   ObjectString *current_name = module_name;
+  mesche_vm_stack_push(vm, OBJECT_VAL(module_name));
   while (IS_CONS(list->cdr)) {
     list = AS_CONS(list->cdr);
     current_name = AS_STRING(list->car);
     module_name = mesche_string_join(vm, module_name, current_name, " ");
+    vm->stack_top[-1] = OBJECT_VAL(module_name);
   }
+  mesche_vm_stack_pop(vm);
 
   return module_name;
 }
@@ -76,9 +80,14 @@ static ObjectModule *mesche_module_resolve_by_name(VM *vm, ObjectString *module_
   Value module_val;
   ObjectModule *module = NULL;
   if (!mesche_table_get(&vm->modules, module_name, &module_val)) {
-    // Create an empty module
+    // Create an empty module, keeping it and its name on the stack until it
+    // has been added to the module table
+    mesche_vm_stack_push(vm, OBJECT_VAL(module_name));
     module = mesche_object_make_module(vm, module_name);
+    mesche_vm_stack_push(vm, OBJECT_VAL(module));
     mesche_table_set((MescheMemory *)vm, &vm->modules, module_name, OBJECT_VAL(module));
+    mesche_vm_stack_pop(vm);
+    mesche_vm_stack_pop(vm);
 
     // Look up the module in the load path
     char *module_path = mesche_module_find_module_path(vm, module_name->chars);
@@ -106,7 +115,7 @@ static ObjectModule *mesche_module_resolve_by_name_string(VM *vm, const char *mo
   return mesche_module_resolve_by_name(vm, module_name_str);
 }
 
-static ObjectModule *mesche_module_resolve_by_path(VM *vm, ObjectCons *list) {
+ObjectModule *mesche_module_resolve_by_path(VM *vm, ObjectCons *list) {
   ObjectString *module_name = mesche_module_name_from_symbol_list(vm, list);
   return mesche_module_resolve_by_name(vm, module_name);
 }
@@ -123,15 +132,44 @@ void mesche_module_enter_by_name(VM *vm, const char *module_name) {
   mesche_module_enter(vm, mesche_module_resolve_by_name_string(vm, module_name));
 }
 
-void mesche_module_import_path(VM *vm, ObjectCons *list) {
+ObjectBinding *mesche_module_binding_get(ObjectModule *module, ObjectString *name) {
+  Value binding_value;
+  if (!mesche_table_get(&module->locals, name, &binding_value)) {
+    return NULL;
+  }
+
+  return AS_BINDING(binding_value);
+}
+
+void mesche_module_define(VM *vm, ObjectModule *module, ObjectString *name, Value value) {
+  // Redefining a variable owned by this module updates its existing binding
+  // so that modules which imported it will see the new value
+  ObjectBinding *binding = mesche_module_binding_get(module, name);
+  if (binding != NULL && binding->module == module) {
+    binding->value = value;
+    mesche_object_write_barrier(vm, (Object *)binding, value);
+    return;
+  }
+
+  // Keep the new binding on the stack while the table may be resized.  The
+  // caller is expected to keep the name and value reachable.
+  binding = mesche_object_make_binding(vm, module, value);
+  mesche_vm_stack_push(vm, OBJECT_VAL(binding));
+  mesche_table_set((MescheMemory *)vm, &module->locals, name, OBJECT_VAL(binding));
+  mesche_object_write_barrier(vm, (Object *)module, OBJECT_VAL(binding));
+  mesche_object_write_barrier(vm, (Object *)module, OBJECT_VAL(name));
+  mesche_vm_stack_pop(vm);
+}
+
+void mesche_module_import(VM *vm, ObjectModule *module, ObjectModule *imported_module) {
   // TODO: Warn or error on shadowing?
-  ObjectModule *current_module = vm->current_module;
-  ObjectModule *module = mesche_module_resolve_by_path(vm, list);
-  // Look up the value for each exported symbol and bind it in the current module
-  for (int i = 0; i < module->exports.count; i++) {
-    Value export_value;
-    ObjectString *export_name = AS_STRING(module->exports.values[i]);
-    mesche_table_get(&module->locals, export_name, &export_value);
-    mesche_table_set((MescheMemory *)vm, &current_module->locals, export_name, export_value);
+  // Share the binding of each exported symbol with the importing module
+  for (int i = 0; i < imported_module->exports.count; i++) {
+    ObjectString *export_name = AS_STRING(imported_module->exports.values[i]);
+    ObjectBinding *binding = mesche_module_binding_get(imported_module, export_name);
+    if (binding != NULL) {
+      mesche_table_set((MescheMemory *)vm, &module->locals, export_name, OBJECT_VAL(binding));
+      mesche_object_write_barrier(vm, (Object *)module, OBJECT_VAL(binding));
+    }
   }
 }
@@ -8,6 +8,9 @@ void mesche_module_print_name(ObjectModule *module);
 void mesche_module_enter(VM *vm, ObjectModule *module);
 void mesche_module_enter_path(VM *vm, ObjectCons *list);
 void mesche_module_enter_by_name(VM *vm, const char *module_name);
-void mesche_module_import_path(VM *vm, ObjectCons *list);
+ObjectModule *mesche_module_resolve_by_path(VM *vm, ObjectCons *list);
+void mesche_module_import(VM *vm, ObjectModule *module, ObjectModule *imported_module);
+ObjectBinding *mesche_module_binding_get(ObjectModule *module, ObjectString *name);
+void mesche_module_define(VM *vm, ObjectModule *module, ObjectString *name, Value value);
 
 #endif
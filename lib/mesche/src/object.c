@@ -1,26 +1,31 @@
 #include <stdio.h>
 
+#include "jit.h"
 #include "mem.h"
 #include "object.h"
+#include "opstats.h"
 #include "util.h"
 #include "vm.h"
 
-#define ALLOC(vm, type, count)                                                                     \
-  (type) mesche_mem_realloc((MescheMemory *)vm, NULL, 0, sizeof(type) * count)
-
 #define ALLOC_OBJECT(vm, type, object_kind) (type *)object_allocate(vm, sizeof(type), object_kind)
 
 #define ALLOC_OBJECT_EX(vm, type, extra_size, object_kind)                                         \
   (type *)object_allocate(vm, sizeof(type) + extra_size, object_kind)
 
+#define FREE_OBJECT(vm, type, pointer)                                                             \
+  mesche_mem_cell_free((MescheMemory *)vm, pointer, sizeof(type))
+
+#define FREE_OBJECT_SIZE(vm, pointer, size) mesche_mem_cell_free((MescheMemory *)vm, pointer, size)
+
 static Object *object_allocate(VM *vm, size_t size, ObjectKind kind) {
-  Object *object = (Object *)mesche_mem_realloc((MescheMemory *)vm, NULL, 0, size);
+  Object *object = (Object *)mesche_mem_cell_alloc((MescheMemory *)vm, size);
   object->kind = kind;
 
-  // Keep track of the object for garbage collection
-  object->is_marked = false;
-  object->next = vm->objects;
-  vm->objects = object;
+  // Minor collections are held off while a major collection is running so
+  // the object goes straight into the old generation
+  object->is_old = vm->mem.gc_phase != MESCHE_GC_IDLE;
+  object->is_remembered = false;
+  object->is_large = size > MEM_POOL_MAX_SIZE;
 
 #ifdef DEBUG_LOG_GC
   printf("%p    allocate %zu for %d\n", (void *)object, size, kind);
@@ -29,6 +34,17 @@ static Object *object_allocate(VM *vm, size_t size, ObjectKind kind) {
   return object;
 }
 
+static inline Object *object_interned_revive(VM *vm, Object *object) {
+  // The interned tables don't keep their entries alive, so an entry which
+  // hasn't been reached yet by an unfinished collection must be marked before
+  // it gets handed out again
+  if (object != NULL && vm->mem.gc_phase == MESCHE_GC_MARK) {
+    mesche_mem_mark_object(vm, object);
+  }
+
+  return object;
+}
+
 static uint32_t object_string_hash(const char *key, int length) {
   // Use the FNV-1a hash algorithm
   uint32_t hash = 2166136261u;
@@ -45,7 +61,7 @@ ObjectString *mesche_object_make_string(VM *vm, const char *chars, int length) {
   uint32_t hash = object_string_hash(chars, length);
   ObjectString *interned_string = mesche_table_find_key(&vm->strings, chars, length, hash);
   if (interned_string != NULL)
-    return interned_string;
+    return (ObjectString *)object_interned_revive(vm, (Object *)interned_string);
 
   // Allocate and initialize the string object
   ObjectString *string = ALLOC_OBJECT_EX(vm, ObjectString, length + 1, ObjectKindString);
@@ -71,12 +87,12 @@ ObjectSymbol *mesche_object_make_symbol(VM *vm, const char *chars, int length) {
   uint32_t hash = object_string_hash(chars, length);
   ObjectSymbol *interned_symbol = (ObjectSymbol*)mesche_table_find_key(&vm->symbols, chars, length, hash);
   if (interned_symbol != NULL)
-    return interned_symbol;
+    return (ObjectSymbol *)object_interned_revive(vm, (Object *)interned_symbol);
 
   // Allocate and initialize the string object
   ObjectSymbol *symbol = ALLOC_OBJECT_EX(vm, ObjectSymbol, length + 1, ObjectKindSymbol);
   memcpy(symbol->string.chars, chars, length);
-  symbol->string.chars[length + 1] = '\0';
+  symbol->string.chars[length] = '\0';
   symbol->string.length = length;
   symbol->string.hash = hash;
 
@@ -94,16 +110,31 @@ ObjectSymbol *mesche_object_make_symbol(VM *vm, const char *chars, int length) {
 }
 
 ObjectKeyword *mesche_object_make_keyword(VM *vm, const char *chars, int length) {
-  // TODO: Do we want to intern keyword strings too?
-  // Allocate and initialize the string object
+  // Is the keyword already interned?
   uint32_t hash = object_string_hash(chars, length);
+  ObjectKeyword *interned_keyword =
+      (ObjectKeyword *)mesche_table_find_key(&vm->keywords, chars, length, hash);
+  if (interned_keyword != NULL)
+    return (ObjectKeyword *)object_interned_revive(vm, (Object *)interned_keyword);
+
+  // Allocate and initialize the string object
   ObjectKeyword *keyword = ALLOC_OBJECT_EX(vm, ObjectKeyword, length + 1, ObjectKindKeyword);
   memcpy(keyword->string.chars, chars, length);
   keyword->string.chars[length] = '\0';
   keyword->string.length = length;
   keyword->string.hash = hash;
 
-  return (ObjectKeyword *)keyword;
+  // Push the keyword onto the stack temporarily to avoid GC
+  mesche_vm_stack_push(vm, OBJECT_VAL(keyword));
+
+  // Add the keyword's string to the interned set so that every use of the
+  // same keyword shares one object
+  mesche_table_set((MescheMemory *)vm, &vm->keywords, &keyword->string, NIL_VAL);
+
+  // Pop the keyword back off the stack
+  mesche_vm_stack_pop(vm);
+
+  return keyword;
 }
 
 ObjectCons *mesche_object_make_cons(VM *vm, Value car, Value cdr) {
@@ -128,7 +159,7 @@ static void function_keyword_args_init(KeywordArgumentArray *array) {
 }
 
 static void function_keyword_args_free(MescheMemory *mem, KeywordArgumentArray *array) {
-  FREE_ARRAY(mem, Value, array->args, array->capacity);
+  FREE_ARRAY(mem, KeywordArgument, array->args, array->capacity);
   function_keyword_args_init(array);
 }
 
@@ -151,6 +182,14 @@ ObjectFunction *mesche_object_make_function(VM *vm, FunctionType type) {
   function->upvalue_count = 0;
   function->type = type;
   function->name = NULL;
+#ifdef MESCHE_OPCODE_STATS
+  function->instruction_count = 0;
+  function->call_count = 0;
+#endif
+#ifdef MESCHE_JIT
+  function->jit = NULL;
+  function->jit_call_count = 0;
+#endif
   function_keyword_args_init(&function->keyword_args);
   mesche_chunk_init(&function->chunk);
 
@@ -158,23 +197,25 @@ ObjectFunction *mesche_object_make_function(VM *vm, FunctionType type) {
 }
 
 ObjectClosure *mesche_object_make_closure(VM *vm, ObjectFunction *function, ObjectModule *module) {
-  // Allocate upvalues for this closure instance
-  ObjectUpvalue **upvalues = ALLOC(vm, ObjectUpvalue **, function->upvalue_count);
-  for (int i = 0; i < function->upvalue_count; i++) {
-    upvalues[i] = NULL;
-  }
-
-  ObjectClosure *closure = ALLOC_OBJECT(vm, ObjectClosure, ObjectKindClosure);
+  // The closure's upvalues are allocated along with it
+  ObjectClosure *closure = ALLOC_OBJECT_EX(
+      vm, ObjectClosure, sizeof(ObjectUpvalue *) * function->upvalue_count, ObjectKindClosure);
   closure->function = function;
   closure->module = module;
-  closure->upvalues = upvalues;
   closure->upvalue_count = function->upvalue_count;
+  for (int i = 0; i < function->upvalue_count; i++) {
+    closure->upvalues[i] = NULL;
+  }
+
   return closure;
 }
 
 ObjectNativeFunction *mesche_object_make_native_function(VM *vm, FunctionPtr function) {
   ObjectNativeFunction *native = ALLOC_OBJECT(vm, ObjectNativeFunction, ObjectKindNativeFunction);
   native->function = function;
+#ifdef MESCHE_OPCODE_STATS
+  native->call_count = 0;
+#endif
   return native;
 }
 
@@ -196,6 +237,13 @@ ObjectModule *mesche_object_make_module(VM *vm, ObjectString *name) {
   return module;
 }
 
+ObjectBinding *mesche_object_make_binding(VM *vm, ObjectModule *module, Value value) {
+  ObjectBinding *binding = ALLOC_OBJECT(vm, ObjectBinding, ObjectKindBinding);
+  binding->value = value;
+  binding->module = module;
+  return binding;
+}
+
 void mesche_object_free(VM *vm, Object *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p    free   ", (void *)object);
@@ -206,52 +254,68 @@ void mesche_object_free(VM *vm, Object *object) {
   switch (object->kind) {
   case ObjectKindString: {
     ObjectString *string = (ObjectString *)object;
-    FREE_SIZE(vm, string, (sizeof(ObjectString) + string->length + 1));
+    FREE_OBJECT_SIZE(vm, string, (sizeof(ObjectString) + string->length + 1));
     break;
   }
   case ObjectKindSymbol: {
     ObjectSymbol *symbol= (ObjectSymbol *)object;
-    FREE_SIZE(vm, symbol, (sizeof(ObjectSymbol) + symbol->string.length + 1));
+    FREE_OBJECT_SIZE(vm, symbol, (sizeof(ObjectSymbol) + symbol->string.length + 1));
     break;
   }
   case ObjectKindKeyword: {
     ObjectKeyword *keyword = (ObjectKeyword *)object;
-    FREE_SIZE(vm, keyword, (sizeof(ObjectKeyword) + keyword->string.length + 1));
+    FREE_OBJECT_SIZE(vm, keyword, (sizeof(ObjectKeyword) + keyword->string.length + 1));
     break;
   }
   case ObjectKindCons:
-    FREE(vm, ObjectCons, object);
+    FREE_OBJECT(vm, ObjectCons, object);
     break;
   case ObjectKindUpvalue:
-    FREE(vm, ObjectUpvalue, object);
+    FREE_OBJECT(vm, ObjectUpvalue, object);
     break;
-  case ObjectKindFunction:
-    FREE(vm, ObjectFunction, object);
+  case ObjectKindFunction: {
+    ObjectFunction *function = (ObjectFunction *)object;
+#ifdef MESCHE_OPCODE_STATS
+    mesche_opstats_function_free(vm, function);
+#endif
+#ifdef MESCHE_JIT
+    mesche_jit_function_free(function);
+#endif
+    mesche_chunk_free((MescheMemory *)vm, &function->chunk);
+    function_keyword_args_free((MescheMemory *)vm, &function->keyword_args);
+    FREE_OBJECT(vm, ObjectFunction, object);
     break;
+  }
   case ObjectKindClosure: {
     ObjectClosure *closure = (ObjectClosure *)object;
-    FREE_ARRAY(vm, ObjectUpvalue *, closure->upvalues, closure->upvalue_count);
-    FREE(vm, ObjectFunction, object);
+    FREE_OBJECT_SIZE(vm, closure,
+                     (sizeof(ObjectClosure) + sizeof(ObjectUpvalue *) * closure->upvalue_count));
     break;
   }
   case ObjectKindNativeFunction:
-    FREE(vm, ObjectNativeFunction, object);
+#ifdef MESCHE_OPCODE_STATS
+    mesche_opstats_native_free(vm, (ObjectNativeFunction *)object);
+#endif
+    FREE_OBJECT(vm, ObjectNativeFunction, object);
     break;
   case ObjectKindPointer: {
     ObjectPointer *pointer = (ObjectPointer *)object;
     if (pointer->is_managed) {
       free(pointer->ptr);
-      FREE(vm, ObjectPointer, object);
-      break;
     }
+    FREE_OBJECT(vm, ObjectPointer, object);
+    break;
   }
   case ObjectKindModule: {
     ObjectModule *module = (ObjectModule *)object;
     mesche_table_free((MescheMemory*)vm, &module->locals);
     mesche_value_array_free((MescheMemory*)vm, &module->exports);
-    FREE(vm, ObjectModule, object);
+    FREE_OBJECT(vm, ObjectModule, object);
     break;
   }
+  case ObjectKindBinding:
+    FREE_OBJECT(vm, ObjectBinding, object);
+    break;
   default:
     PANIC("Don't know how to free object kind %d!", object->kind);
   }
@@ -323,6 +387,9 @@ void mesche_object_print(Value value) {
     printf("<module (%s) %p>", module->name->chars, module);
     break;
   }
+  case ObjectKindBinding:
+    printf("binding");
+    break;
   default:
     printf("<unknown>");
     break;
@@ -5,10 +5,6 @@
 #include "value.h"
 #include "vm.h"
 
-#define IS_OBJECT(value) ((value).kind == VALUE_OBJECT)
-#define AS_OBJECT(value) ((value).as.object)
-
-#define OBJECT_VAL(value) ((Value){VALUE_OBJECT, {.object = (Object *)value}})
 #define OBJECT_KIND(value) (AS_OBJECT(value)->kind)
 
 #define IS_CONS(value) mesche_object_is_kind(value, ObjectKindCons)
@@ -26,6 +22,9 @@
 #define IS_MODULE(value) mesche_object_is_kind(value, ObjectKindModule)
 #define AS_MODULE(value) ((ObjectModule *)AS_OBJECT(value))
 
+#define IS_BINDING(value) mesche_object_is_kind(value, ObjectKindBinding)
+#define AS_BINDING(value) ((ObjectBinding *)AS_OBJECT(value))
+
 #define IS_POINTER(value) mesche_object_is_kind(value, ObjectKindPointer)
 #define AS_POINTER(value) ((ObjectPointer *)AS_OBJECT(value))
 
@@ -48,13 +47,18 @@ typedef enum {
   ObjectKindClosure,
   ObjectKindNativeFunction,
   ObjectKindPointer,
-  ObjectKindModule
+  ObjectKindModule,
+  ObjectKindBinding
 } ObjectKind;
 
+// Objects live in cells of the memory pools which keep their mark bits, so
+// the collector finds them by walking pages instead of a list
 struct Object {
   ObjectKind kind;
-  bool is_marked;
-  struct Object *next;
+  // Objects start out young and become old once they survive a collection
+  bool is_old;
+  bool is_remembered;
+  bool is_large;
 };
 
 struct ObjectString {
@@ -83,7 +87,7 @@ struct ObjectCons {
 typedef enum { TYPE_FUNCTION, TYPE_SCRIPT } FunctionType;
 
 typedef struct {
-  ObjectString *name;
+  ObjectKeyword *name;
   uint8_t default_index;
 } KeywordArgument;
 
@@ -101,6 +105,15 @@ struct ObjectFunction {
   Chunk chunk;
   KeywordArgumentArray keyword_args;
   ObjectString *name;
+#ifdef MESCHE_OPCODE_STATS
+  size_t instruction_count;
+  size_t call_count;
+#endif
+#ifdef MESCHE_JIT
+  // Native code once the function has been called often enough
+  struct MescheJitCode *jit;
+  int jit_call_count;
+#endif
 };
 
 struct ObjectUpvalue {
@@ -114,8 +127,10 @@ struct ObjectClosure {
   Object object;
   ObjectModule *module;
   ObjectFunction *function;
-  ObjectUpvalue **upvalues;
   int upvalue_count;
+
+  // Stored inline so that a closure is a single allocation
+  ObjectUpvalue *upvalues[];
 };
 
 struct ObjectModule {
@@ -125,9 +140,21 @@ struct ObjectModule {
   ObjectString *name;
 };
 
+// Holds the value of a module-level variable.  Module tables map names to
+// bindings so that importing modules can share the same cell as the module
+// which defined it.
+struct ObjectBinding {
+  Object object;
+  Value value;
+  ObjectModule *module;
+};
+
 typedef struct {
   Object object;
   FunctionPtr function;
+#ifdef MESCHE_OPCODE_STATS
+  size_t call_count;
+#endif
 } ObjectNativeFunction;
 
 typedef struct {
@@ -148,11 +175,47 @@ ObjectClosure *mesche_object_make_closure(VM *vm, ObjectFunction *function, Obje
 ObjectNativeFunction *mesche_object_make_native_function(VM *vm, FunctionPtr function);
 ObjectPointer *mesche_object_make_pointer(VM *vm, void *ptr, bool is_managed);
 ObjectModule *mesche_object_make_module(VM *vm, ObjectString *name);
+ObjectBinding *mesche_object_make_binding(VM *vm, ObjectModule *module, Value value);
 
 void mesche_object_free(VM *vm, struct Object *object);
 void mesche_object_print(Value value);
 
 bool mesche_object_is_kind(Value value, ObjectKind kind);
+
+static inline bool mesche_object_is_marked(Object *object) {
+  return mesche_mem_cell_is_marked(object, object->is_large);
+}
+
+// Must be called when a reference to `value` is stored in an existing
+// object so that minor collections can find young objects held by old ones
+// and an unfinished major collection doesn't miss the new reference
+static inline void mesche_object_write_barrier(VM *vm, Object *object, Value value) {
+  if (!IS_OBJECT(value)) {
+    return;
+  }
+
+  if (object->is_old && !AS_OBJECT(value)->is_old) {
+    mesche_mem_remember(vm, object);
+  }
+
+  if (vm->mem.gc_phase == MESCHE_GC_MARK && mesche_object_is_marked(object)) {
+    mesche_mem_mark_object(vm, AS_OBJECT(value));
+  }
+}
+
+// Must be called once an object has been filled in over several allocations
+// because it might have been promoted or traced before all of its references
+// were stored
+static inline void mesche_object_write_barrier_all(VM *vm, Object *object) {
+  if (object->is_old) {
+    mesche_mem_remember(vm, object);
+  }
+
+  if (vm->mem.gc_phase == MESCHE_GC_MARK) {
+    mesche_mem_retrace(vm, object);
+  }
+}
+
 bool mesche_object_string_equalsp(Object *left, Object *right);
 
 #endif
@@ -1,6 +1,8 @@
 #ifndef mesche_op_h
 #define mesche_op_h
 
+// NOTE: Bump MESCHE_CACHE_VERSION in cache.h when changing the opcodes since
+// cached bytecode stores them by number
 typedef enum {
   OP_CONSTANT,
   OP_NIL,
@@ -32,11 +34,51 @@ typedef enum {
   OP_READ_LOCAL,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  OP_LOOP,
   OP_CALL,
+  OP_CALL_KEYWORDS,
+  OP_TAIL_CALL,
+  OP_TAIL_CALL_KEYWORDS,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_DISPLAY,
-  OP_RETURN
+  OP_RETURN,
+
+  // Superinstructions which the peephole pass fuses from the ones above
+  OP_ADD_LOCAL_CONSTANT,
+  OP_SUBTRACT_LOCAL_CONSTANT,
+  OP_EQV_LOCAL_CONSTANT,
+  OP_POP_JUMP_IF_FALSE,
+  OP_EQV_JUMP_IF_FALSE,
+
+  // Specialized variants which instructions rewrite themselves to once they
+  // have run, each one turns back into the generic instruction if its guard
+  // fails
+  OP_ADD_NUM,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_CALL_CLOSURE_EXACT_ARITY,
+  OP_CALL_NATIVE,
+  OP_TAIL_CALL_CLOSURE_EXACT_ARITY,
+
+  // Register instructions which address local slots and constants directly,
+  // only emitted for VMs with use_register_ops set
+  OP_ADD_REG,
+  OP_SUBTRACT_REG,
+  OP_MULTIPLY_REG,
+  OP_DIVIDE_REG,
+  OP_EQV_REG,
+  OP_MOVE_LOCAL,
+  OP_STORE_LOCAL,
+
+  // Not an opcode, the number of opcodes above
+  OP_COUNT
 } MescheOpCode;
 
+// Bits of a register instruction's mode byte which mark an operand as a
+// constant index rather than a local slot
+#define OP_REG_A_CONSTANT 1
+#define OP_REG_B_CONSTANT 2
+
 #endif
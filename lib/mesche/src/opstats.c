@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "opstats.h"
+#include "util.h"
+#include "vm.h"
+
+static const char *opcode_names[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_T] = "OP_T",
+    [OP_POP] = "OP_POP",
+    [OP_POP_SCOPE] = "OP_POP_SCOPE",
+    [OP_CONS] = "OP_CONS",
+    [OP_LIST] = "OP_LIST",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_AND] = "OP_AND",
+    [OP_OR] = "OP_OR",
+    [OP_NOT] = "OP_NOT",
+    [OP_EQV] = "OP_EQV",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_DEFINE_MODULE] = "OP_DEFINE_MODULE",
+    [OP_IMPORT_MODULE] = "OP_IMPORT_MODULE",
+    [OP_ENTER_MODULE] = "OP_ENTER_MODULE",
+    [OP_EXPORT_SYMBOL] = "OP_EXPORT_SYMBOL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_READ_GLOBAL] = "OP_READ_GLOBAL",
+    [OP_READ_UPVALUE] = "OP_READ_UPVALUE",
+    [OP_READ_LOCAL] = "OP_READ_LOCAL",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_CALL_KEYWORDS] = "OP_CALL_KEYWORDS",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_TAIL_CALL_KEYWORDS] = "OP_TAIL_CALL_KEYWORDS",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_DISPLAY] = "OP_DISPLAY",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_EQV_LOCAL_CONSTANT] = "OP_EQV_LOCAL_CONSTANT",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_EQV_JUMP_IF_FALSE] = "OP_EQV_JUMP_IF_FALSE",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_CALL_CLOSURE_EXACT_ARITY] = "OP_CALL_CLOSURE_EXACT_ARITY",
+    [OP_CALL_NATIVE] = "OP_CALL_NATIVE",
+    [OP_TAIL_CALL_CLOSURE_EXACT_ARITY] = "OP_TAIL_CALL_CLOSURE_EXACT_ARITY",
+    [OP_ADD_REG] = "OP_ADD_REG",
+    [OP_SUBTRACT_REG] = "OP_SUBTRACT_REG",
+    [OP_MULTIPLY_REG] = "OP_MULTIPLY_REG",
+    [OP_DIVIDE_REG] = "OP_DIVIDE_REG",
+    [OP_EQV_REG] = "OP_EQV_REG",
+    [OP_MOVE_LOCAL] = "OP_MOVE_LOCAL",
+    [OP_STORE_LOCAL] = "OP_STORE_LOCAL",
+};
+
+_Static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == OP_COUNT,
+               "Every opcode needs a name in opstats.c");
+
+const char *mesche_opstats_opcode_name(uint8_t opcode) {
+  if (opcode >= OP_COUNT || opcode_names[opcode] == NULL) {
+    return "OP_UNKNOWN";
+  }
+
+  return opcode_names[opcode];
+}
+
+#ifdef MESCHE_OPCODE_STATS
+
+void mesche_opstats_init(VM *vm) {
+  vm->opstats = (MescheOpStats *)calloc(1, sizeof(MescheOpStats));
+  if (vm->opstats == NULL) {
+    PANIC("Could not allocate opcode statistics.");
+  }
+}
+
+static void *opstats_grow(void *array, int *capacity, size_t entry_size) {
+  *capacity = GROW_CAPACITY(*capacity);
+  array = realloc(array, entry_size * *capacity);
+  if (array == NULL) {
+    PANIC("Could not grow opcode statistics.");
+  }
+
+  return array;
+}
+
+void mesche_opstats_native_define(VM *vm, FunctionPtr function, const char *name) {
+  MescheOpStats *stats = vm->opstats;
+  for (int i = 0; i < stats->native_count; i++) {
+    if (stats->natives[i].function == function) {
+      return;
+    }
+  }
+
+  if (stats->native_count == stats->native_capacity) {
+    stats->natives = opstats_grow(stats->natives, &stats->native_capacity,
+                                  sizeof(MescheOpStatsNative));
+  }
+
+  stats->natives[stats->native_count++] =
+      (MescheOpStatsNative){.function = function, .name = strdup(name), .call_count = 0};
+}
+
+void mesche_opstats_function_free(VM *vm, ObjectFunction *function) {
+  if (function->instruction_count == 0 && function->call_count == 0) {
+    return;
+  }
+
+  // Lambdas have no name of their own so the line they start on tells
+  // them apart
+  const char *name = function->name != NULL ? function->name->chars
+                     : function->type == TYPE_SCRIPT ? "<script>"
+                                                     : "<lambda>";
+  int line = function->chunk.count > 0 ? function->chunk.lines[0] : 0;
+
+  MescheOpStats *stats = vm->opstats;
+  for (int i = 0; i < stats->function_count; i++) {
+    MescheOpStatsFunction *entry = &stats->functions[i];
+    if (entry->line == line && strcmp(entry->name, name) == 0) {
+      entry->instruction_count += function->instruction_count;
+      entry->call_count += function->call_count;
+      return;
+    }
+  }
+
+  if (stats->function_count == stats->function_capacity) {
+    stats->functions = opstats_grow(stats->functions, &stats->function_capacity,
+                                    sizeof(MescheOpStatsFunction));
+  }
+
+  stats->functions[stats->function_count++] =
+      (MescheOpStatsFunction){.name = strdup(name),
+                              .line = line,
+                              .instruction_count = function->instruction_count,
+                              .call_count = function->call_count};
+}
+
+void mesche_opstats_native_free(VM *vm, ObjectNativeFunction *native) {
+  MescheOpStats *stats = vm->opstats;
+  for (int i = 0; i < stats->native_count; i++) {
+    if (stats->natives[i].function == native->function) {
+      stats->natives[i].call_count += native->call_count;
+      return;
+    }
+  }
+}
+
+typedef struct {
+  uint8_t first;
+  uint8_t second;
+  size_t count;
+} OpStatsPair;
+
+static int opstats_pair_compare(const void *left, const void *right) {
+  size_t left_count = ((const OpStatsPair *)left)->count;
+  size_t right_count = ((const OpStatsPair *)right)->count;
+  return left_count < right_count ? 1 : left_count > right_count ? -1 : 0;
+}
+
+static int opstats_function_compare(const void *left, const void *right) {
+  size_t left_count = ((const MescheOpStatsFunction *)left)->instruction_count;
+  size_t right_count = ((const MescheOpStatsFunction *)right)->instruction_count;
+  return left_count < right_count ? 1 : left_count > right_count ? -1 : 0;
+}
+
+static int opstats_native_compare(const void *left, const void *right) {
+  size_t left_count = ((const MescheOpStatsNative *)left)->call_count;
+  size_t right_count = ((const MescheOpStatsNative *)right)->call_count;
+  return left_count < right_count ? 1 : left_count > right_count ? -1 : 0;
+}
+
+// Names come from source code so they could contain anything
+static void opstats_write_json_string(FILE *out, const char *string) {
+  fputc('"', out);
+  for (const char *c = string; *c != '\0'; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(out, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(out, "\\u%04x", *c);
+    } else {
+      fputc(*c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void opstats_write_csv_string(FILE *out, const char *string) {
+  fputc('"', out);
+  for (const char *c = string; *c != '\0'; c++) {
+    if (*c == '"') {
+      fputc('"', out);
+    }
+    fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+static void opstats_write_json(MescheOpStats *stats, OpStatsPair *pairs, int pair_count,
+                               FILE *out) {
+  fprintf(out, "{\n  \"calls\": {\"closure\": %zu, \"native\": %zu},\n", stats->closure_calls,
+          stats->native_calls);
+
+  fprintf(out, "  \"opcodes\": [");
+  bool is_first = true;
+  for (int i = 0; i < OP_COUNT; i++) {
+    if (stats->opcode_counts[i] > 0) {
+      fprintf(out, "%s\n    {\"opcode\": \"%s\", \"count\": %zu}", is_first ? "" : ",",
+              mesche_opstats_opcode_name(i), stats->opcode_counts[i]);
+      is_first = false;
+    }
+  }
+
+  fprintf(out, "\n  ],\n  \"pairs\": [");
+  for (int i = 0; i < pair_count; i++) {
+    fprintf(out, "%s\n    {\"opcode\": \"%s\", \"next\": \"%s\", \"count\": %zu}",
+            i == 0 ? "" : ",", mesche_opstats_opcode_name(pairs[i].first),
+            mesche_opstats_opcode_name(pairs[i].second), pairs[i].count);
+  }
+
+  fprintf(out, "\n  ],\n  \"functions\": [");
+  for (int i = 0; i < stats->function_count; i++) {
+    MescheOpStatsFunction *entry = &stats->functions[i];
+    fprintf(out, "%s\n    {\"name\": ", i == 0 ? "" : ",");
+    opstats_write_json_string(out, entry->name);
+    fprintf(out, ", \"line\": %d, \"instructions\": %zu, \"calls\": %zu}", entry->line,
+            entry->instruction_count, entry->call_count);
+  }
+
+  // Natives which were never called are left out since every VM defines many
+  fprintf(out, "\n  ],\n  \"natives\": [");
+  is_first = true;
+  for (int i = 0; i < stats->native_count; i++) {
+    if (stats->natives[i].call_count == 0) {
+      continue;
+    }
+
+    fprintf(out, "%s\n    {\"name\": ", is_first ? "" : ",");
+    is_first = false;
+    opstats_write_json_string(out, stats->natives[i].name);
+    fprintf(out, ", \"calls\": %zu}", stats->natives[i].call_count);
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+}
+
+static void opstats_write_csv(MescheOpStats *stats, OpStatsPair *pairs, int pair_count,
+                              FILE *out) {
+  fprintf(out, "kind,name,next,count,calls\n");
+  fprintf(out, "calls,closure,,,%zu\n", stats->closure_calls);
+  fprintf(out, "calls,native,,,%zu\n", stats->native_calls);
+
+  for (int i = 0; i < OP_COUNT; i++) {
+    if (stats->opcode_counts[i] > 0) {
+      fprintf(out, "opcode,%s,,%zu,\n", mesche_opstats_opcode_name(i), stats->opcode_counts[i]);
+    }
+  }
+
+  for (int i = 0; i < pair_count; i++) {
+    fprintf(out, "pair,%s,%s,%zu,\n", mesche_opstats_opcode_name(pairs[i].first),
+            mesche_opstats_opcode_name(pairs[i].second), pairs[i].count);
+  }
+
+  // The function's line goes in the "next" column
+  for (int i = 0; i < stats->function_count; i++) {
+    MescheOpStatsFunction *entry = &stats->functions[i];
+    fprintf(out, "function,");
+    opstats_write_csv_string(out, entry->name);
+    fprintf(out, ",%d,%zu,%zu\n", entry->line, entry->instruction_count, entry->call_count);
+  }
+
+  for (int i = 0; i < stats->native_count; i++) {
+    if (stats->natives[i].call_count == 0) {
+      continue;
+    }
+
+    fprintf(out, "native,");
+    opstats_write_csv_string(out, stats->natives[i].name);
+    fprintf(out, ",,,%zu\n", stats->natives[i].call_count);
+  }
+}
+
+// Functions which are still alive have to be freed before the counts are
+// written so that theirs are included
+bool mesche_opstats_write(VM *vm, const char *file_path) {
+  MescheOpStats *stats = vm->opstats;
+  FILE *out = fopen(file_path, "w");
+  if (out == NULL) {
+    return false;
+  }
+
+  int pair_count = 0;
+  OpStatsPair *pairs = malloc(sizeof(OpStatsPair) * OP_COUNT * OP_COUNT);
+  if (pairs == NULL) {
+    PANIC("Could not allocate opcode pairs.");
+  }
+
+  for (int i = 0; i < OP_COUNT; i++) {
+    for (int j = 0; j < OP_COUNT; j++) {
+      if (stats->pair_counts[i][j] > 0) {
+        pairs[pair_count++] = (OpStatsPair){i, j, stats->pair_counts[i][j]};
+      }
+    }
+  }
+
+  qsort(pairs, pair_count, sizeof(OpStatsPair), opstats_pair_compare);
+  qsort(stats->functions, stats->function_count, sizeof(MescheOpStatsFunction),
+        opstats_function_compare);
+  qsort(stats->natives, stats->native_count, sizeof(MescheOpStatsNative),
+        opstats_native_compare);
+
+  size_t path_length = strlen(file_path);
+  if (path_length >= 4 && strcmp(file_path + path_length - 4, ".csv") == 0) {
+    opstats_write_csv(stats, pairs, pair_count, out);
+  } else {
+    opstats_write_json(stats, pairs, pair_count, out);
+  }
+
+  free(pairs);
+  fclose(out);
+  return true;
+}
+
+void mesche_opstats_free(VM *vm) {
+  MescheOpStats *stats = vm->opstats;
+  if (stats == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < stats->function_count; i++) {
+    free(stats->functions[i].name);
+  }
+  for (int i = 0; i < stats->native_count; i++) {
+    free(stats->natives[i].name);
+  }
+
+  free(stats->functions);
+  free(stats->natives);
+  free(stats);
+  vm->opstats = NULL;
+}
+
+#endif
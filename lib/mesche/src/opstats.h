@@ -0,0 +1,72 @@
+#ifndef mesche_opstats_h
+#define mesche_opstats_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "object.h"
+#include "op.h"
+#include "vm.h"
+
+// Where the counts are written when MESCHE_OPCODE_STATS_PATH isn't set, a
+// path ending in .csv selects CSV instead of JSON
+#define OPSTATS_DEFAULT_PATH "mesche-opcode-stats.json"
+
+// Counts of a function which has been freed, merged with others of the same
+// name and line
+typedef struct {
+  char *name;
+  int line;
+  size_t instruction_count;
+  size_t call_count;
+} MescheOpStatsFunction;
+
+// Native functions have no name of their own so the name they were defined
+// with is remembered for their function pointer
+typedef struct {
+  FunctionPtr function;
+  char *name;
+  size_t call_count;
+} MescheOpStatsNative;
+
+typedef struct MescheOpStats {
+  size_t opcode_counts[OP_COUNT];
+  size_t pair_counts[OP_COUNT][OP_COUNT];
+  uint8_t previous_opcode;
+  size_t closure_calls;
+  size_t native_calls;
+
+  int function_count;
+  int function_capacity;
+  MescheOpStatsFunction *functions;
+
+  int native_count;
+  int native_capacity;
+  MescheOpStatsNative *natives;
+} MescheOpStats;
+
+const char *mesche_opstats_opcode_name(uint8_t opcode);
+
+#ifdef MESCHE_OPCODE_STATS
+
+// Counts an instruction as it's dispatched along with the one before it
+static inline uint8_t mesche_opstats_count(MescheOpStats *stats, ObjectFunction *function,
+                                           uint8_t opcode) {
+  stats->opcode_counts[opcode]++;
+  stats->pair_counts[stats->previous_opcode][opcode]++;
+  stats->previous_opcode = opcode;
+  function->instruction_count++;
+  return opcode;
+}
+
+void mesche_opstats_init(VM *vm);
+void mesche_opstats_native_define(VM *vm, FunctionPtr function, const char *name);
+void mesche_opstats_function_free(VM *vm, ObjectFunction *function);
+void mesche_opstats_native_free(VM *vm, ObjectNativeFunction *native);
+bool mesche_opstats_write(VM *vm, const char *file_path);
+void mesche_opstats_free(VM *vm);
+
+#endif
+
+#endif
@@ -0,0 +1,393 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "op.h"
+#include "peephole.h"
+#include "util.h"
+
+// The peephole pass rewrites a finished chunk into a shorter one where
+// common instruction sequences are fused into superinstructions.  Nothing
+// may jump into the middle of a fused sequence so every jump target is
+// counted before the rewrite, and the jumps which were written are patched
+// once the new location of every old instruction is known.
+//
+// When register instructions are enabled, operands which are only pushed to
+// be consumed right away are read from their local slot or constant instead.
+
+typedef struct {
+  int operand;
+  int old_target;
+} PeepholeJump;
+
+typedef struct {
+  Chunk *chunk;
+  bool use_registers;
+
+  // The chunk as the compiler emitted it
+  Chunk original;
+  int count;
+
+  // Indexed by old offset, only meaningful where an instruction starts
+  int *previous;
+  int *target_counts;
+  int *new_offsets;
+  bool *is_removed;
+
+  PeepholeJump *jumps;
+  int jump_count;
+  int jump_capacity;
+
+  int write_offset;
+} Peephole;
+
+static int peephole_jump_target(Peephole *peephole, int offset) {
+  uint8_t *code = peephole->original.code;
+  return offset + 3 + (uint16_t)((code[offset + 1] << 8) | code[offset + 2]);
+}
+
+static int peephole_loop_target(Peephole *peephole, int offset) {
+  uint8_t *code = peephole->original.code;
+  return offset + 5 - (uint16_t)((code[offset + 3] << 8) | code[offset + 4]);
+}
+
+static void peephole_retarget(Peephole *peephole, int old_target, int new_target) {
+  peephole->target_counts[old_target]--;
+  peephole->target_counts[new_target]++;
+}
+
+// Whether the instruction at the offset can be folded into the one before
+// it, which is only the case if nothing jumps to it
+static bool peephole_can_fuse(Peephole *peephole, int offset, uint8_t instr) {
+  return offset < peephole->count && peephole->original.code[offset] == instr &&
+         peephole->target_counts[offset] == 0 && !peephole->is_removed[offset];
+}
+
+static void peephole_emit(Peephole *peephole, uint8_t byte, int line) {
+  peephole->chunk->code[peephole->write_offset] = byte;
+  peephole->chunk->lines[peephole->write_offset] = line;
+  peephole->write_offset++;
+}
+
+static void peephole_emit_jump(Peephole *peephole, uint8_t instr, int old_target, int line) {
+  if (peephole->jump_count == peephole->jump_capacity) {
+    peephole->jump_capacity = GROW_CAPACITY(peephole->jump_capacity);
+    peephole->jumps = realloc(peephole->jumps, sizeof(PeepholeJump) * peephole->jump_capacity);
+    if (peephole->jumps == NULL) {
+      PANIC("Could not allocate peephole jumps.");
+    }
+  }
+
+  peephole_emit(peephole, instr, line);
+  peephole->jumps[peephole->jump_count++] =
+      (PeepholeJump){.operand = peephole->write_offset, .old_target = old_target};
+  peephole_emit(peephole, 0xff, line);
+  peephole_emit(peephole, 0xff, line);
+}
+
+static uint8_t peephole_local_constant_instr(uint8_t instr) {
+  switch (instr) {
+  case OP_ADD:
+    return OP_ADD_LOCAL_CONSTANT;
+  case OP_SUBTRACT:
+    return OP_SUBTRACT_LOCAL_CONSTANT;
+  case OP_EQV:
+    return OP_EQV_LOCAL_CONSTANT;
+  default:
+    return OP_COUNT;
+  }
+}
+
+static uint8_t peephole_register_instr(uint8_t instr) {
+  switch (instr) {
+  case OP_ADD:
+    return OP_ADD_REG;
+  case OP_SUBTRACT:
+    return OP_SUBTRACT_REG;
+  case OP_MULTIPLY:
+    return OP_MULTIPLY_REG;
+  case OP_DIVIDE:
+    return OP_DIVIDE_REG;
+  case OP_EQV:
+  case OP_EQUAL:
+    return OP_EQV_REG;
+  default:
+    return OP_COUNT;
+  }
+}
+
+// Whether the instruction at the offset pushes a local or a constant which
+// a register instruction could read in place
+static bool peephole_is_register_operand(Peephole *peephole, int offset) {
+  if (offset >= peephole->count || peephole->is_removed[offset] ||
+      peephole->target_counts[offset] > 0) {
+    return false;
+  }
+
+  uint8_t instr = peephole->original.code[offset];
+  return instr == OP_READ_LOCAL || instr == OP_CONSTANT;
+}
+
+// Turns a pair of pushed locals or constants and the operator which consumes
+// them into one register instruction, or a local which is pushed and then
+// stored into another local into a move
+static int peephole_fuse_register(Peephole *peephole, int offset) {
+  uint8_t *code = peephole->original.code;
+  int line = peephole->original.lines[offset];
+
+  if (code[offset] == OP_READ_LOCAL && peephole_can_fuse(peephole, offset + 2, OP_SET_LOCAL) &&
+      peephole_can_fuse(peephole, offset + 4, OP_POP)) {
+    peephole_emit(peephole, OP_MOVE_LOCAL, line);
+    peephole_emit(peephole, code[offset + 3], line);
+    peephole_emit(peephole, code[offset + 1], line);
+    return offset + 5;
+  }
+
+  if (!peephole_is_register_operand(peephole, offset + 2) || offset + 4 >= peephole->count ||
+      peephole->target_counts[offset + 4] > 0 || peephole->is_removed[offset + 4]) {
+    return -1;
+  }
+
+  uint8_t instr = peephole_register_instr(code[offset + 4]);
+  if (instr == OP_COUNT) {
+    return -1;
+  }
+
+  uint8_t mode = 0;
+  if (code[offset] == OP_CONSTANT) {
+    mode |= OP_REG_A_CONSTANT;
+  }
+  if (code[offset + 2] == OP_CONSTANT) {
+    mode |= OP_REG_B_CONSTANT;
+  }
+
+  peephole_emit(peephole, instr, line);
+  peephole_emit(peephole, mode, line);
+  peephole_emit(peephole, code[offset + 1], line);
+  peephole_emit(peephole, code[offset + 3], line);
+  return offset + 5;
+}
+
+// `if` leaves its condition on the stack and pops it at the start of both
+// branches.  When the `OP_JUMP_IF_FALSE` at the offset has that shape,
+// returns the offset of the false branch's `OP_POP` so that the jump can pop
+// the condition itself and land after it.  Otherwise returns -1.
+static int peephole_pop_jump_target(Peephole *peephole, int offset) {
+  int target = peephole_jump_target(peephole, offset);
+  if (!peephole_can_fuse(peephole, offset + 3, OP_POP) || target >= peephole->count ||
+      peephole->original.code[target] != OP_POP) {
+    return -1;
+  }
+
+  return target;
+}
+
+static void peephole_emit_pop_jump(Peephole *peephole, uint8_t instr, int target, int line) {
+  peephole_retarget(peephole, target, target + 1);
+
+  // The false branch's pop is dead if the true branch jumps over it
+  int previous = peephole->previous[target];
+  if (peephole->target_counts[target] == 0 && previous != -1 &&
+      peephole->original.code[previous] == OP_JUMP) {
+    peephole->is_removed[target] = true;
+  }
+
+  peephole_emit_jump(peephole, instr, target + 1, line);
+}
+
+// Tries to fuse the instructions at the offset, returning the offset of the
+// next instruction if that succeeded or -1 if nothing was emitted
+static int peephole_fuse(Peephole *peephole, int offset) {
+  uint8_t *code = peephole->original.code;
+  int line = peephole->original.lines[offset];
+
+  switch (code[offset]) {
+  case OP_READ_LOCAL: {
+    // `(+ x 1)`, `(- n 1)` and `(eqv? n 0)` with a local operand
+    uint8_t instr = OP_COUNT;
+    if (peephole_can_fuse(peephole, offset + 2, OP_CONSTANT) && offset + 4 < peephole->count &&
+        peephole->target_counts[offset + 4] == 0) {
+      instr = peephole_local_constant_instr(code[offset + 4]);
+    }
+
+    if (instr == OP_COUNT) {
+      return peephole->use_registers ? peephole_fuse_register(peephole, offset) : -1;
+    }
+
+    peephole_emit(peephole, instr, line);
+    peephole_emit(peephole, code[offset + 1], line);
+    peephole_emit(peephole, code[offset + 3], line);
+    return offset + 5;
+  }
+  case OP_CONSTANT:
+    return peephole->use_registers ? peephole_fuse_register(peephole, offset) : -1;
+  case OP_SET_LOCAL:
+    // A local which is set as a statement doesn't need its value kept
+    if (!peephole->use_registers || !peephole_can_fuse(peephole, offset + 2, OP_POP)) {
+      return -1;
+    }
+
+    peephole_emit(peephole, OP_STORE_LOCAL, line);
+    peephole_emit(peephole, code[offset + 1], line);
+    return offset + 3;
+  case OP_EQV: {
+    if (!peephole_can_fuse(peephole, offset + 1, OP_JUMP_IF_FALSE)) {
+      return -1;
+    }
+
+    int target = peephole_pop_jump_target(peephole, offset + 1);
+    if (target == -1) {
+      return -1;
+    }
+
+    peephole_emit_pop_jump(peephole, OP_EQV_JUMP_IF_FALSE, target, line);
+    return offset + 5;
+  }
+  case OP_JUMP_IF_FALSE: {
+    int target = peephole_pop_jump_target(peephole, offset);
+    if (target == -1) {
+      return -1;
+    }
+
+    peephole_emit_pop_jump(peephole, OP_POP_JUMP_IF_FALSE, target, line);
+    return offset + 4;
+  }
+  case OP_JUMP: {
+    // Jumps to jumps go straight to the final target and a jump to a return
+    // returns right away
+    int target = peephole_jump_target(peephole, offset);
+    while (target < peephole->count && code[target] == OP_JUMP) {
+      int next_target = peephole_jump_target(peephole, target);
+      peephole_retarget(peephole, target, next_target);
+      target = next_target;
+    }
+
+    if (target < peephole->count && code[target] == OP_RETURN) {
+      peephole->target_counts[target]--;
+      peephole_emit(peephole, OP_RETURN, line);
+    } else {
+      peephole_emit_jump(peephole, OP_JUMP, target, line);
+    }
+
+    return offset + 3;
+  }
+  case OP_POP_SCOPE: {
+    // Locals leave their scope one at a time
+    int local_count = code[offset + 1];
+    offset += 2;
+    while (peephole_can_fuse(peephole, offset, OP_POP_SCOPE) &&
+           local_count + code[offset + 1] <= UINT8_MAX) {
+      local_count += code[offset + 1];
+      offset += 2;
+    }
+
+    // Popping no locals leaves the stack as it was
+    if (local_count > 0) {
+      peephole_emit(peephole, OP_POP_SCOPE, line);
+      peephole_emit(peephole, local_count, line);
+    }
+
+    return offset;
+  }
+  default:
+    return -1;
+  }
+}
+
+void mesche_peephole_optimize(Chunk *chunk, bool use_registers) {
+  Peephole peephole;
+  memset(&peephole, 0, sizeof(Peephole));
+  peephole.chunk = chunk;
+  peephole.use_registers = use_registers;
+  peephole.count = chunk->count;
+
+  // Keep the original instructions around while the chunk is rewritten, the
+  // constants are shared since they don't change
+  int count = chunk->count;
+  peephole.original = *chunk;
+  peephole.original.code = malloc(sizeof(uint8_t) * count);
+  peephole.original.lines = malloc(sizeof(int) * count);
+  peephole.previous = malloc(sizeof(int) * (count + 1));
+  peephole.target_counts = calloc(count + 1, sizeof(int));
+  peephole.new_offsets = malloc(sizeof(int) * (count + 1));
+  peephole.is_removed = calloc(count + 1, sizeof(bool));
+  if (peephole.original.code == NULL || peephole.original.lines == NULL ||
+      peephole.previous == NULL || peephole.target_counts == NULL ||
+      peephole.new_offsets == NULL || peephole.is_removed == NULL) {
+    PANIC("Could not allocate peephole state.");
+  }
+
+  memcpy(peephole.original.code, chunk->code, sizeof(uint8_t) * count);
+  memcpy(peephole.original.lines, chunk->lines, sizeof(int) * count);
+
+  // Find where each instruction starts and what jumps to it
+  int previous = -1;
+  for (int offset = 0; offset < count;
+       offset += mesche_chunk_instr_length(&peephole.original, offset)) {
+    uint8_t instr = peephole.original.code[offset];
+    if (instr == OP_JUMP || instr == OP_JUMP_IF_FALSE) {
+      peephole.target_counts[peephole_jump_target(&peephole, offset)]++;
+    } else if (instr == OP_LOOP) {
+      peephole.target_counts[peephole_loop_target(&peephole, offset)]++;
+    }
+
+    peephole.previous[offset] = previous;
+    previous = offset;
+  }
+
+  for (int offset = 0; offset < count;) {
+    peephole.new_offsets[offset] = peephole.write_offset;
+    if (peephole.is_removed[offset]) {
+      offset += mesche_chunk_instr_length(&peephole.original, offset);
+      continue;
+    }
+
+    int next_offset = peephole_fuse(&peephole, offset);
+    if (next_offset != -1) {
+      offset = next_offset;
+      continue;
+    }
+
+    // Copy the instruction as it is, jumps still need to be patched
+    int length = mesche_chunk_instr_length(&peephole.original, offset);
+    int line = peephole.original.lines[offset];
+    if (peephole.original.code[offset] == OP_JUMP_IF_FALSE) {
+      peephole_emit_jump(&peephole, OP_JUMP_IF_FALSE, peephole_jump_target(&peephole, offset),
+                         line);
+    } else {
+      for (int i = 0; i < length; i++) {
+        peephole_emit(&peephole, peephole.original.code[offset + i], line);
+      }
+
+      // A loop's start has already been written so its jump is patched now
+      if (peephole.original.code[offset] == OP_LOOP) {
+        int distance =
+            peephole.write_offset - peephole.new_offsets[peephole_loop_target(&peephole, offset)];
+        chunk->code[peephole.write_offset - 2] = (distance >> 8) & 0xff;
+        chunk->code[peephole.write_offset - 1] = distance & 0xff;
+      }
+    }
+
+    offset += length;
+  }
+
+  peephole.new_offsets[count] = peephole.write_offset;
+  chunk->count = peephole.write_offset;
+
+  // Jumps only ever get shorter so they still fit
+  for (int i = 0; i < peephole.jump_count; i++) {
+    PeepholeJump *jump = &peephole.jumps[i];
+    int distance = peephole.new_offsets[jump->old_target] - (jump->operand + 2);
+    chunk->code[jump->operand] = (distance >> 8) & 0xff;
+    chunk->code[jump->operand + 1] = distance & 0xff;
+  }
+
+  free(peephole.original.code);
+  free(peephole.original.lines);
+  free(peephole.previous);
+  free(peephole.target_counts);
+  free(peephole.new_offsets);
+  free(peephole.is_removed);
+  free(peephole.jumps);
+}
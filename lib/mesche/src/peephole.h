@@ -0,0 +1,10 @@
+#ifndef mesche_peephole_h
+#define mesche_peephole_h
+
+#include <stdbool.h>
+
+#include "chunk.h"
+
+void mesche_peephole_optimize(Chunk *chunk, bool use_registers);
+
+#endif
@@ -0,0 +1,494 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "module.h"
+#include "object.h"
+#include "profile.h"
+#include "util.h"
+#include "vm.h"
+
+// Samples are aggregated by the SIGPROF handler itself, which can't allocate,
+// so all of its tables are allocated up front.  Samples which don't fit are
+// counted as dropped.
+#define PROFILE_MAX_DEPTH 64
+#define PROFILE_FUNCTION_CAPACITY 4096
+#define PROFILE_STACK_CAPACITY 16384
+#define PROFILE_FRAME_CAPACITY (512 * 1024)
+
+// A frame of a sampled call stack: the function's slot in the function table
+// and the source line it was executing
+typedef struct {
+  uint32_t function;
+  uint32_t line;
+} ProfileFrame;
+
+// A distinct call stack and the number of times it was sampled.  Its frames
+// are stored outermost first in the profiler's frame arena.
+typedef struct {
+  uint32_t hash;
+  uint32_t first_frame;
+  uint16_t depth;
+  bool is_truncated;
+  uint32_t count;
+} ProfileStack;
+
+typedef struct MescheProfiler {
+  VM *vm;
+  pthread_t thread;
+  long interval_us;
+  bool is_running;
+
+  // Set while the tables are read so that the signal handler leaves them be
+  volatile sig_atomic_t is_reading;
+
+  // Sampled functions stay alive until the profiler is reset so that their
+  // names can be reported after they're gone from the program
+  ObjectFunction *functions[PROFILE_FUNCTION_CAPACITY];
+  int function_count;
+
+  ProfileStack stacks[PROFILE_STACK_CAPACITY];
+  int stack_count;
+  ProfileFrame frames[PROFILE_FRAME_CAPACITY];
+  int frame_count;
+
+  size_t sample_count;
+  size_t idle_count;
+  size_t dropped_count;
+} MescheProfiler;
+
+// The interval timer belongs to the process, so only one VM can be profiled
+// at a time
+static MescheProfiler *volatile profile_active = NULL;
+
+static int profile_function_slot(MescheProfiler *profiler, ObjectFunction *function) {
+  uint32_t mask = PROFILE_FUNCTION_CAPACITY - 1;
+  uint32_t slot = (uint32_t)(((uintptr_t)function >> 3) * 2654435761u) & mask;
+  for (;;) {
+    if (profiler->functions[slot] == function) {
+      return slot;
+    }
+
+    if (profiler->functions[slot] == NULL) {
+      if (profiler->function_count >= PROFILE_FUNCTION_CAPACITY * 3 / 4) {
+        return -1;
+      }
+
+      profiler->functions[slot] = function;
+      profiler->function_count++;
+      return slot;
+    }
+
+    slot = (slot + 1) & mask;
+  }
+}
+
+static void profile_take_sample(MescheProfiler *profiler) {
+  VM *vm = profiler->vm;
+  profiler->sample_count++;
+  if (profiler->is_reading) {
+    profiler->dropped_count++;
+    return;
+  }
+
+  // The VM fills in a call frame before counting it and keeps its old frames
+  // until new ones are in place, so every counted frame can be read here
+  int frame_count = vm->frame_count;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  CallFrame *frames = vm->frames;
+  if (frame_count == 0) {
+    profiler->idle_count++;
+    return;
+  }
+
+  // Keep the innermost frames of deep stacks
+  ProfileFrame sample[PROFILE_MAX_DEPTH];
+  int first = frame_count > PROFILE_MAX_DEPTH ? frame_count - PROFILE_MAX_DEPTH : 0;
+  int depth = frame_count - first;
+  bool is_truncated = first > 0;
+  uint32_t hash = 2166136261u ^ is_truncated;
+  for (int i = 0; i < depth; i++) {
+    CallFrame *frame = &frames[first + i];
+    ObjectFunction *function = frame->closure->function;
+    Chunk *chunk = &function->chunk;
+    int slot = profile_function_slot(profiler, function);
+    if (slot < 0 || chunk->count == 0) {
+      profiler->dropped_count++;
+      return;
+    }
+
+    // The instruction pointer is already past the current instruction and a
+    // tail call may have swapped the closure before resetting it
+    ptrdiff_t offset = frame->ip - chunk->code - 1;
+    if (offset < 0 || offset >= chunk->count) {
+      offset = offset < 0 ? 0 : chunk->count - 1;
+    }
+
+    sample[i].function = slot;
+    sample[i].line = chunk->lines[offset];
+    hash = (hash ^ sample[i].function) * 16777619u;
+    hash = (hash ^ sample[i].line) * 16777619u;
+  }
+
+  uint32_t mask = PROFILE_STACK_CAPACITY - 1;
+  uint32_t slot = hash & mask;
+  while (profiler->stacks[slot].count > 0) {
+    ProfileStack *stack = &profiler->stacks[slot];
+    if (stack->hash == hash && stack->depth == depth && stack->is_truncated == is_truncated &&
+        memcmp(&profiler->frames[stack->first_frame], sample, sizeof(ProfileFrame) * depth) == 0) {
+      stack->count++;
+      return;
+    }
+
+    slot = (slot + 1) & mask;
+  }
+
+  if (profiler->stack_count >= PROFILE_STACK_CAPACITY * 3 / 4 ||
+      profiler->frame_count + depth > PROFILE_FRAME_CAPACITY) {
+    profiler->dropped_count++;
+    return;
+  }
+
+  ProfileStack *stack = &profiler->stacks[slot];
+  memcpy(&profiler->frames[profiler->frame_count], sample, sizeof(ProfileFrame) * depth);
+  stack->hash = hash;
+  stack->first_frame = profiler->frame_count;
+  stack->depth = depth;
+  stack->is_truncated = is_truncated;
+  stack->count = 1;
+  profiler->frame_count += depth;
+  profiler->stack_count++;
+}
+
+static void profile_signal_handler(int signal_number) {
+  MescheProfiler *profiler = profile_active;
+  if (profiler == NULL) {
+    return;
+  }
+
+  // The timer's signal goes to whichever thread is using the CPU, e.g. a
+  // marking thread, but only the VM's thread can look at its call frames
+  if (!pthread_equal(pthread_self(), profiler->thread)) {
+    pthread_kill(profiler->thread, SIGPROF);
+    return;
+  }
+
+  int saved_errno = errno;
+  profile_take_sample(profiler);
+  errno = saved_errno;
+}
+
+static void profile_begin_reading(MescheProfiler *profiler) {
+  profiler->is_reading = true;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static void profile_end_reading(MescheProfiler *profiler) {
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  profiler->is_reading = false;
+}
+
+void mesche_profile_start(VM *vm, long interval_us) {
+  if (profile_active != NULL) {
+    if (profile_active->vm != vm) {
+      fprintf(stderr, "The profiler is already running for another VM.\n");
+    }
+    return;
+  }
+
+  if (vm->profiler == NULL) {
+    vm->profiler = (MescheProfiler *)calloc(1, sizeof(MescheProfiler));
+    if (vm->profiler == NULL) {
+      PANIC("Profiler allocation failed!\n");
+    }
+    vm->profiler->vm = vm;
+  }
+
+  MescheProfiler *profiler = vm->profiler;
+  profiler->thread = pthread_self();
+  profiler->interval_us = interval_us > 0 ? interval_us : PROFILE_DEFAULT_INTERVAL_US;
+
+  // The handler stays installed after the profiler stops because the
+  // default action of a late SIGPROF is to terminate the process
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = profile_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+
+  profile_active = profiler;
+  profiler->is_running = true;
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = profiler->interval_us / 1000000;
+  timer.it_interval.tv_usec = profiler->interval_us % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void mesche_profile_stop(VM *vm) {
+  MescheProfiler *profiler = vm->profiler;
+  if (profiler == NULL || !profiler->is_running) {
+    return;
+  }
+
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  profile_active = NULL;
+  profiler->is_running = false;
+}
+
+void mesche_profile_reset(VM *vm) {
+  MescheProfiler *profiler = vm->profiler;
+  if (profiler == NULL) {
+    return;
+  }
+
+  profile_begin_reading(profiler);
+  memset(profiler->functions, 0, sizeof(profiler->functions));
+  memset(profiler->stacks, 0, sizeof(profiler->stacks));
+  profiler->function_count = 0;
+  profiler->stack_count = 0;
+  profiler->frame_count = 0;
+  profiler->sample_count = 0;
+  profiler->idle_count = 0;
+  profiler->dropped_count = 0;
+  profile_end_reading(profiler);
+}
+
+bool mesche_profile_is_running(VM *vm) {
+  return vm->profiler != NULL && vm->profiler->is_running;
+}
+
+static const char *profile_function_name(ObjectFunction *function) {
+  if (function->name != NULL) {
+    return function->name->chars;
+  }
+
+  return function->type == TYPE_SCRIPT ? "<script>" : "<lambda>";
+}
+
+typedef struct {
+  uint32_t function;
+  uint32_t line;
+  size_t count;
+} ProfileEntry;
+
+static int profile_entry_compare_location(const void *a, const void *b) {
+  const ProfileEntry *left = a;
+  const ProfileEntry *right = b;
+  if (left->function != right->function) {
+    return left->function < right->function ? -1 : 1;
+  }
+
+  return left->line < right->line ? -1 : left->line > right->line;
+}
+
+static int profile_entry_compare_count(const void *a, const void *b) {
+  const ProfileEntry *left = a;
+  const ProfileEntry *right = b;
+  return left->count < right->count ? 1 : left->count > right->count ? -1 : 0;
+}
+
+static double profile_percent(MescheProfiler *profiler, size_t count) {
+  return profiler->sample_count > 0 ? 100.0 * count / profiler->sample_count : 0.0;
+}
+
+void mesche_profile_print_report(VM *vm, FILE *out, int top_count) {
+  MescheProfiler *profiler = vm->profiler;
+  if (profiler == NULL) {
+    fprintf(out, "-- No profile has been recorded.\n");
+    return;
+  }
+
+  profile_begin_reading(profiler);
+
+  // Count the samples in which each function is running (self) or anywhere
+  // on the stack (total), a recursive function only counts once per sample
+  size_t *self_counts = calloc(PROFILE_FUNCTION_CAPACITY, sizeof(size_t));
+  size_t *total_counts = calloc(PROFILE_FUNCTION_CAPACITY, sizeof(size_t));
+  int *seen_in_stack = calloc(PROFILE_FUNCTION_CAPACITY, sizeof(int));
+  ProfileEntry *lines = calloc(profiler->stack_count + 1, sizeof(ProfileEntry));
+  ProfileEntry *functions = calloc(profiler->function_count + 1, sizeof(ProfileEntry));
+  if (self_counts == NULL || total_counts == NULL || seen_in_stack == NULL || lines == NULL ||
+      functions == NULL) {
+    PANIC("Profile report allocation failed!\n");
+  }
+
+  int line_count = 0;
+  for (int i = 0, stack_index = 0; i < PROFILE_STACK_CAPACITY; i++) {
+    ProfileStack *stack = &profiler->stacks[i];
+    if (stack->count == 0) {
+      continue;
+    }
+
+    stack_index++;
+    ProfileFrame *frames = &profiler->frames[stack->first_frame];
+    for (int j = 0; j < stack->depth; j++) {
+      if (seen_in_stack[frames[j].function] != stack_index) {
+        seen_in_stack[frames[j].function] = stack_index;
+        total_counts[frames[j].function] += stack->count;
+      }
+    }
+
+    ProfileFrame *top = &frames[stack->depth - 1];
+    self_counts[top->function] += stack->count;
+    lines[line_count++] = (ProfileEntry){top->function, top->line, stack->count};
+  }
+
+  int function_count = 0;
+  for (int i = 0; i < PROFILE_FUNCTION_CAPACITY; i++) {
+    if (profiler->functions[i] != NULL) {
+      functions[function_count++] = (ProfileEntry){i, 0, self_counts[i]};
+    }
+  }
+
+  // Merge the samples taken on the same line under different callers
+  qsort(lines, line_count, sizeof(ProfileEntry), profile_entry_compare_location);
+  int merged_count = 0;
+  for (int i = 0; i < line_count; i++) {
+    if (merged_count > 0 && lines[merged_count - 1].function == lines[i].function &&
+        lines[merged_count - 1].line == lines[i].line) {
+      lines[merged_count - 1].count += lines[i].count;
+    } else {
+      lines[merged_count++] = lines[i];
+    }
+  }
+
+  qsort(functions, function_count, sizeof(ProfileEntry), profile_entry_compare_count);
+  qsort(lines, merged_count, sizeof(ProfileEntry), profile_entry_compare_count);
+
+  fprintf(out, "-- Profile: %zu samples every %ld us (%zu outside of Mesche code, %zu dropped)\n\n",
+          profiler->sample_count, profiler->interval_us, profiler->idle_count,
+          profiler->dropped_count);
+  fprintf(out, "   Self   Total  Function\n");
+  for (int i = 0; i < function_count && i < top_count; i++) {
+    uint32_t slot = functions[i].function;
+    fprintf(out, " %5.1f%%  %5.1f%%  %s\n", profile_percent(profiler, self_counts[slot]),
+            profile_percent(profiler, total_counts[slot]),
+            profile_function_name(profiler->functions[slot]));
+  }
+
+  fprintf(out, "\n   Self  Line\n");
+  for (int i = 0; i < merged_count && i < top_count; i++) {
+    fprintf(out, " %5.1f%%  %s:%u\n", profile_percent(profiler, lines[i].count),
+            profile_function_name(profiler->functions[lines[i].function]), lines[i].line);
+  }
+
+  free(self_counts);
+  free(total_counts);
+  free(seen_in_stack);
+  free(lines);
+  free(functions);
+
+  profile_end_reading(profiler);
+}
+
+bool mesche_profile_write_folded(VM *vm, const char *file_path) {
+  // Writes one line per sampled stack in the "folded" format read by
+  // flamegraph.pl: the function names from the outermost one in, separated
+  // by semicolons, followed by the sample count
+  MescheProfiler *profiler = vm->profiler;
+  FILE *file = fopen(file_path, "w");
+  if (profiler == NULL || file == NULL) {
+    if (file != NULL) {
+      fclose(file);
+    }
+    return false;
+  }
+
+  profile_begin_reading(profiler);
+  for (int i = 0; i < PROFILE_STACK_CAPACITY; i++) {
+    ProfileStack *stack = &profiler->stacks[i];
+    if (stack->count == 0) {
+      continue;
+    }
+
+    if (stack->is_truncated) {
+      fputs("...;", file);
+    }
+
+    ProfileFrame *frames = &profiler->frames[stack->first_frame];
+    for (int j = 0; j < stack->depth; j++) {
+      fprintf(file, "%s%s", j > 0 ? ";" : "",
+              profile_function_name(profiler->functions[frames[j].function]));
+    }
+    fprintf(file, " %u\n", stack->count);
+  }
+  profile_end_reading(profiler);
+
+  fclose(file);
+  return true;
+}
+
+void mesche_profile_mark_roots(VM *vm) {
+  MescheProfiler *profiler = vm->profiler;
+  for (int i = 0; i < PROFILE_FUNCTION_CAPACITY; i++) {
+    if (profiler->functions[i] != NULL) {
+      mesche_mem_mark_object(vm, (Object *)profiler->functions[i]);
+    }
+  }
+}
+
+void mesche_profile_free(VM *vm) {
+  if (vm->profiler != NULL) {
+    mesche_profile_stop(vm);
+    free(vm->profiler);
+    vm->profiler = NULL;
+  }
+}
+
+static Value mesche_profile_func_start(MescheMemory *mem, int arg_count, Value *args) {
+  long interval_us = arg_count > 0 && IS_NUMBER(args[0]) ? (long)AS_NUMBER(args[0]) : 0;
+  mesche_profile_start((VM *)mem, interval_us);
+  return T_VAL;
+}
+
+static Value mesche_profile_func_stop(MescheMemory *mem, int arg_count, Value *args) {
+  mesche_profile_stop((VM *)mem);
+  return T_VAL;
+}
+
+static Value mesche_profile_func_reset(MescheMemory *mem, int arg_count, Value *args) {
+  mesche_profile_reset((VM *)mem);
+  return T_VAL;
+}
+
+static Value mesche_profile_func_running_p(MescheMemory *mem, int arg_count, Value *args) {
+  return BOOL_VAL(mesche_profile_is_running((VM *)mem));
+}
+
+static Value mesche_profile_func_report(MescheMemory *mem, int arg_count, Value *args) {
+  int top_count = arg_count > 0 && IS_NUMBER(args[0]) ? (int)AS_NUMBER(args[0]) : 20;
+  mesche_profile_print_report((VM *)mem, stdout, top_count);
+  return T_VAL;
+}
+
+static Value mesche_profile_func_write_folded(MescheMemory *mem, int arg_count, Value *args) {
+  if (arg_count != 1 || !IS_STRING(args[0])) {
+    return NIL_VAL;
+  }
+
+  return BOOL_VAL(mesche_profile_write_folded((VM *)mem, AS_CSTRING(args[0])));
+}
+
+void mesche_profile_module_init(VM *vm) {
+  // Define the natives of the (mesche profile) module without leaving the
+  // current module
+  ObjectModule *previous_module = vm->current_module;
+  mesche_module_enter_by_name(vm, "mesche profile");
+  mesche_vm_define_native(vm, "profile-start", mesche_profile_func_start, true);
+  mesche_vm_define_native(vm, "profile-stop", mesche_profile_func_stop, true);
+  mesche_vm_define_native(vm, "profile-reset", mesche_profile_func_reset, true);
+  mesche_vm_define_native(vm, "profile-running?", mesche_profile_func_running_p, true);
+  mesche_vm_define_native(vm, "profile-report", mesche_profile_func_report, true);
+  mesche_vm_define_native(vm, "profile-write-folded", mesche_profile_func_write_folded, true);
+  mesche_module_enter(vm, previous_module);
+}
@@ -0,0 +1,22 @@
+#ifndef mesche_profile_h
+#define mesche_profile_h
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+// How often the running VM gets sampled unless another interval is given
+#define PROFILE_DEFAULT_INTERVAL_US 1000
+
+void mesche_profile_start(VM *vm, long interval_us);
+void mesche_profile_stop(VM *vm);
+void mesche_profile_reset(VM *vm);
+bool mesche_profile_is_running(VM *vm);
+void mesche_profile_print_report(VM *vm, FILE *out, int top_count);
+bool mesche_profile_write_folded(VM *vm, const char *file_path);
+void mesche_profile_mark_roots(VM *vm);
+void mesche_profile_free(VM *vm);
+void mesche_profile_module_init(VM *vm);
+
+#endif
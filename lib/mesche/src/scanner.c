@@ -146,6 +146,7 @@ static TokenKind scanner_identifier_type(Scanner *scanner) {
       return scanner_check_keyword(scanner, 2, 4, "fine", TokenKindDefine);
     }
     case 'i': return scanner_check_keyword(scanner, 2, 5, "splay", TokenKindDisplay);
+    case 'o': return scanner_check_keyword(scanner, 2, 0, "", TokenKindDo);
     }
     break;
   }
@@ -34,6 +34,7 @@ typedef enum {
   TokenKindSet,
   TokenKindBegin,
   TokenKindLet,
+  TokenKindDo,
   TokenKindIf,
   TokenKindLambda,
   TokenKindDisplay,
@@ -9,6 +9,7 @@
 void mesche_table_init(Table *table) {
   table->count = 0;
   table->capacity = 0;
+  table->version = 0;
   table->entries = NULL;
 }
 
@@ -73,6 +74,7 @@ static void table_adjust_capacity(MescheMemory *mem, Table *table, int capacity)
 
   table->entries = entries;
   table->capacity = capacity;
+  table->version++;
 }
 
 bool mesche_table_set(MescheMemory *mem, Table *table, ObjectString *key, Value value) {
@@ -91,6 +93,7 @@ bool mesche_table_set(MescheMemory *mem, Table *table, ObjectString *key, Value
 
   entry->key = key;
   entry->value = value;
+  table->version++;
 
   return is_new_key;
 }
@@ -115,6 +118,7 @@ bool mesche_table_delete(Table *table, ObjectString *key) {
   // Set a tombstone value at this entry
   entry->key = NULL;
   entry->value = T_VAL;
+  table->version++;
 
   return true;
 }
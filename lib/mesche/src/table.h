@@ -13,6 +13,9 @@ typedef struct {
 typedef struct {
   int count;
   int capacity;
+  // Incremented whenever entries are set, removed or moved so that lookups
+  // cached against the table can be validated cheaply
+  uint32_t version;
   Entry *entries;
 } Table;
 
@@ -28,22 +28,27 @@ void mesche_value_array_free(MescheMemory *mem, ValueArray* array) {
 }
 
 void mesche_value_print(Value value) {
-  switch (value.kind) {
-  case VALUE_NUMBER: printf("%g", AS_NUMBER(value)); break;
-  case VALUE_NIL: printf("nil"); break;
-  case VALUE_TRUE: printf("t"); break;
-  case VALUE_EMPTY: printf("()"); break;
-  case VALUE_OBJECT: mesche_object_print(value); break;
+  if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_T(value)) {
+    printf("t");
+  } else if (IS_EMPTY(value)) {
+    printf("()");
+  } else if (IS_OBJECT(value)) {
+    mesche_object_print(value);
   }
 }
 
 bool mesche_value_equalp(Value a, Value b) {
-  // This check also covers comparison of t and nil
-  if (a.kind != b.kind) return false;
-
-  switch(a.kind) {
-  case VALUE_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-  case VALUE_OBJECT: return AS_OBJECT(a) == AS_OBJECT(b);
-  default: return false;
+  // Values of different kinds are never equal, this also covers comparison
+  // of t and nil
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  } else if (IS_OBJECT(a) && IS_OBJECT(b)) {
+    return AS_OBJECT(a) == AS_OBJECT(b);
   }
+
+  return false;
 }
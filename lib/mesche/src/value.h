@@ -12,19 +12,78 @@ typedef struct ObjectFunction ObjectFunction;
 typedef struct ObjectClosure ObjectClosure;
 typedef struct ObjectUpvalue ObjectUpvalue;
 typedef struct ObjectModule ObjectModule;
+typedef struct ObjectBinding ObjectBinding;
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 
 #include "mem.h"
 
+#ifdef MESCHE_NAN_BOXING
+
+// When NaN boxing is enabled, every value is packed into a single 64-bit
+// word.  Numbers are stored as plain doubles and every other kind of value
+// lives inside of the unused bits of a quiet NaN:
+//
+// - Singletons (nil, t, and the empty list) set a small tag in the low bits
+// - Object pointers set the sign bit and store the pointer in the low 48 bits
+
+#define VALUE_SIGN_BIT ((uint64_t)0x8000000000000000)
+#define VALUE_QNAN ((uint64_t)0x7ffc000000000000)
+
+#define VALUE_TAG_NIL 1
+#define VALUE_TAG_TRUE 2
+#define VALUE_TAG_EMPTY 3
+
+typedef uint64_t Value;
+
+static inline Value mesche_value_from_number(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+static inline double mesche_value_to_number(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+#define T_VAL ((Value)(uint64_t)(VALUE_QNAN | VALUE_TAG_TRUE))
+#define NIL_VAL ((Value)(uint64_t)(VALUE_QNAN | VALUE_TAG_NIL))
+#define EMPTY_VAL ((Value)(uint64_t)(VALUE_QNAN | VALUE_TAG_EMPTY))
+#define NUMBER_VAL(value) mesche_value_from_number(value)
+#define BOOL_VAL(value) ((value) ? T_VAL : NIL_VAL)
+#define OBJECT_VAL(value)                                                                          \
+  ((Value)(VALUE_SIGN_BIT | VALUE_QNAN | (uint64_t)(uintptr_t)(value)))
+
+#define AS_NUMBER(value) mesche_value_to_number(value)
+#define AS_BOOL(value) ((value) != NIL_VAL)
+#define AS_OBJECT(value) ((Object *)(uintptr_t)((value) & ~(VALUE_SIGN_BIT | VALUE_QNAN)))
+
+#define IS_ANY(value) (true)
+#define IS_T(value) ((value) == T_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_EMPTY(value) ((value) == EMPTY_VAL)
+#define IS_FALSEY(value) (IS_NIL(value))
+#define IS_NUMBER(value) (((value) & VALUE_QNAN) != VALUE_QNAN)
+#define IS_OBJECT(value)                                                                           \
+  (((value) & (VALUE_QNAN | VALUE_SIGN_BIT)) == (VALUE_QNAN | VALUE_SIGN_BIT))
+#define IS_STRING(value) mesche_object_is_kind(value, ObjectKindString)
+
+#else
+
 #define T_VAL ((Value){VALUE_TRUE, {.number = 0}})
 #define NIL_VAL ((Value){VALUE_NIL, {.number = 0}})
 #define EMPTY_VAL ((Value){VALUE_EMPTY, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VALUE_NUMBER, {.number = value}})
 #define BOOL_VAL(value) ((Value){value ? VALUE_TRUE : VALUE_NIL, {.number = 0}})
+#define OBJECT_VAL(value) ((Value){VALUE_OBJECT, {.object = (Object *)value}})
 
 #define AS_NUMBER(value) ((value).as.number)
 #define AS_BOOL(value) ((value).kind != VALUE_NIL)
+#define AS_OBJECT(value) ((value).as.object)
 
 #define IS_ANY(value) (true)
 #define IS_T(value) ((value).kind == VALUE_TRUE)
@@ -32,6 +91,7 @@ typedef struct ObjectModule ObjectModule;
 #define IS_EMPTY(value) ((value).kind == VALUE_EMPTY)
 #define IS_FALSEY(value) (IS_NIL(value))
 #define IS_NUMBER(value) ((value).kind == VALUE_NUMBER)
+#define IS_OBJECT(value) ((value).kind == VALUE_OBJECT)
 #define IS_STRING(value) mesche_object_is_kind(value, ObjectKindString)
 
 typedef enum { VALUE_NIL, VALUE_TRUE, VALUE_EMPTY, VALUE_NUMBER, VALUE_OBJECT } ValueKind;
@@ -44,6 +104,8 @@ typedef struct {
   } as;
 } Value;
 
+#endif
+
 typedef struct {
   int capacity;
   int count;
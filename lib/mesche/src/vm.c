@@ -3,15 +3,20 @@
 #include <stdio.h>
 #include <time.h>
 
+#include "cache.h"
 #include "chunk.h"
 #include "compiler.h"
 #include "disasm.h"
 #include "fs.h"
+#include "gc.h"
+#include "jit.h"
 #include "list.h"
 #include "mem.h"
 #include "module.h"
 #include "object.h"
 #include "op.h"
+#include "opstats.h"
+#include "profile.h"
 #include "util.h"
 #include "value.h"
 #include "vm.h"
@@ -19,7 +24,51 @@
 // NOTE: Enable this for diagnostic purposes
 /* #define DEBUG_TRACE_EXECUTION */
 
+// Define MESCHE_USE_COMPUTED_GOTO to use threaded dispatch (GCC's
+// labels-as-values extension) instead of the switch-based loop.  It is off by
+// default because it has not measured faster than the switch on the bench
+// workloads.  Tracing needs the loop header to run before every instruction,
+// so it always uses the switch.
+#if defined(__GNUC__) && defined(MESCHE_USE_COMPUTED_GOTO) && !defined(DEBUG_TRACE_EXECUTION)
+#define MESCHE_COMPUTED_GOTO
+#endif
+
+static void vm_stack_grow(VM *vm, int min_capacity) {
+  int capacity = vm->stack_capacity;
+  while (capacity < min_capacity) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+
+  Value *stack = (Value *)malloc(sizeof(Value) * capacity);
+  if (stack == NULL) {
+    PANIC("VM's value stack could not be reallocated.");
+  }
+
+  // Move everything that points into the old stack over to the new one
+  memcpy(stack, vm->stack, sizeof(Value) * (vm->stack_top - vm->stack));
+  for (int i = 0; i < vm->frame_count; i++) {
+    vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+  }
+  for (ObjectUpvalue *upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm->stack);
+  }
+  vm->stack_top = stack + (vm->stack_top - vm->stack);
+
+  free(vm->stack);
+  vm->stack = stack;
+  vm->stack_capacity = capacity;
+}
+
 void mesche_vm_stack_push(VM *vm, Value value) {
+  if (vm->stack_top == vm->stack + vm->stack_capacity) {
+    // Pushes can't fail so there's nothing to unwind to past the limit
+    if (vm->stack_capacity >= STACK_MAX) {
+      PANIC("Stack overflow.\n");
+    }
+
+    vm_stack_grow(vm, vm->stack_capacity + 1);
+  }
+
   *vm->stack_top = value;
   vm->stack_top++;
 }
@@ -56,23 +105,105 @@ static void vm_runtime_error(VM *vm, const char *format, ...) {
   vm_reset_stack(vm);
 }
 
+static bool vm_stack_reserve(VM *vm, int count) {
+  // Make sure there is room for the slots of a new call frame before any
+  // pointers into the stack are taken for it
+  int needed = (int)(vm->stack_top - vm->stack) + count;
+  if (needed > vm->stack_capacity) {
+    if (needed > STACK_MAX) {
+      vm_runtime_error(vm, "Stack overflow.");
+      return false;
+    }
+
+    vm_stack_grow(vm, needed);
+  }
+
+  return true;
+}
+
+static inline Object *vm_cell_object(MeschePoolPage *page, int word, int bit) {
+  return (Object *)((char *)page + (word * 64 + bit) * MEM_POOL_GRANULE);
+}
+
+static void vm_free_large_cells(VM *vm, MescheLargeCell *cell) {
+  while (cell != NULL) {
+    MescheLargeCell *next = cell->next;
+    mesche_object_free(vm, (Object *)(cell + 1));
+    cell = next;
+  }
+}
+
 static void vm_free_objects(VM *vm) {
-  Object *object = vm->objects;
-  while (object != NULL) {
-    Object *next = object->next;
-    mesche_object_free(vm, object);
-    object = next;
+  for (int i = 0; i < MEM_POOL_CLASS_COUNT; i++) {
+    for (MeschePoolPage *page = vm->mem.pools[i].pages; page != NULL; page = page->next) {
+      for (int word = 0; word < MEM_POOL_BITMAP_WORDS; word++) {
+        uint64_t cells = page->cell_bits[word];
+        while (cells != 0) {
+          int bit = __builtin_ctzll(cells);
+          cells &= cells - 1;
+          mesche_object_free(vm, vm_cell_object(page, word, bit));
+        }
+      }
+    }
   }
 
+  vm_free_large_cells(vm, vm->mem.young_large_cells);
+  vm_free_large_cells(vm, vm->mem.large_cells);
+  vm_free_large_cells(vm, vm->sweep_large_cells);
+
   if (vm->gray_stack) {
     free(vm->gray_stack);
   }
+
+  if (vm->remembered) {
+    free(vm->remembered);
+  }
+}
+
+void mesche_mem_remember(VM *vm, Object *object) {
+  // Every young object gets promoted by a running major collection
+  if (object->is_remembered || vm->mem.gc_phase != MESCHE_GC_IDLE)
+    return;
+
+  // Resize the remembered set if necessary
+  if (vm->remembered_capacity < vm->remembered_count + 1) {
+    vm->remembered_capacity = GROW_CAPACITY(vm->remembered_capacity);
+    vm->remembered =
+        (Object **)realloc(vm->remembered, sizeof(Object *) * vm->remembered_capacity);
+
+    if (vm->remembered == NULL) {
+      PANIC("VM's remembered set could not be reallocated.");
+    }
+  }
+
+  object->is_remembered = true;
+  vm->remembered[vm->remembered_count++] = object;
+}
+
+static void mem_gray_push(VM *vm, Object *object) {
+  // Resize the gray stack if necessary (tracks visited objects)
+  if (vm->gray_capacity < vm->gray_count + 1) {
+    vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+    vm->gray_stack = (Object **)realloc(vm->gray_stack, sizeof(Object *) * vm->gray_capacity);
+
+    // Check if something went wrong with allocation
+    if (vm->gray_stack == NULL) {
+      PANIC("VM's gray stack could not be reallocated.");
+    }
+  }
+
+  // Add the object to the gray stack
+  vm->gray_stack[vm->gray_count++] = object;
 }
 
 void mesche_mem_mark_object(VM *vm, Object *object) {
   if (object == NULL)
     return;
-  if (object->is_marked)
+  if (mesche_object_is_marked(object))
+    return;
+
+  // Minor collections treat old objects as live and don't trace through them
+  if (vm->gc_is_minor && object->is_old)
     return;
 
 #ifdef DEBUG_LOG_GC
@@ -81,25 +212,21 @@ void mesche_mem_mark_object(VM *vm, Object *object) {
   printf("\n");
 #endif
 
-  object->is_marked = true;
+  mesche_mem_cell_mark(object, object->is_large);
 
   // Add the object to the gray stack if it has references to trace
   if (object->kind != ObjectKindString && object->kind != ObjectKindSymbol &&
       object->kind != ObjectKindKeyword && object->kind != ObjectKindNativeFunction &&
       object->kind != ObjectKindPointer) {
-    // Resize the gray stack if necessary (tracks visited objects)
-    if (vm->gray_capacity < vm->gray_count + 1) {
-      vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
-      vm->gray_stack = (Object **)realloc(vm->gray_stack, sizeof(Object *) * vm->gray_capacity);
-
-      // Check if something went wrong with allocation
-      if (vm->gray_stack == NULL) {
-        PANIC("VM's gray stack could not be reallocated.");
-      }
-    }
+    mem_gray_push(vm, object);
+  }
+}
 
-    // Add the object to the gray stack
-    vm->gray_stack[vm->gray_count++] = object;
+void mesche_mem_retrace(VM *vm, Object *object) {
+  // An object which was already traced by an unfinished collection has been
+  // changed, so it must be traced again to find its new references
+  if (mesche_object_is_marked(object)) {
+    mem_gray_push(vm, object);
   }
 }
 
@@ -108,6 +235,27 @@ static void mem_mark_value(VM *vm, Value value) {
     mesche_mem_mark_object(vm, AS_OBJECT(value));
 }
 
+void mesche_mem_mark_root(VM *vm, Object *object) {
+  // Roots may have been changed without a write barrier (objects under
+  // construction, the compiler's functions), so old roots are traced in
+  // minor collections too
+  if (object != NULL && vm->gc_is_minor && object->is_old) {
+    mesche_mem_remember(vm, object);
+  } else if (object != NULL && vm->gc_is_remark) {
+    // The same goes for roots which were traced earlier in an incremental
+    // collection
+    mesche_mem_cell_mark(object, object->is_large);
+    mem_gray_push(vm, object);
+  } else {
+    mesche_mem_mark_object(vm, object);
+  }
+}
+
+static void mem_mark_root_value(VM *vm, Value value) {
+  if (IS_OBJECT(value))
+    mesche_mem_mark_root(vm, AS_OBJECT(value));
+}
+
 static void mem_mark_array(VM *vm, ValueArray *array) {
   for (int i = 0; i < array->count; i++) {
     mem_mark_value(vm, array->values[i]);
@@ -130,15 +278,21 @@ static void mem_mark_module(VM *vm, struct ObjectModule *module) {
 static void mem_mark_roots(void *target) {
   VM *vm = (VM *)target;
   for (Value *slot = vm->stack; slot < vm->stack_top; slot++) {
-    mem_mark_value(vm, *slot);
+    mem_mark_root_value(vm, *slot);
   }
 
   for (int i = 0; i < vm->frame_count; i++) {
-    mesche_mem_mark_object(vm, (Object *)vm->frames[i].closure);
+    mesche_mem_mark_root(vm, (Object *)vm->frames[i].closure);
   }
 
   for (ObjectUpvalue *upvalue = vm->open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
-    mesche_mem_mark_object(vm, (Object *)upvalue);
+    mesche_mem_mark_root(vm, (Object *)upvalue);
+  }
+
+  mesche_mem_mark_object(vm, (Object *)vm->load_paths);
+
+  if (vm->profiler != NULL) {
+    mesche_profile_mark_roots(vm);
   }
 
   // Mark roots in every module
@@ -171,6 +325,17 @@ static void mem_darken_object(VM *vm, Object *object) {
     ObjectFunction *function = (ObjectFunction *)object;
     mesche_mem_mark_object(vm, (Object *)function->name);
     mem_mark_array(vm, &function->chunk.constants);
+    for (int i = 0; i < function->keyword_args.count; i++) {
+      mesche_mem_mark_object(vm, (Object *)function->keyword_args.args[i].name);
+    }
+
+    // Keep functions referenced by keyword call caches alive so that a cache
+    // can't match a new function allocated at the same address
+    if (function->chunk.keyword_caches != NULL) {
+      for (int i = 0; i < function->chunk.keyword_cache_count; i++) {
+        mesche_mem_mark_object(vm, (Object *)function->chunk.keyword_caches[i].function);
+      }
+    }
     break;
   }
   case ObjectKindUpvalue:
@@ -178,6 +343,13 @@ static void mem_darken_object(VM *vm, Object *object) {
     break;
   case ObjectKindModule:
     mem_mark_module(vm, ((ObjectModule *)object));
+    break;
+  case ObjectKindBinding: {
+    ObjectBinding *binding = (ObjectBinding *)object;
+    mem_mark_value(vm, binding->value);
+    mesche_mem_mark_object(vm, (Object *)binding->module);
+    break;
+  }
   default:
     break;
   }
@@ -194,186 +366,571 @@ static void mem_trace_references(MescheMemory *mem) {
   }
 }
 
-static void mem_table_remove_white(Table *table) {
+// Work done by a slice between checks of the clock
+#define GC_SLICE_CHECK_INTERVAL 64
+
+static inline bool mem_slice_expired(uint64_t deadline, int *work) {
+  if (deadline == 0 || ++(*work) % GC_SLICE_CHECK_INTERVAL != 0) {
+    return false;
+  }
+
+  return mesche_mem_time_us() >= deadline;
+}
+
+static bool mem_trace_references_slice(VM *vm, uint64_t deadline) {
+  int work = 0;
+  while (vm->gray_count > 0) {
+    Object *object = vm->gray_stack[--vm->gray_count];
+    mem_darken_object(vm, object);
+    if (mem_slice_expired(deadline, &work)) {
+      return vm->gray_count == 0;
+    }
+  }
+
+  return true;
+}
+
+static void mem_trace_remembered(VM *vm) {
+  // Old objects in the remembered set are the only way to reach young
+  // objects from the old generation.  Darken them without marking so that
+  // their young references get traced.
+  for (int i = 0; i < vm->remembered_count; i++) {
+    mem_darken_object(vm, vm->remembered[i]);
+    mem_trace_references((MescheMemory *)vm);
+  }
+}
+
+static void mem_remembered_clear(VM *vm) {
+  // Every young object which survived was promoted, so the old generation
+  // doesn't point at any young objects anymore
+  for (int i = 0; i < vm->remembered_count; i++) {
+    vm->remembered[i]->is_remembered = false;
+  }
+
+  vm->remembered_count = 0;
+}
+
+static inline bool mem_object_is_live(VM *vm, Object *object) {
+  return mesche_object_is_marked(object) || (vm->gc_is_minor && object->is_old);
+}
+
+static void mem_table_remove_white(VM *vm, Table *table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->object.is_marked) {
+    if (entry->key != NULL && !mem_object_is_live(vm, (Object *)entry->key)) {
       mesche_table_delete(table, entry->key);
     }
   }
 }
 
-static void mem_sweep_objects(VM *vm) {
-  Object *previous = NULL;
-  Object *object = vm->objects;
+static inline bool mem_cell_bit_is_set(uint64_t bits, int bit) {
+  return (bits >> bit) & 1;
+}
 
-  // Walk through the object linked list
-  while (object != NULL) {
-    // If the object is marked, move to the next object, retaining
-    // a pointer this one so that the next live object can be linked
-    // to it
-    if (object->is_marked) {
-      object->is_marked = false; // Seeya next time...
-      previous = object;
-      object = object->next;
+static inline void mem_sweep_object(VM *vm, Object *object) {
+  vm->mem.gc_stats.cycle.objects_swept[object->kind]++;
+  mesche_object_free(vm, object);
+}
+
+static void mem_sweep_young_pages(VM *vm) {
+  MescheMemory *mem = (MescheMemory *)vm;
+
+  // Only the pages which received new cells since the last minor collection
+  // can hold young objects
+  for (MeschePoolPage *page = mem->young_pages; page != NULL; page = page->next_young) {
+    for (int word = 0; word < MEM_POOL_BITMAP_WORDS; word++) {
+      uint64_t cells = page->cell_bits[word];
+      uint64_t marks = page->mark_bits[word];
+      while (cells != 0) {
+        int bit = __builtin_ctzll(cells);
+        cells &= cells - 1;
+
+        // Move surviving young objects over to the old generation
+        Object *object = vm_cell_object(page, word, bit);
+        if (mem_cell_bit_is_set(marks, bit)) {
+          object->is_old = true;
+        } else if (!object->is_old) {
+          mem_sweep_object(vm, object);
+        }
+      }
+    }
+
+    memset(page->mark_bits, 0, sizeof(page->mark_bits));
+    page->has_young_cells = false;
+  }
+
+  mem->young_pages = NULL;
+
+  while (mem->young_large_cells != NULL) {
+    MescheLargeCell *cell = mem->young_large_cells;
+    mem->young_large_cells = cell->next;
+    if (cell->is_marked) {
+      cell->is_marked = false;
+      ((Object *)(cell + 1))->is_old = true;
+      cell->next = mem->large_cells;
+      mem->large_cells = cell;
     } else {
-      // If the object is unmarked, remove it from the linked list
-      // and free it
-      Object *unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm->objects = object;
+      mem_sweep_object(vm, (Object *)(cell + 1));
+    }
+  }
+}
+
+static void mem_promote_young_survivors(VM *vm) {
+  MescheMemory *mem = (MescheMemory *)vm;
+
+  // Every young object which survives a major collection becomes old, the
+  // rest will be freed when their page gets swept
+  for (MeschePoolPage *page = mem->young_pages; page != NULL; page = page->next_young) {
+    for (int word = 0; word < MEM_POOL_BITMAP_WORDS; word++) {
+      uint64_t survivors = page->cell_bits[word] & page->mark_bits[word];
+      while (survivors != 0) {
+        int bit = __builtin_ctzll(survivors);
+        survivors &= survivors - 1;
+        vm_cell_object(page, word, bit)->is_old = true;
       }
+    }
+
+    page->has_young_cells = false;
+  }
 
-      mesche_object_free(vm, unreached);
+  mem->young_pages = NULL;
+
+  while (mem->young_large_cells != NULL) {
+    MescheLargeCell *cell = mem->young_large_cells;
+    mem->young_large_cells = cell->next;
+    ((Object *)(cell + 1))->is_old = true;
+    cell->next = mem->large_cells;
+    mem->large_cells = cell;
+  }
+}
+
+static void mem_sweep_page(VM *vm, MeschePoolPage *page) {
+  // Free every cell which didn't get marked, the survivors are left alone
+  for (int word = 0; word < MEM_POOL_BITMAP_WORDS; word++) {
+    uint64_t unreached = page->cell_bits[word] & ~page->mark_bits[word];
+    while (unreached != 0) {
+      int bit = __builtin_ctzll(unreached);
+      unreached &= unreached - 1;
+      mem_sweep_object(vm, vm_cell_object(page, word, bit));
     }
   }
+
+  memset(page->mark_bits, 0, sizeof(page->mark_bits));
+  page->swept_epoch = vm->mem.gc_epoch;
 }
 
-static void mem_collect_garbage(MescheMemory *mem) {
-  VM *vm = (VM *)mem;
+static bool mem_sweep_slice(VM *vm, uint64_t deadline) {
+  MescheMemory *mem = (MescheMemory *)vm;
+
+  // Walk the pages of each pool, skipping the ones which were added after
+  // the sweep started
+  while (vm->sweep_pool < MEM_POOL_CLASS_COUNT) {
+    MeschePoolPage *page = vm->sweep_page;
+    if (page == NULL) {
+      vm->sweep_pool++;
+      if (vm->sweep_pool < MEM_POOL_CLASS_COUNT) {
+        vm->sweep_page = mem->pools[vm->sweep_pool].pages;
+      }
+      continue;
+    }
+
+    vm->sweep_page = page->next;
+    if (page->swept_epoch != mem->gc_epoch) {
+      mem_sweep_page(vm, page);
+      if (deadline != 0 && mesche_mem_time_us() >= deadline) {
+        return false;
+      }
+    }
+  }
+
+  int work = 0;
+  while (vm->sweep_large_cells != NULL) {
+    MescheLargeCell *cell = vm->sweep_large_cells;
+    vm->sweep_large_cells = cell->next;
+    if (cell->is_marked) {
+      cell->is_marked = false;
+      cell->next = mem->large_cells;
+      mem->large_cells = cell;
+    } else {
+      mem_sweep_object(vm, (Object *)(cell + 1));
+    }
+
+    if (mem_slice_expired(deadline, &work)) {
+      return vm->sweep_large_cells == NULL;
+    }
+  }
+
+  return true;
+}
+
+static void mem_mark_all_roots(VM *vm) {
   mem_mark_roots(vm);
   if (vm->current_compiler != NULL) {
     mesche_compiler_mark_roots(vm->current_compiler);
   }
+}
+
+static void mem_collect_minor(VM *vm) {
+  // A minor collection only traces and sweeps the young generation
+  vm->gc_is_minor = true;
+  mem_mark_all_roots(vm);
+  mem_trace_references((MescheMemory *)vm);
+  mem_trace_remembered(vm);
+
+  mem_table_remove_white(vm, &vm->strings);
+  mem_table_remove_white(vm, &vm->symbols);
+  mem_table_remove_white(vm, &vm->keywords);
+  mem_sweep_young_pages(vm);
+  mem_remembered_clear(vm);
+  vm->gc_is_minor = false;
+
+  mesche_mem_pools_sweep((MescheMemory *)vm);
+}
+
+static void mem_collect_major_finish_mark(VM *vm) {
+  // The stack and other roots aren't covered by write barriers, so they get
+  // traced again before marking can finish.  This is the only part of a
+  // major collection which can't be split up.
+  vm->gc_is_remark = true;
+  mem_mark_all_roots(vm);
+  vm->gc_is_remark = false;
   mem_trace_references((MescheMemory *)vm);
-  mem_table_remove_white(&vm->strings);
-  mem_table_remove_white(&vm->symbols);
-  mem_sweep_objects(vm);
+
+  mem_table_remove_white(vm, &vm->strings);
+  mem_table_remove_white(vm, &vm->symbols);
+  mem_table_remove_white(vm, &vm->keywords);
+
+  // Start a new sweep epoch so that pages added while sweeping are skipped
+  // and detach the large cells for the same reason
+  mem_promote_young_survivors(vm);
+  vm->sweep_large_cells = vm->mem.large_cells;
+  vm->mem.large_cells = NULL;
+  vm->mem.gc_epoch++;
+  vm->sweep_pool = 0;
+  vm->sweep_page = vm->mem.pools[0].pages;
+  vm->mem.gc_phase = MESCHE_GC_SWEEP;
+}
+
+static void mem_collect_garbage(MescheMemory *mem, bool is_major, long budget_us) {
+  VM *vm = (VM *)mem;
+
+  if (!is_major) {
+    mem_collect_minor(vm);
+    return;
+  }
+
+  uint64_t deadline = budget_us > 0 ? mesche_mem_time_us() + budget_us : 0;
+  if (mem->gc_phase == MESCHE_GC_IDLE) {
+    // Objects allocated while the collection is running go straight into
+    // the old generation (see object_allocate) and every survivor gets
+    // promoted, so the remembered set isn't needed until it's finished
+    mem_remembered_clear(vm);
+    mem_mark_all_roots(vm);
+    mem->gc_phase = MESCHE_GC_MARK;
+  }
+
+  if (mem->gc_phase == MESCHE_GC_MARK) {
+    if (!mem_trace_references_slice(vm, deadline)) {
+      return;
+    }
+
+    mem_collect_major_finish_mark(vm);
+  }
+
+  if (!mem_sweep_slice(vm, deadline)) {
+    return;
+  }
+
+  mem->gc_phase = MESCHE_GC_IDLE;
+
+  mesche_mem_pools_sweep(mem);
 }
 
 void mesche_vm_init(VM *vm) {
   // initialize the memory manager
   mesche_mem_init(&vm->mem, mem_collect_garbage);
 
-  vm->objects = NULL;
+  vm->sweep_pool = 0;
+  vm->sweep_page = NULL;
+  vm->sweep_large_cells = NULL;
   vm->current_compiler = NULL;
+  vm->load_paths = NULL;
+  vm->use_register_ops = false;
+
+  // Initialize the gray stack and remembered set
+  vm->gray_count = 0;
+  vm->gray_capacity = 0;
+  vm->gray_stack = NULL;
+  vm->gc_is_minor = false;
+  vm->gc_is_remark = false;
+  vm->profiler = NULL;
+#ifdef MESCHE_OPCODE_STATS
+  mesche_opstats_init(vm);
+#endif
+#ifdef MESCHE_JIT
+  mesche_jit_init(vm);
+#endif
+  vm->remembered_count = 0;
+  vm->remembered_capacity = 0;
+  vm->remembered = NULL;
+
+  // Initialize the value stack and call frames
+  vm->stack = (Value *)malloc(sizeof(Value) * STACK_INITIAL);
+  vm->stack_capacity = STACK_INITIAL;
+  vm->frames = (CallFrame *)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+  vm->frame_capacity = FRAMES_INITIAL;
+  if (vm->stack == NULL || vm->frames == NULL) {
+    PANIC("VM's stack could not be allocated.");
+  }
   vm_reset_stack(vm);
   mesche_table_init(&vm->strings);
   mesche_table_init(&vm->symbols);
+  mesche_table_init(&vm->keywords);
 
   // Initialize the module table root module
   mesche_table_init(&vm->modules);
   ObjectString *module_name = mesche_object_make_string(vm, "mesche-user", 11);
+  mesche_vm_stack_push(vm, OBJECT_VAL(module_name));
   vm->root_module = mesche_object_make_module(vm, module_name);
   vm->current_module = vm->root_module;
-  vm->load_paths = NULL;
+  mesche_vm_stack_push(vm, OBJECT_VAL(vm->root_module));
   mesche_table_set((MescheMemory *)vm, &vm->modules, vm->root_module->name,
                    OBJECT_VAL(vm->root_module));
+  mesche_vm_stack_pop(vm);
+  mesche_vm_stack_pop(vm);
 
-  // Initialize the gray stack
-  vm->gray_count = 0;
-  vm->gray_capacity = 0;
-  vm->gray_stack = NULL;
+  // Register the modules which are implemented natively
+  mesche_gc_module_init(vm);
+  mesche_profile_module_init(vm);
 }
 
 void mesche_vm_free(VM *vm) {
+  mesche_profile_free(vm);
   mesche_table_free((MescheMemory *)vm, &vm->strings);
   mesche_table_free((MescheMemory *)vm, &vm->symbols);
+  mesche_table_free((MescheMemory *)vm, &vm->keywords);
   mesche_table_free((MescheMemory *)vm, &vm->modules);
   vm_reset_stack(vm);
   vm_free_objects(vm);
+
+#ifdef MESCHE_OPCODE_STATS
+  // Freeing the objects folded their counts into the statistics
+  const char *stats_path = getenv("MESCHE_OPCODE_STATS_PATH");
+  stats_path = stats_path != NULL ? stats_path : OPSTATS_DEFAULT_PATH;
+  if (mesche_opstats_write(vm, stats_path)) {
+    printf("-- Opcode statistics written to %s\n", stats_path);
+  } else {
+    fprintf(stderr, "Could not write opcode statistics to %s\n", stats_path);
+  }
+  mesche_opstats_free(vm);
+#endif
+  mesche_mem_free(&vm->mem);
+
+  free(vm->stack);
+  free(vm->frames);
 }
 
-static bool vm_call(VM *vm, ObjectClosure *closure, uint8_t arg_count) {
-  // Need to factor in:
-  // - Required argument count (arity)
-  // - Number of keywords (check the value stack to match them)
-  Value *arg_start = vm->stack_top - arg_count;
-  if (closure->function->keyword_args.count > 0) {
-    // This is 15 keyword arguments and their values
-    Value stored_keyword_args[30];
-
-    // Find keyword arguments and copy them to temporary storage
-    int start_index = 0;
-    Value *keyword_start = NULL;
-    Value *keyword_current = arg_start;
-    for (int i = 0; i < arg_count; i++) {
-      if (keyword_start == NULL && IS_KEYWORD(*keyword_current)) {
-        keyword_start = keyword_current;
-        start_index = i;
-      }
-
-      if (keyword_start != NULL) {
-        // Copy the value to temporary storage
-        // TODO: Error if we've reached the storage max
-        stored_keyword_args[i - start_index] = *keyword_current;
-      }
-
-      keyword_current++;
-    }
-
-    // Reset the top of the stack to the location of the first keyword argument
-    vm->stack_top = keyword_start;
-
-    // Now that we know where keywords start in the value stack, push the
-    // keyword default values on so that they line up with the local variables
-    // we've defined
-    KeywordArgument *keyword_arg = closure->function->keyword_args.args;
-    for (int i = 0; i < closure->function->keyword_args.count; i++) {
-      // Check if the passed keyword args match this keyword
-      bool found_match = false;
-      for (int j = 0; j < arg_count - start_index; j += 2) {
-        if (mesche_object_string_equalsp((Object *)keyword_arg->name,
-                                         (Object *)AS_KEYWORD(stored_keyword_args[j]))) {
-          // Put the value on the stack
-          mesche_vm_stack_push(vm, stored_keyword_args[j + 1]);
-          found_match = true;
-        }
+// Marks a keyword parameter which wasn't passed by the caller
+#define KEYWORD_ARG_NOT_PASSED UINT8_MAX
+
+static void vm_keyword_args_match(ObjectFunction *function, Value *keyword_start, int pair_count,
+                                  uint8_t *matches) {
+  // Find the first passed keyword argument which names each keyword parameter.
+  // Keywords are interned so they can be compared by identity.
+  for (int i = 0; i < function->keyword_args.count; i++) {
+    matches[i] = KEYWORD_ARG_NOT_PASSED;
+    for (int j = 0; j < pair_count; j++) {
+      if (IS_KEYWORD(keyword_start[j * 2]) &&
+          AS_KEYWORD(keyword_start[j * 2]) == function->keyword_args.args[i].name) {
+        matches[i] = j;
+        break;
       }
+    }
+  }
+}
 
-      // Skip to the next keyword if the previous had a match
-      if (found_match) {
-        keyword_arg++;
-        continue;
-      }
+static void vm_keyword_args_apply(VM *vm, ObjectFunction *function, Value *keyword_start,
+                                  int pair_count, uint8_t *matches) {
+  // Set the passed values aside since the parameter values are written over
+  // the keyword argument pairs.  Argument counts fit in a byte so there can't
+  // be more pairs than this.
+  Value passed_values[UINT8_COUNT / 2];
+  for (int i = 0; i < pair_count; i++) {
+    passed_values[i] = keyword_start[i * 2 + 1];
+  }
 
+  // Push a value for each keyword parameter so that they line up with the
+  // local variables the function defined for them
+  vm->stack_top = keyword_start;
+  KeywordArgument *keyword_arg = function->keyword_args.args;
+  for (int i = 0; i < function->keyword_args.count; i++) {
+    if (matches[i] != KEYWORD_ARG_NOT_PASSED) {
+      mesche_vm_stack_push(vm, passed_values[matches[i]]);
+    } else if (keyword_arg->default_index > 0) {
       // Apply default value of keyword argument
-      if (keyword_arg->default_index > 0) {
-        mesche_vm_stack_push(
-            vm, closure->function->chunk.constants.values[keyword_arg->default_index - 1]);
-      } else {
-        // If no default value was provided, choose `nil`
-        mesche_vm_stack_push(vm, NIL_VAL);
-      }
-
-      keyword_arg++;
+      mesche_vm_stack_push(vm, function->chunk.constants.values[keyword_arg->default_index - 1]);
+    } else {
+      // If no default value was provided, choose `nil`
+      mesche_vm_stack_push(vm, NIL_VAL);
     }
-  } else {
-    if (arg_count != closure->function->arity) {
-      vm_runtime_error(vm, "Expected %d arguments but got %d.", closure->function->arity,
-                       arg_count);
+
+    keyword_arg++;
+  }
+}
+
+static bool vm_call_frame(VM *vm, ObjectClosure *closure, Value *arg_start) {
+  if (vm->frame_count == vm->frame_capacity) {
+    if (vm->frame_count == FRAMES_MAX) {
+      vm_runtime_error(vm, "Stack overflow.");
       return false;
     }
+
+    // The old frames stay valid until the new ones are in place because the
+    // profiler's signal handler can read them at any point
+    int capacity = GROW_CAPACITY(vm->frame_capacity);
+    CallFrame *frames = (CallFrame *)malloc(sizeof(CallFrame) * capacity);
+    if (frames == NULL) {
+      PANIC("VM's call frames could not be reallocated.");
+    }
+
+    memcpy(frames, vm->frames, sizeof(CallFrame) * vm->frame_count);
+    CallFrame *old_frames = vm->frames;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    vm->frames = frames;
+    vm->frame_capacity = capacity;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    free(old_frames);
   }
 
-  CallFrame *frame = &vm->frames[vm->frame_count++];
+  // Fill in the frame before it's counted for the same reason
+  CallFrame *frame = &vm->frames[vm->frame_count];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = arg_start - 1;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  vm->frame_count++;
+
+#ifdef MESCHE_OPCODE_STATS
+  closure->function->call_count++;
+  vm->opstats->closure_calls++;
+#endif
+#ifdef MESCHE_JIT
+  // Compile the function the first time it gets hot
+  ObjectFunction *function = closure->function;
+  if (function->jit_call_count < vm->jit_threshold &&
+      ++function->jit_call_count == vm->jit_threshold) {
+    mesche_jit_compile(vm, function);
+  }
+#endif
+  return true;
+}
+
+static bool vm_call(VM *vm, ObjectClosure *closure, uint8_t arg_count) {
+  if (!vm_stack_reserve(vm, UINT8_COUNT)) {
+    return false;
+  }
+
+  Value *arg_start = vm->stack_top - arg_count;
+  ObjectFunction *function = closure->function;
+  if (function->keyword_args.count > 0) {
+    // Keyword arguments start at the first keyword value that was passed
+    Value *keyword_start = arg_start;
+    while (keyword_start < vm->stack_top && !IS_KEYWORD(*keyword_start)) {
+      keyword_start++;
+    }
+
+    if (keyword_start - arg_start != function->arity) {
+      vm_runtime_error(vm, "Expected %d arguments but got %d.", function->arity,
+                       (int)(keyword_start - arg_start));
+      return false;
+    }
+
+    uint8_t matches[UINT8_COUNT];
+    int pair_count = (vm->stack_top - keyword_start) / 2;
+    vm_keyword_args_match(function, keyword_start, pair_count, matches);
+    vm_keyword_args_apply(vm, function, keyword_start, pair_count, matches);
+  } else {
+    if (arg_count != function->arity) {
+      vm_runtime_error(vm, "Expected %d arguments but got %d.", function->arity, arg_count);
+      return false;
+    }
+  }
+
+  return vm_call_frame(vm, closure, arg_start);
+}
+
+static bool vm_call_keywords(VM *vm, ObjectClosure *closure, uint8_t arg_count,
+                             uint8_t keyword_count, KeywordCallCache *cache) {
+  if (!vm_stack_reserve(vm, UINT8_COUNT)) {
+    return false;
+  }
+
+  Value *arg_start = vm->stack_top - arg_count;
+  Value *keyword_start = vm->stack_top - keyword_count * 2;
+  ObjectFunction *function = closure->function;
+  if (function->keyword_args.count == 0 || keyword_start - arg_start != function->arity) {
+    // Let the general path report the argument mismatch
+    return vm_call(vm, closure, arg_count);
+  }
+
+  // The keywords passed from a call site never change, so the matches only
+  // need to be found again when a different function is called from it
+  if (cache->function != function) {
+    if (function->keyword_args.count > KEYWORD_CACHE_MAX) {
+      uint8_t matches[UINT8_COUNT];
+      vm_keyword_args_match(function, keyword_start, keyword_count, matches);
+      vm_keyword_args_apply(vm, function, keyword_start, keyword_count, matches);
+      return vm_call_frame(vm, closure, arg_start);
+    }
+
+    // The calling frame's function owns the call site's cache
+    vm_keyword_args_match(function, keyword_start, keyword_count, cache->matches);
+    cache->function = function;
+    mesche_object_write_barrier(vm, (Object *)vm->frames[vm->frame_count - 1].closure->function,
+                                OBJECT_VAL(function));
+  }
+
+  vm_keyword_args_apply(vm, function, keyword_start, keyword_count, cache->matches);
+  return vm_call_frame(vm, closure, arg_start);
+}
+
+static inline bool vm_call_native(VM *vm, ObjectNativeFunction *native, uint8_t arg_count) {
+#ifdef MESCHE_OPCODE_STATS
+  native->call_count++;
+  vm->opstats->native_calls++;
+#endif
+  // Natives hold a pointer to their arguments so the stack can't be allowed
+  // to move while they push values of their own
+  if (!vm_stack_reserve(vm, UINT8_COUNT)) {
+    return false;
+  }
+
+  Value result = native->function((MescheMemory *)vm, arg_count, vm->stack_top - arg_count);
+
+  // Pop off all of the argument and the function itself and push the result
+  vm->stack_top -= arg_count + 1;
+  mesche_vm_stack_push(vm, result);
   return true;
 }
 
+// Whether a closure can be called without matching keyword arguments or
+// checking how many arguments were passed
+static inline bool vm_call_is_exact(Value callee, uint8_t arg_count) {
+  if (!IS_CLOSURE(callee)) {
+    return false;
+  }
+
+  ObjectFunction *function = AS_CLOSURE(callee)->function;
+  return function->arity == arg_count && function->keyword_args.count == 0;
+}
+
 static bool vm_call_value(VM *vm, Value callee, uint8_t arg_count) {
   if (IS_OBJECT(callee)) {
     switch (OBJECT_KIND(callee)) {
     case ObjectKindClosure:
       return vm_call(vm, AS_CLOSURE(callee), arg_count);
-    case ObjectKindNativeFunction: {
-      FunctionPtr func_ptr = AS_NATIVE_FUNC(callee);
-      Value result = func_ptr((MescheMemory *)vm, arg_count, vm->stack_top - arg_count);
-
-      // Pop off all of the argument and the function itself
-      for (int i = 0; i < arg_count + 1; i++) {
-        mesche_vm_stack_pop(vm);
-      }
-
-      // Push the result to store it
-      mesche_vm_stack_push(vm, result);
-      return true;
-    }
+    case ObjectKindNativeFunction:
+      return vm_call_native(vm, (ObjectNativeFunction *)AS_OBJECT(callee), arg_count);
     default:
       break; // Value not callable
     }
@@ -384,6 +941,24 @@ static bool vm_call_value(VM *vm, Value callee, uint8_t arg_count) {
   return false;
 }
 
+static void vm_close_upvalues(VM *vm, Value *stack_slot);
+
+static void vm_frame_collapse(VM *vm) {
+  // Replace the calling frame with the frame that was just pushed for a tail
+  // call by sliding the callee and its arguments down into the caller's slots
+  CallFrame *caller = &vm->frames[vm->frame_count - 2];
+  CallFrame *callee = &vm->frames[vm->frame_count - 1];
+  vm_close_upvalues(vm, caller->slots);
+
+  int slot_count = vm->stack_top - callee->slots;
+  memmove(caller->slots, callee->slots, sizeof(Value) * slot_count);
+  vm->stack_top = caller->slots + slot_count;
+
+  caller->closure = callee->closure;
+  caller->ip = callee->ip;
+  vm->frame_count--;
+}
+
 static ObjectUpvalue *vm_capture_upvalue(VM *vm, Value *local) {
   ObjectUpvalue *prev_upvalue = NULL;
   ObjectUpvalue *upvalue = vm->open_upvalues;
@@ -429,32 +1004,250 @@ static void vm_close_upvalues(VM *vm, Value *stack_slot) {
     ObjectUpvalue *upvalue = vm->open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    mesche_object_write_barrier(vm, (Object *)upvalue, upvalue->closed);
     vm->open_upvalues = upvalue->next;
   }
 }
 
+void mesche_vm_loop_store(VM *vm, Value *loop_slots, int count) {
+  // Closures made in the previous pass through the loop keep the values they
+  // captured, the next pass gets fresh bindings
+  vm_close_upvalues(vm, loop_slots);
+
+  Value *values = vm->stack_top - count;
+  for (int i = 0; i < count; i++) {
+    loop_slots[i] = values[i];
+  }
+
+  // Locals and temporaries from the loop's body are discarded
+  vm->stack_top = loop_slots + count;
+}
+
+#ifdef MESCHE_JIT
+bool mesche_vm_jit_call(VM *vm, ObjectClosure *closure, uint8_t arg_count) {
+  // Native code holds on to its frame while the callee runs, so calls which
+  // would move the frames or the stack are left to the interpreter
+  if (vm->frame_count == vm->frame_capacity ||
+      vm->stack_top - vm->stack + UINT8_COUNT > vm->stack_capacity) {
+    return false;
+  }
+
+  return vm_call_frame(vm, closure, vm->stack_top - arg_count);
+}
+
+void mesche_vm_jit_return(VM *vm) {
+  // Does the same as OP_RETURN for a function returning to another function
+  CallFrame *frame = &vm->frames[vm->frame_count - 1];
+  Value value = *--vm->stack_top;
+  vm->frame_count--;
+  vm_close_upvalues(vm, frame->slots);
+  vm->stack_top = frame->slots;
+  *vm->stack_top++ = value;
+}
+#endif
+
+static GlobalCache *vm_global_cache_resolve(VM *vm, CallFrame *frame, uint8_t constant) {
+  Table *globals =
+      frame->closure->module ? &frame->closure->module->locals : &vm->current_module->locals;
+  Chunk *chunk = &frame->closure->function->chunk;
+  GlobalCache *cache = &chunk->global_caches[constant];
+
+  // The cached entry is only valid while the table hasn't changed shape
+  if (cache->table == globals && cache->version == globals->version) {
+    return cache;
+  }
+
+  ObjectString *name = AS_STRING(chunk->constants.values[constant]);
+  Value binding;
+  if (!mesche_table_get(globals, name, &binding)) {
+    vm_runtime_error(vm, "Undefined variable '%s'.", name->chars);
+    return NULL;
+  }
+
+  cache->table = globals;
+  cache->version = globals->version;
+  cache->binding = AS_BINDING(binding);
+
+  return cache;
+}
+
 InterpretResult mesche_vm_run(VM *vm) {
   CallFrame *frame = &vm->frames[vm->frame_count - 1];
   ObjectModule *prev_module = NULL;
+  ObjectModule *import_module = NULL;
+
+  // Scratch variables shared between instructions.  These are declared once
+  // here rather than on every pass through the dispatch loop.
+  Value value;
+  ObjectString *name;
+  uint16_t offset;
+  uint8_t slot;
+  uint8_t arg_count;
 
 #define READ_BYTE() (*frame->ip++)
+#ifdef MESCHE_OPCODE_STATS
+#define READ_OPCODE() mesche_opstats_count(vm->opstats, frame->closure->function, READ_BYTE())
+#else
+#define READ_OPCODE() READ_BYTE()
+#endif
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
-// TODO: Don't pop 'a', manipulate top of stack
+// Replaces the two operands on top of the stack with the result in place
 #define BINARY_OP(value_type, pred, cast, op)                                                      \
   do {                                                                                             \
-    if (!pred(vm_stack_peek(vm, 0)) || !pred(vm_stack_peek(vm, 1))) {                              \
+    Value *a = &vm->stack_top[-2];                                                                 \
+    Value b = vm->stack_top[-1];                                                                   \
+    if (!pred(b) || !pred(*a)) {                                                                   \
+      vm_runtime_error(vm, "Operands must be numbers.");                                           \
+      return INTERPRET_RUNTIME_ERROR;                                                              \
+    }                                                                                              \
+    *a = value_type(cast(*a) op cast(b));                                                          \
+    vm->stack_top--;                                                                               \
+  } while (false)
+
+// Applies an arithmetic operator to a local and a constant
+#define LOCAL_CONSTANT_OP(op)                                                                      \
+  do {                                                                                             \
+    Value a = frame->slots[READ_BYTE()];                                                           \
+    Value b = READ_CONSTANT();                                                                     \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                                          \
       vm_runtime_error(vm, "Operands must be numbers.");                                           \
       return INTERPRET_RUNTIME_ERROR;                                                              \
     }                                                                                              \
-    double b = cast(mesche_vm_stack_pop(vm));                                                      \
-    double a = cast(mesche_vm_stack_pop(vm));                                                      \
-    mesche_vm_stack_push(vm, value_type(a op b));                                                  \
+    mesche_vm_stack_push(vm, NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)));                            \
   } while (false)
 
+// Reads a register operand, a local slot or a constant depending on the
+// instruction's mode byte
+#define READ_REG(mode, constant_bit)                                                               \
+  ((mode) & (constant_bit) ? READ_CONSTANT() : frame->slots[READ_BYTE()])
+
+// Applies an arithmetic operator to two register operands
+#define REG_OP(op)                                                                                 \
+  do {                                                                                             \
+    uint8_t mode = READ_BYTE();                                                                    \
+    Value a = READ_REG(mode, OP_REG_A_CONSTANT);                                                   \
+    Value b = READ_REG(mode, OP_REG_B_CONSTANT);                                                   \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                                          \
+      vm_runtime_error(vm, "Operands must be numbers.");                                           \
+      return INTERPRET_RUNTIME_ERROR;                                                              \
+    }                                                                                              \
+    mesche_vm_stack_push(vm, NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)));                            \
+  } while (false)
+
+// Applies an arithmetic operator to the two numbers on top of the stack,
+// returning to the generic instruction when either isn't a number
+#define NUMBER_OP(generic, op)                                                                     \
+  if (!IS_NUMBER(vm->stack_top[-1]) || !IS_NUMBER(vm->stack_top[-2])) {                            \
+    VM_DEQUICKEN(generic, 1);                                                                      \
+  }                                                                                                \
+  vm->stack_top[-2] = NUMBER_VAL(AS_NUMBER(vm->stack_top[-2]) op AS_NUMBER(vm->stack_top[-1]));    \
+  vm->stack_top--;
+
+// Rewrites the instruction that was just read back to its generic form and
+// runs that instead
+#define VM_DEQUICKEN(generic, length)                                                              \
+  frame->ip -= (length);                                                                           \
+  *frame->ip = (generic);                                                                          \
+  VM_NEXT();
+
+// Rewrites the instruction that was just read to a specialized form once it
+// has run
+#define VM_QUICKEN(quick, length) frame->ip[-(length)] = (quick)
+
+// Runs the frame's native code from its current instruction if the function
+// has been compiled.  Native code can call and return, so it may leave a
+// different frame on top.
+#ifdef MESCHE_JIT
+#define VM_JIT_ENTER()                                                                             \
+  if (frame->closure->function->jit != NULL) {                                                     \
+    mesche_jit_enter(vm, frame);                                                                   \
+    frame = &vm->frames[vm->frame_count - 1];                                                      \
+  }
+#else
+#define VM_JIT_ENTER()
+#endif
+
+#ifdef MESCHE_COMPUTED_GOTO
+  // Each entry is the address of the label which implements the opcode
+  static void *dispatch_table[] = {
+      [OP_CONSTANT] = &&op_OP_CONSTANT,
+      [OP_NIL] = &&op_OP_NIL,
+      [OP_T] = &&op_OP_T,
+      [OP_POP] = &&op_OP_POP,
+      [OP_POP_SCOPE] = &&op_OP_POP_SCOPE,
+      [OP_CONS] = &&op_OP_CONS,
+      [OP_LIST] = &&op_OP_LIST,
+      [OP_ADD] = &&op_OP_ADD,
+      [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+      [OP_DIVIDE] = &&op_OP_DIVIDE,
+      [OP_NEGATE] = &&op_unknown,
+      [OP_AND] = &&op_OP_AND,
+      [OP_OR] = &&op_OP_OR,
+      [OP_NOT] = &&op_OP_NOT,
+      [OP_EQV] = &&op_OP_EQV,
+      [OP_EQUAL] = &&op_OP_EQUAL,
+      [OP_DEFINE_MODULE] = &&op_OP_DEFINE_MODULE,
+      [OP_IMPORT_MODULE] = &&op_OP_IMPORT_MODULE,
+      [OP_ENTER_MODULE] = &&op_OP_ENTER_MODULE,
+      [OP_EXPORT_SYMBOL] = &&op_OP_EXPORT_SYMBOL,
+      [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+      [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+      [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+      [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+      [OP_READ_GLOBAL] = &&op_OP_READ_GLOBAL,
+      [OP_READ_UPVALUE] = &&op_OP_READ_UPVALUE,
+      [OP_READ_LOCAL] = &&op_OP_READ_LOCAL,
+      [OP_JUMP] = &&op_OP_JUMP,
+      [OP_LOOP] = &&op_OP_LOOP,
+      [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+      [OP_CALL] = &&op_OP_CALL,
+      [OP_CALL_KEYWORDS] = &&op_OP_CALL_KEYWORDS,
+      [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+      [OP_TAIL_CALL_KEYWORDS] = &&op_OP_TAIL_CALL_KEYWORDS,
+      [OP_CLOSURE] = &&op_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+      [OP_DISPLAY] = &&op_OP_DISPLAY,
+      [OP_RETURN] = &&op_OP_RETURN,
+      [OP_ADD_LOCAL_CONSTANT] = &&op_OP_ADD_LOCAL_CONSTANT,
+      [OP_SUBTRACT_LOCAL_CONSTANT] = &&op_OP_SUBTRACT_LOCAL_CONSTANT,
+      [OP_EQV_LOCAL_CONSTANT] = &&op_OP_EQV_LOCAL_CONSTANT,
+      [OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+      [OP_EQV_JUMP_IF_FALSE] = &&op_OP_EQV_JUMP_IF_FALSE,
+      [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+      [OP_SUBTRACT_NUM] = &&op_OP_SUBTRACT_NUM,
+      [OP_MULTIPLY_NUM] = &&op_OP_MULTIPLY_NUM,
+      [OP_DIVIDE_NUM] = &&op_OP_DIVIDE_NUM,
+      [OP_CALL_CLOSURE_EXACT_ARITY] = &&op_OP_CALL_CLOSURE_EXACT_ARITY,
+      [OP_CALL_NATIVE] = &&op_OP_CALL_NATIVE,
+      [OP_TAIL_CALL_CLOSURE_EXACT_ARITY] = &&op_OP_TAIL_CALL_CLOSURE_EXACT_ARITY,
+      [OP_ADD_REG] = &&op_OP_ADD_REG,
+      [OP_SUBTRACT_REG] = &&op_OP_SUBTRACT_REG,
+      [OP_MULTIPLY_REG] = &&op_OP_MULTIPLY_REG,
+      [OP_DIVIDE_REG] = &&op_OP_DIVIDE_REG,
+      [OP_EQV_REG] = &&op_OP_EQV_REG,
+      [OP_MOVE_LOCAL] = &&op_OP_MOVE_LOCAL,
+      [OP_STORE_LOCAL] = &&op_OP_STORE_LOCAL,
+  };
+
+// Jump straight to the next instruction's implementation
+#define VM_DISPATCH() goto *dispatch_table[READ_OPCODE()];
+#define VM_CASE(op) op_##op
+#define VM_DEFAULT() op_unknown
+#define VM_NEXT() VM_DISPATCH()
+#else
+// Fall back to a portable switch inside of the dispatch loop
+#define VM_DISPATCH() switch (READ_OPCODE())
+#define VM_CASE(op) case op
+#define VM_DEFAULT() default
+#define VM_NEXT() continue
+#endif
+
   vm->is_running = true;
+  VM_JIT_ENTER();
 
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
@@ -470,105 +1263,172 @@ InterpretResult mesche_vm_run(VM *vm) {
                         (int)(frame->ip - frame->closure->function->chunk.code));
 #endif
 
-    uint8_t instr;
-    uint8_t offset;
-    Value value;
-    ObjectString *name;
-    uint8_t slot = 0;
-    uint8_t arg_count;
-    Value *prev_stack_top = vm->stack_top;
-
-    switch (instr = READ_BYTE()) {
-    case OP_CONSTANT:
+    VM_DISPATCH() {
+    VM_CASE(OP_CONSTANT) :
       value = READ_CONSTANT();
       mesche_vm_stack_push(vm, value);
-      break;
-    case OP_NIL:
+      VM_NEXT();
+    VM_CASE(OP_NIL) :
       mesche_vm_stack_push(vm, NIL_VAL);
-      break;
-    case OP_T:
+      VM_NEXT();
+    VM_CASE(OP_T) :
       mesche_vm_stack_push(vm, T_VAL);
-      break;
-    case OP_POP:
+      VM_NEXT();
+    VM_CASE(OP_POP) :
       mesche_vm_stack_pop(vm);
-      break;
-    case OP_POP_SCOPE: {
+      VM_NEXT();
+    VM_CASE(OP_POP_SCOPE) : {
       // Only start popping if we have locals to clear
       uint8_t local_count = READ_BYTE();
       if (local_count > 0) {
-        Value result = mesche_vm_stack_pop(vm);
-        for (int i = 0; i < local_count; i++) {
-          mesche_vm_stack_pop(vm);
-        }
-        mesche_vm_stack_push(vm, result);
+        vm->stack_top -= local_count;
+        vm->stack_top[-1] = vm->stack_top[local_count - 1];
       }
-      break;
+      VM_NEXT();
     }
-    case OP_CONS: {
-      Value cdr = mesche_vm_stack_pop(vm);
-      Value car = mesche_vm_stack_pop(vm);
-      mesche_vm_stack_push(vm, OBJECT_VAL(mesche_object_make_cons(vm, car, cdr)));
-      break;
+    VM_CASE(OP_CONS) : {
+      // Leave the operands on the stack until the cons is allocated so that
+      // they can't be collected in the meantime
+      ObjectCons *cons = mesche_object_make_cons(vm, vm_stack_peek(vm, 1), vm_stack_peek(vm, 0));
+      vm->stack_top -= 2;
+      mesche_vm_stack_push(vm, OBJECT_VAL(cons));
+      VM_NEXT();
     }
-    case OP_LIST: {
-      ObjectCons *list = NULL;
+    VM_CASE(OP_LIST) : {
       uint8_t item_count = READ_BYTE();
-      if (item_count == 0) {
-        mesche_vm_stack_push(vm, EMPTY_VAL);
-      } else {
-        // List values will be popped in reverse order, build the
-        // list back to front (great for cons pairs)
-        Value list_value;
-        for (int i = 0; i < item_count; i++) {
-          list_value = mesche_vm_stack_pop(vm);
-          list =
-              mesche_object_make_cons(vm, list_value, list == NULL ? EMPTY_VAL : OBJECT_VAL(list));
-        }
 
-        mesche_vm_stack_push(vm, OBJECT_VAL(list));
+      // Build the list back to front (great for cons pairs) in a slot at the
+      // top of the stack so that the items and the partial list stay
+      // reachable while the cons cells are being allocated
+      mesche_vm_stack_push(vm, EMPTY_VAL);
+      for (int i = 0; i < item_count; i++) {
+        ObjectCons *list = mesche_object_make_cons(vm, vm_stack_peek(vm, i + 1), vm_stack_peek(vm, 0));
+        vm->stack_top[-1] = OBJECT_VAL(list);
       }
-      break;
+
+      value = mesche_vm_stack_pop(vm);
+      vm->stack_top -= item_count;
+      mesche_vm_stack_push(vm, value);
+      VM_NEXT();
     }
-    case OP_ADD:
+    VM_CASE(OP_ADD) :
       BINARY_OP(NUMBER_VAL, IS_NUMBER, AS_NUMBER, +);
-      break;
-    case OP_SUBTRACT:
+      VM_QUICKEN(OP_ADD_NUM, 1);
+      VM_NEXT();
+    VM_CASE(OP_ADD_NUM) :
+      NUMBER_OP(OP_ADD, +);
+      VM_NEXT();
+    VM_CASE(OP_SUBTRACT) :
       BINARY_OP(NUMBER_VAL, IS_NUMBER, AS_NUMBER, -);
-      break;
-    case OP_MULTIPLY:
+      VM_QUICKEN(OP_SUBTRACT_NUM, 1);
+      VM_NEXT();
+    VM_CASE(OP_SUBTRACT_NUM) :
+      NUMBER_OP(OP_SUBTRACT, -);
+      VM_NEXT();
+    VM_CASE(OP_MULTIPLY) :
       BINARY_OP(NUMBER_VAL, IS_NUMBER, AS_NUMBER, *);
-      break;
-    case OP_DIVIDE:
+      VM_QUICKEN(OP_MULTIPLY_NUM, 1);
+      VM_NEXT();
+    VM_CASE(OP_MULTIPLY_NUM) :
+      NUMBER_OP(OP_MULTIPLY, *);
+      VM_NEXT();
+    VM_CASE(OP_DIVIDE) :
       BINARY_OP(NUMBER_VAL, IS_NUMBER, AS_NUMBER, /);
-      break;
-    case OP_AND:
+      VM_QUICKEN(OP_DIVIDE_NUM, 1);
+      VM_NEXT();
+    VM_CASE(OP_DIVIDE_NUM) :
+      NUMBER_OP(OP_DIVIDE, /);
+      VM_NEXT();
+    VM_CASE(OP_ADD_LOCAL_CONSTANT) :
+      LOCAL_CONSTANT_OP(+);
+      VM_NEXT();
+    VM_CASE(OP_SUBTRACT_LOCAL_CONSTANT) :
+      LOCAL_CONSTANT_OP(-);
+      VM_NEXT();
+    VM_CASE(OP_EQV_LOCAL_CONSTANT) : {
+      Value a = frame->slots[READ_BYTE()];
+      mesche_vm_stack_push(vm, BOOL_VAL(mesche_value_equalp(a, READ_CONSTANT())));
+      VM_NEXT();
+    }
+    VM_CASE(OP_ADD_REG) :
+      REG_OP(+);
+      VM_NEXT();
+    VM_CASE(OP_SUBTRACT_REG) :
+      REG_OP(-);
+      VM_NEXT();
+    VM_CASE(OP_MULTIPLY_REG) :
+      REG_OP(*);
+      VM_NEXT();
+    VM_CASE(OP_DIVIDE_REG) :
+      REG_OP(/);
+      VM_NEXT();
+    VM_CASE(OP_EQV_REG) : {
+      uint8_t mode = READ_BYTE();
+      Value a = READ_REG(mode, OP_REG_A_CONSTANT);
+      Value b = READ_REG(mode, OP_REG_B_CONSTANT);
+      mesche_vm_stack_push(vm, BOOL_VAL(mesche_value_equalp(a, b)));
+      VM_NEXT();
+    }
+    VM_CASE(OP_AND) :
       BINARY_OP(BOOL_VAL, IS_ANY, AS_BOOL, &&);
-      break;
-    case OP_OR:
+      VM_NEXT();
+    VM_CASE(OP_OR) :
       BINARY_OP(BOOL_VAL, IS_ANY, AS_BOOL, ||);
-      break;
-    case OP_NOT:
+      VM_NEXT();
+    VM_CASE(OP_NOT) :
       mesche_vm_stack_push(vm, IS_NIL(mesche_vm_stack_pop(vm)) ? T_VAL : NIL_VAL);
-      break;
-    case OP_EQUAL:
+      VM_NEXT();
+    VM_CASE(OP_EQUAL) :
       // Drop through for now
-    case OP_EQV: {
+    VM_CASE(OP_EQV) : {
       Value b = mesche_vm_stack_pop(vm);
       Value a = mesche_vm_stack_pop(vm);
       mesche_vm_stack_push(vm, BOOL_VAL(mesche_value_equalp(a, b)));
-      break;
+      VM_NEXT();
     }
-    case OP_JUMP:
+    VM_CASE(OP_JUMP) :
       offset = READ_SHORT();
       frame->ip += offset;
-      break;
-    case OP_JUMP_IF_FALSE:
+      VM_NEXT();
+    VM_CASE(OP_JUMP_IF_FALSE) :
       offset = READ_SHORT();
       if (IS_FALSEY(vm_stack_peek(vm, 0))) {
         frame->ip += offset;
       }
-      break;
-    case OP_RETURN:
+      VM_NEXT();
+    VM_CASE(OP_LOOP) : {
+      slot = READ_BYTE();
+      uint8_t count = READ_BYTE();
+      offset = READ_SHORT();
+      mesche_vm_loop_store(vm, &frame->slots[slot], count);
+      frame->ip -= offset;
+#ifdef MESCHE_JIT
+      // Each pass through a loop counts towards making its function hot
+      ObjectFunction *function = frame->closure->function;
+      if (function->jit_call_count < vm->jit_threshold &&
+          ++function->jit_call_count == vm->jit_threshold) {
+        mesche_jit_compile(vm, function);
+      }
+      VM_JIT_ENTER();
+#endif
+      VM_NEXT();
+    }
+    VM_CASE(OP_POP_JUMP_IF_FALSE) :
+      offset = READ_SHORT();
+      if (IS_FALSEY(mesche_vm_stack_pop(vm))) {
+        frame->ip += offset;
+      }
+      VM_NEXT();
+    VM_CASE(OP_EQV_JUMP_IF_FALSE) : {
+      offset = READ_SHORT();
+      Value b = mesche_vm_stack_pop(vm);
+      Value a = mesche_vm_stack_pop(vm);
+      if (!mesche_value_equalp(a, b)) {
+        frame->ip += offset;
+      }
+      VM_NEXT();
+    }
+    VM_CASE(OP_RETURN) :
       // Hold on to the function result value before we manipulate the stack
       value = mesche_vm_stack_pop(vm);
       vm->frame_count--;
@@ -585,113 +1445,257 @@ InterpretResult mesche_vm_run(VM *vm) {
         return INTERPRET_OK;
       }
 
-      // Restore the previous module if there is one
-      if (prev_module) {
-        vm->current_module = prev_module;
-        prev_module = NULL;
-      }
-
       // Restore the previous result value, call frame, and value stack pointer
       // before continuing execution
       vm->stack_top = frame->slots;
-      mesche_vm_stack_push(vm, value);
+      if (prev_module && frame->closure->function->type == TYPE_SCRIPT) {
+        // A module's script has finished running, restore the previous module
+        // and import the bindings it defined.  OP_IMPORT_MODULE doesn't produce
+        // a value so the script's result is dropped.
+        vm->current_module = prev_module;
+        prev_module = NULL;
+
+        if (import_module) {
+          mesche_module_import(vm, vm->current_module, import_module);
+          import_module = NULL;
+        }
+      } else {
+        mesche_vm_stack_push(vm, value);
+      }
       frame = &vm->frames[vm->frame_count - 1];
-      break;
-    case OP_DISPLAY:
+      VM_JIT_ENTER();
+      VM_NEXT();
+    VM_CASE(OP_DISPLAY) :
       // Peek at the value on the stack
       mesche_value_print(vm_stack_peek(vm, 0));
-      break;
-    case OP_DEFINE_MODULE: {
-      ObjectCons *list = AS_CONS(mesche_vm_stack_pop(vm));
+      VM_NEXT();
+    VM_CASE(OP_DEFINE_MODULE) : {
+      // The module path stays on the stack until the module is resolved
+      ObjectCons *list = AS_CONS(vm_stack_peek(vm, 0));
       mesche_module_enter_path(vm, list);
-      mesche_vm_stack_push(vm, OBJECT_VAL(vm->current_module));
-      break;
+      vm->stack_top[-1] = OBJECT_VAL(vm->current_module);
+      VM_NEXT();
     }
-    case OP_IMPORT_MODULE: {
+    VM_CASE(OP_IMPORT_MODULE) : {
       // Hold on to the current module so that we can return to it later
       prev_module = vm->current_module;
 
-      ObjectCons *list = AS_CONS(mesche_vm_stack_pop(vm));
-      Value *stack_top = vm->stack_top;
-      mesche_module_import_path(vm, list);
-      if (vm->stack_top > stack_top && IS_CLOSURE(vm_stack_peek(vm, 0))) {
-        ObjectClosure *closure = AS_CLOSURE(vm_stack_peek(vm, 0));
-        if (closure->function->type == TYPE_SCRIPT) {
-          // Call the script
-          vm_call(vm, closure, 0);
-          frame = &vm->frames[vm->frame_count - 1];
-        }
+      ObjectCons *list = AS_CONS(vm_stack_peek(vm, 0));
+      int stack_count = vm->stack_top - vm->stack;
+      ObjectModule *module = mesche_module_resolve_by_path(vm, list);
+      if (vm->stack_top - vm->stack > stack_count && IS_CLOSURE(vm_stack_peek(vm, 0)) &&
+          AS_CLOSURE(vm_stack_peek(vm, 0))->function->type == TYPE_SCRIPT) {
+        // Drop the module path from beneath the script closure
+        vm->stack_top[-2] = vm->stack_top[-1];
+        vm->stack_top--;
+
+        // Call the script, its bindings will be imported when it returns
+        import_module = module;
+        vm_call(vm, AS_CLOSURE(vm_stack_peek(vm, 0)), 0);
+        frame = &vm->frames[vm->frame_count - 1];
+        VM_JIT_ENTER();
       } else {
+        // The module is already loaded so import its bindings now
+        mesche_vm_stack_pop(vm);
+        mesche_module_import(vm, vm->current_module, module);
+
         // Reset the module now so we don't run into trouble later
         prev_module = NULL;
       }
-      break;
+      VM_NEXT();
     }
-    case OP_ENTER_MODULE: {
-      ObjectCons *list = AS_CONS(mesche_vm_stack_pop(vm));
+    VM_CASE(OP_ENTER_MODULE) : {
+      ObjectCons *list = AS_CONS(vm_stack_peek(vm, 0));
       mesche_module_enter_path(vm, list);
-      mesche_vm_stack_push(vm, OBJECT_VAL(vm->current_module));
-      break;
+      vm->stack_top[-1] = OBJECT_VAL(vm->current_module);
+      VM_NEXT();
     }
-    case OP_EXPORT_SYMBOL:
+    VM_CASE(OP_EXPORT_SYMBOL) :
       name = READ_STRING();
       // TODO: Convert the local value for this binding to an ObjectExport
       mesche_value_array_write((MescheMemory *)vm, &vm->current_module->exports, OBJECT_VAL(name));
-      break;
-    case OP_DEFINE_GLOBAL:
-      name = READ_STRING();
-      mesche_table_set((MescheMemory *)vm, &vm->current_module->locals, name, vm_stack_peek(vm, 0));
-      break;
-    case OP_READ_GLOBAL:
+      mesche_object_write_barrier(vm, (Object *)vm->current_module, OBJECT_VAL(name));
+      VM_NEXT();
+    VM_CASE(OP_DEFINE_GLOBAL) :
       name = READ_STRING();
-      Table *globals =
-          frame->closure->module ? &frame->closure->module->locals : &vm->current_module->locals;
-      if (!mesche_table_get(globals, name, &value)) {
-        vm_runtime_error(vm, "Undefined variable '%s'.", name->chars);
+      mesche_module_define(vm, vm->current_module, name, vm_stack_peek(vm, 0));
+      VM_NEXT();
+    VM_CASE(OP_READ_GLOBAL) : {
+      GlobalCache *cache = vm_global_cache_resolve(vm, frame, READ_BYTE());
+      if (cache == NULL) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      mesche_vm_stack_push(vm, value);
-      break;
-    case OP_READ_UPVALUE:
+      mesche_vm_stack_push(vm, cache->binding->value);
+      VM_NEXT();
+    }
+    VM_CASE(OP_READ_UPVALUE) :
       // TODO: The problem here is that the local is no longer on the stack!
       // I'm using POP_SCOPE to get rid of all the locals but maybe the pointer
       // no longer works?  It's pointing to the location of the result of the function
       slot = READ_BYTE();
       mesche_vm_stack_push(vm, *frame->closure->upvalues[slot]->location);
-      break;
-    case OP_READ_LOCAL:
+      VM_NEXT();
+    VM_CASE(OP_READ_LOCAL) :
       slot = READ_BYTE();
       mesche_vm_stack_push(vm, frame->slots[slot]);
-      break;
-    case OP_SET_GLOBAL: {
-      name = READ_STRING();
-      Table *globals =
-          frame->closure->module ? &frame->closure->module->locals : &vm->current_module->locals;
-      if (mesche_table_set((MescheMemory *)vm, globals, name, vm_stack_peek(vm, 0))) {
-        vm_runtime_error(vm, "Undefined variable '%s'.", name->chars);
+      VM_NEXT();
+    VM_CASE(OP_SET_GLOBAL) : {
+      GlobalCache *cache = vm_global_cache_resolve(vm, frame, READ_BYTE());
+      if (cache == NULL) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      cache->binding->value = vm_stack_peek(vm, 0);
+      mesche_object_write_barrier(vm, (Object *)cache->binding, cache->binding->value);
+      VM_NEXT();
     }
-    case OP_SET_UPVALUE:
+    VM_CASE(OP_SET_UPVALUE) : {
       slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = vm_stack_peek(vm, 0);
-      break;
-    case OP_SET_LOCAL:
+      ObjectUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = vm_stack_peek(vm, 0);
+      mesche_object_write_barrier(vm, (Object *)upvalue, *upvalue->location);
+      VM_NEXT();
+    }
+    VM_CASE(OP_SET_LOCAL) :
       slot = READ_BYTE();
       frame->slots[slot] = vm_stack_peek(vm, 0);
-      break;
-    case OP_CALL:
+      VM_NEXT();
+    VM_CASE(OP_STORE_LOCAL) :
+      slot = READ_BYTE();
+      frame->slots[slot] = *--vm->stack_top;
+      VM_NEXT();
+    VM_CASE(OP_MOVE_LOCAL) :
+      slot = READ_BYTE();
+      frame->slots[slot] = frame->slots[READ_BYTE()];
+      VM_NEXT();
+    VM_CASE(OP_CALL) :
       // Call the function with the specified number of arguments
       arg_count = READ_BYTE();
-      if (!vm_call_value(vm, vm_stack_peek(vm, arg_count), arg_count)) {
+      value = vm_stack_peek(vm, arg_count);
+      if (vm_call_is_exact(value, arg_count)) {
+        VM_QUICKEN(OP_CALL_CLOSURE_EXACT_ARITY, 2);
+      } else if (IS_NATIVE_FUNC(value)) {
+        VM_QUICKEN(OP_CALL_NATIVE, 2);
+      }
+
+      if (!vm_call_value(vm, value, arg_count)) {
         return INTERPRET_COMPILE_ERROR;
       }
 
       // Set the current frame to the new call frame
       frame = &vm->frames[vm->frame_count - 1];
-      break;
-    case OP_CLOSURE: {
+      VM_JIT_ENTER();
+      VM_NEXT();
+    VM_CASE(OP_CALL_CLOSURE_EXACT_ARITY) :
+      arg_count = READ_BYTE();
+      value = vm_stack_peek(vm, arg_count);
+      if (!vm_call_is_exact(value, arg_count)) {
+        VM_DEQUICKEN(OP_CALL, 2);
+      }
+
+      if (!vm_stack_reserve(vm, UINT8_COUNT) ||
+          !vm_call_frame(vm, AS_CLOSURE(value), vm->stack_top - arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      frame = &vm->frames[vm->frame_count - 1];
+      VM_JIT_ENTER();
+      VM_NEXT();
+    VM_CASE(OP_CALL_NATIVE) :
+      arg_count = READ_BYTE();
+      value = vm_stack_peek(vm, arg_count);
+      if (!IS_NATIVE_FUNC(value)) {
+        VM_DEQUICKEN(OP_CALL, 2);
+      }
+
+      if (!vm_call_native(vm, (ObjectNativeFunction *)AS_OBJECT(value), arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      // The native may have run code in new frames of its own
+      frame = &vm->frames[vm->frame_count - 1];
+      VM_JIT_ENTER();
+      VM_NEXT();
+    VM_CASE(OP_CALL_KEYWORDS) : {
+      // Call the function with the specified number of arguments, the last of
+      // which are keyword and value pairs
+      arg_count = READ_BYTE();
+      uint8_t keyword_count = READ_BYTE();
+      KeywordCallCache *cache = &frame->closure->function->chunk.keyword_caches[READ_SHORT()];
+      value = vm_stack_peek(vm, arg_count);
+      if (IS_CLOSURE(value)) {
+        if (!vm_call_keywords(vm, AS_CLOSURE(value), arg_count, keyword_count, cache)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+      } else if (!vm_call_value(vm, value, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      // Set the current frame to the new call frame
+      frame = &vm->frames[vm->frame_count - 1];
+      VM_JIT_ENTER();
+      VM_NEXT();
+    }
+    VM_CASE(OP_TAIL_CALL) : {
+      // Natives return straight away, only collapse the frame if a closure
+      // was called
+      int frame_count = vm->frame_count;
+      arg_count = READ_BYTE();
+      value = vm_stack_peek(vm, arg_count);
+      if (vm_call_is_exact(value, arg_count)) {
+        VM_QUICKEN(OP_TAIL_CALL_CLOSURE_EXACT_ARITY, 2);
+      }
+
+      if (!vm_call_value(vm, value, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      if (vm->frame_count > frame_count) {
+        vm_frame_collapse(vm);
+      }
+
+      frame = &vm->frames[vm->frame_count - 1];
+      VM_JIT_ENTER();
+      VM_NEXT();
+    }
+    VM_CASE(OP_TAIL_CALL_CLOSURE_EXACT_ARITY) :
+      arg_count = READ_BYTE();
+      value = vm_stack_peek(vm, arg_count);
+      if (!vm_call_is_exact(value, arg_count)) {
+        VM_DEQUICKEN(OP_TAIL_CALL, 2);
+      }
+
+      if (!vm_stack_reserve(vm, UINT8_COUNT) ||
+          !vm_call_frame(vm, AS_CLOSURE(value), vm->stack_top - arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      vm_frame_collapse(vm);
+      frame = &vm->frames[vm->frame_count - 1];
+      VM_JIT_ENTER();
+      VM_NEXT();
+    VM_CASE(OP_TAIL_CALL_KEYWORDS) : {
+      int frame_count = vm->frame_count;
+      arg_count = READ_BYTE();
+      uint8_t keyword_count = READ_BYTE();
+      KeywordCallCache *cache = &frame->closure->function->chunk.keyword_caches[READ_SHORT()];
+      value = vm_stack_peek(vm, arg_count);
+      if (IS_CLOSURE(value)) {
+        if (!vm_call_keywords(vm, AS_CLOSURE(value), arg_count, keyword_count, cache)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+      } else if (!vm_call_value(vm, value, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      if (vm->frame_count > frame_count) {
+        vm_frame_collapse(vm);
+      }
+
+      frame = &vm->frames[vm->frame_count - 1];
+      VM_JIT_ENTER();
+      VM_NEXT();
+    }
+    VM_CASE(OP_CLOSURE) : {
       ObjectFunction *function = AS_FUNCTION(READ_CONSTANT());
       ObjectClosure *closure = mesche_object_make_closure(vm, function, vm->current_module);
       mesche_vm_stack_push(vm, OBJECT_VAL(closure));
@@ -709,9 +1713,11 @@ InterpretResult mesche_vm_run(VM *vm) {
         }
       }
 
-      break;
+      mesche_object_write_barrier_all(vm, (Object *)closure);
+
+      VM_NEXT();
     }
-    case OP_CLOSE_UPVALUE:
+    VM_CASE(OP_CLOSE_UPVALUE) : {
       // NOTE: This opcode gets issued when a scope block is ending (usually
       // from a `let` or `begin` expression with multiple body expressions)
       // so skip the topmost value on the stack (the last expression result)
@@ -723,18 +1729,12 @@ InterpretResult mesche_vm_run(VM *vm) {
       mesche_vm_stack_pop(vm);
       mesche_vm_stack_push(vm, result);
 
-      break;
+      VM_NEXT();
+    }
+    VM_DEFAULT() :
+      vm_runtime_error(vm, "Unknown opcode %d.", frame->ip[-1]);
+      return INTERPRET_RUNTIME_ERROR;
     }
-
-    // For now, we enforce that all instructions except OP_POP should produce
-    // (or leave) a value on the stack so that we can be consistent with how
-    // expressions are popped in blocks when their values aren't consumed.
-    // TODO: Rethink this check, it doesn't work for binary operations which
-    // pop 2 values from the stack
-    /* if (instr != OP_POP && vm->stack_top < prev_stack_top) { */
-    /*   PANIC("Instruction \"%d\" consumed a stack value! (before: %x, after: %x)\n", instr,
-     * prev_stack_top, vm->stack_top); */
-    /* } */
   }
 
   vm->is_running = false;
@@ -742,8 +1742,20 @@ InterpretResult mesche_vm_run(VM *vm) {
 #undef READ_STRING
 #undef READ_SHORT
 #undef READ_BYTE
+#undef READ_OPCODE
 #undef READ_CONSTANT
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef VM_DEQUICKEN
+#undef VM_QUICKEN
+#undef VM_JIT_ENTER
+#undef LOCAL_CONSTANT_OP
+#undef READ_REG
+#undef REG_OP
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef VM_DEFAULT
+#undef VM_NEXT
 }
 
 static Value mesche_vm_clock_native(int arg_count, Value *args) {
@@ -755,10 +1767,13 @@ void mesche_vm_define_native(VM *vm, const char *name, FunctionPtr function, boo
   ObjectString *func_name = mesche_object_make_string(vm, name, (int)strlen(name));
   mesche_vm_stack_push(vm, OBJECT_VAL(func_name));
   mesche_vm_stack_push(vm, OBJECT_VAL(mesche_object_make_native_function(vm, function)));
+#ifdef MESCHE_OPCODE_STATS
+  mesche_opstats_native_define(vm, function, name);
+#endif
 
-  // Add the item to the table and possibly the export list
-  mesche_table_set((MescheMemory *)vm, &vm->current_module->locals, AS_STRING(*(vm->stack_top - 2)),
-                   *(vm->stack_top - 1));
+  // Bind the function in the module and possibly add it to the export list
+  mesche_module_define(vm, vm->current_module, AS_STRING(*(vm->stack_top - 2)),
+                       *(vm->stack_top - 1));
   if (exported) {
     mesche_value_array_write((MescheMemory *)vm, &vm->current_module->exports,
                              OBJECT_VAL(func_name));
@@ -772,16 +1787,13 @@ void mesche_vm_define_native(VM *vm, const char *name, FunctionPtr function, boo
 void mesche_vm_load_path_add(VM *vm, const char *load_path) {
   char *resolved_path = mesche_fs_resolve_path(load_path);
   ObjectString *path_str = mesche_object_make_string(vm, resolved_path, strlen(resolved_path));
+  mesche_vm_stack_push(vm, OBJECT_VAL(path_str));
   vm->load_paths = mesche_list_push(vm, vm->load_paths, OBJECT_VAL(path_str));
+  mesche_vm_stack_pop(vm);
   free(resolved_path);
 }
 
-InterpretResult mesche_vm_eval_string(VM *vm, const char *script_string) {
-  ObjectFunction *function = mesche_compile_source(vm, script_string);
-  if (function == NULL) {
-    return INTERPRET_COMPILE_ERROR;
-  }
-
+static InterpretResult vm_run_function(VM *vm, ObjectFunction *function) {
   // Push the top-level function as a closure
   mesche_vm_stack_push(vm, OBJECT_VAL(function));
   ObjectClosure *closure = mesche_object_make_closure(vm, function, NULL);
@@ -795,14 +1807,39 @@ InterpretResult mesche_vm_eval_string(VM *vm, const char *script_string) {
   return mesche_vm_run(vm);
 }
 
-InterpretResult mesche_vm_load_module(VM *vm, const char *module_path) {
-  char *source = mesche_fs_file_read_all(module_path);
+InterpretResult mesche_vm_eval_string(VM *vm, const char *script_string) {
+  ObjectFunction *function = mesche_compile_source(vm, script_string);
+  if (function == NULL) {
+    return INTERPRET_COMPILE_ERROR;
+  }
+
+  return vm_run_function(vm, function);
+}
+
+static ObjectFunction *vm_compile_file(VM *vm, const char *file_path) {
+  // Skip the compiler when the file's bytecode cache is still valid
+  ObjectFunction *function = mesche_cache_load(vm, file_path);
+  if (function != NULL) {
+    return function;
+  }
+
+  char *source = mesche_fs_file_read_all(file_path);
   if (source == NULL) {
     // TODO: Report and fail gracefully
-    PANIC("ERROR: Could not load script file: %s\n\n", module_path);
+    PANIC("ERROR: Could not load script file: %s\n\n", file_path);
   }
 
-  ObjectFunction *function = mesche_compile_source(vm, source);
+  function = mesche_compile_source(vm, source);
+  if (function != NULL) {
+    mesche_cache_write(vm, function, file_path, source);
+  }
+
+  free(source);
+  return function;
+}
+
+InterpretResult mesche_vm_load_module(VM *vm, const char *module_path) {
+  ObjectFunction *function = vm_compile_file(vm, module_path);
   if (function == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
@@ -823,15 +1860,10 @@ InterpretResult mesche_vm_load_module(VM *vm, const char *module_path) {
 }
 
 InterpretResult mesche_vm_load_file(VM *vm, const char *file_path) {
-  char *source = mesche_fs_file_read_all(file_path);
-  if (source == NULL) {
-    // TODO: Report and fail gracefully
-    PANIC("ERROR: Could not load script file: %s\n\n", file_path);
+  ObjectFunction *function = vm_compile_file(vm, file_path);
+  if (function == NULL) {
+    return INTERPRET_COMPILE_ERROR;
   }
 
-  // Eval the script and then free the source string
-  InterpretResult result = mesche_vm_eval_string(vm, source);
-  free(source);
-
-  return result;
+  return vm_run_function(vm, function);
 }
@@ -8,8 +8,13 @@
 #include "value.h"
 
 #define UINT8_COUNT (UINT8_MAX + 1)
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+
+// The value stack and call frames start small and grow as calls get deeper.
+// Going past either limit is reported as a stack overflow.
+#define FRAMES_INITIAL 8
+#define FRAMES_MAX 65536
+#define STACK_INITIAL UINT8_COUNT
+#define STACK_MAX (1 << 20)
 
 typedef Value (*FunctionPtr)(MescheMemory *mem, int arg_count, Value *args);
 
@@ -21,20 +26,32 @@ typedef struct {
 
 typedef struct {
   MescheMemory mem;
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;
   int frame_count;
-  Value stack[STACK_MAX]; // TODO: Make this dynamically resizable
+  int frame_capacity;
+  Value *stack;
   Value *stack_top;
+  int stack_capacity;
   Table strings;
   Table symbols;
+  Table keywords;
 
   Table modules;
   ObjectModule *root_module;
+
+  // Compile code to register instructions which read locals and constants in
+  // place instead of pushing them first, set before loading any code
+  bool use_register_ops;
+
   ObjectModule *current_module;
   ObjectCons *load_paths;
 
   ObjectUpvalue *open_upvalues;
-  Object *objects;
+
+  // Where an incremental collection continues sweeping the memory pools
+  int sweep_pool;
+  MeschePoolPage *sweep_page;
+  MescheLargeCell *sweep_large_cells;
 
   // An opaque pointer to the current compiler to avoid cyclic type dependencies.
   // Used for calling the compiler's root marking function
@@ -44,6 +61,29 @@ typedef struct {
   int gray_count;
   int gray_capacity;
   Object **gray_stack;
+  bool gc_is_minor;
+  bool gc_is_remark;
+
+  // The sampling profiler while one has been started
+  struct MescheProfiler *profiler;
+
+#ifdef MESCHE_OPCODE_STATS
+  // Instruction and call counts which are written out when the VM is freed
+  struct MescheOpStats *opstats;
+#endif
+
+#ifdef MESCHE_JIT
+  // How many calls it takes before a function is compiled to native code
+  int jit_threshold;
+
+  // How many calls native code has made without returning to the interpreter
+  int jit_depth;
+#endif
+
+  // Old objects which may hold references to young objects
+  int remembered_count;
+  int remembered_capacity;
+  Object **remembered;
 
   // An application-specific context object
   void *app_context;
@@ -66,8 +106,16 @@ InterpretResult mesche_vm_load_file(VM *vm, const char *file_path);
 InterpretResult mesche_vm_load_module(VM *vm, const char *module_path);
 void mesche_vm_stack_push(VM *vm, Value value);
 Value mesche_vm_stack_pop(VM *vm);
+void mesche_vm_loop_store(VM *vm, Value *loop_slots, int count);
+#ifdef MESCHE_JIT
+bool mesche_vm_jit_call(VM *vm, ObjectClosure *closure, uint8_t arg_count);
+void mesche_vm_jit_return(VM *vm);
+#endif
 void mesche_vm_define_native(VM *vm, const char *name, FunctionPtr function, bool exported);
 void mesche_mem_mark_object(VM *vm, Object *object);
+void mesche_mem_mark_root(VM *vm, Object *object);
+void mesche_mem_remember(VM *vm, Object *object);
+void mesche_mem_retrace(VM *vm, Object *object);
 void mesche_vm_load_path_add(VM *vm, const char *load_path);
 
 #endif
@@ -8,6 +8,7 @@
 
 int main(int argc, char **argv) {
   bool use_repl = false;
+  bool use_profiler = false;
   const char *script_path = NULL;
 
   // Check program arguments
@@ -15,13 +16,15 @@ int main(int argc, char **argv) {
     for (int i = 1; i < argc; i++) {
       if (strcmp(argv[i], "--repl") == 0) {
         use_repl = true;
+      } else if (strcmp(argv[i], "--profile") == 0) {
+        use_profiler = true;
       } else {
         // Treat it as a file path
-        script_path = argv[1];
+        script_path = argv[i];
       }
     }
   } else {
-    printf("\nFlux Compose\n\n  Usage: flux-compose <--repl | path/to/file.fxs>\n\n");
+    printf("\nFlux Compose\n\n  Usage: flux-compose [--profile] <--repl | path/to/file.fxs>\n\n");
     exit(0);
   }
 
@@ -58,6 +61,11 @@ int main(int argc, char **argv) {
     flux_graphics_window_show(window);
   }
 
+  if (use_profiler) {
+    // Sample the scripts from the start, the profile is written out on exit
+    mesche_profile_start(&vm, PROFILE_DEFAULT_INTERVAL_US);
+  }
+
   if (script_path != NULL) {
     // Evaluate the script before starting the renderer
     mesche_vm_load_file(&vm, script_path);
@@ -67,6 +75,14 @@ int main(int argc, char **argv) {
   // Start the render loop
   flux_graphics_loop_start(window, repl);
 
+  if (use_profiler) {
+    mesche_profile_stop(&vm);
+    mesche_profile_print_report(&vm, stdout, 20);
+    if (mesche_profile_write_folded(&vm, "flux-compose.folded")) {
+      printf("-- Folded stacks for flamegraph.pl written to flux-compose.folded\n");
+    }
+  }
+
   // Report the final memory allocation statistics
   mesche_mem_report((MescheMemory *)&vm);
 